@@ -0,0 +1,156 @@
+/*
+ * BatchTest.cc
+ *
+ *  Checks batched calls against the local mock Drive server: every answer
+ *  must land on the call it belongs to whatever order the server sends them
+ *  in, with its own status code, 100 calls at most per round trip. The
+ *  client's own messages are silenced unless --verbose is given.
+ *  Exits with 0 when every check passes.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <unistd.h>
+#include <curl/curl.h>
+#include "GDConnect.h"
+#include "MockDrive.h"
+
+static std::vector<std::string> failures;
+
+static void check(bool ok, const std::string& what)
+{
+    if (!ok)
+        failures.push_back(what);
+}
+
+static std::size_t collect(char * data, std::size_t size, std::size_t nmemb, void * buffer)
+{
+    static_cast<std::string*>(buffer)->append(data, size * nmemb);
+    return size * nmemb;
+}
+
+/* Posts a hand-made batch of count metadata calls, returns the HTTP code of the batch */
+static long rawBatch(const std::string& url, const std::string& id, std::size_t count)
+{
+    const std::string boundary = "raw_batch";
+    std::string body;
+    for (std::size_t i = 0; i < count; i++)
+        body += "--" + boundary + "\r\nContent-Type: application/http\r\nContent-ID: <item"
+                + std::to_string((unsigned long long) i) + ">\r\n\r\nGET /drive/v3/files/" + id + "\r\n\r\n";
+    body += "--" + boundary + "--\r\n";
+
+    std::string response;
+    long code = -1;
+    CURL * curl = curl_easy_init();
+    struct curl_slist * headers = NULL;
+    headers = curl_slist_append(headers, ("Content-Type: multipart/mixed; boundary=" + boundary).c_str());
+    headers = curl_slist_append(headers, "Authorization: Bearer raw");
+    curl_easy_setopt(curl, CURLOPT_URL, (url + "/batch/drive/v3").c_str());
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.c_str());
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long) body.size());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, collect);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+    if (curl_easy_perform(curl) == CURLE_OK)
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+    curl_slist_free_all(headers);
+    curl_easy_cleanup(curl);
+    return code;
+}
+
+int main(int argc, char* argv[])
+{
+    bool verbose = argc > 1 && !strcmp(argv[1], "--verbose");
+    MockOptions options;
+    MockDrive mock(options);
+    if (!mock.start())
+        return 1;
+    const std::string url = mock.url();
+
+    char workDir[] = "/tmp/gdbatch.XXXXXX";
+    if (!mkdtemp(workDir) || chdir(workDir) != 0 || !MockDrive::writeCredentials(url))
+    {
+        std::cerr << "Unable to prepare a working directory" << std::endl;
+        return 1;
+    }
+    int saved[2];
+    if (!verbose)
+        silence(true, saved);
+    GDConnect drive("config.json");
+    if (drive.init("config.json") || !drive.valid())
+    {
+        if (!verbose)
+            silence(false, saved);
+        std::cerr << "Unable to authenticate against " << url << std::endl;
+        return 1;
+    }
+
+    // 250 calls: existing files interleaved with unknown ids, three batches
+    std::vector<std::string> ids;
+    std::vector<std::string> names;
+    for (std::size_t i = 0; i < 250; i++)
+    {
+        std::string name = "batch-" + std::to_string((unsigned long long) i);
+        if (i % 3 == 2)
+        {
+            ids.push_back("missing-" + std::to_string((unsigned long long) i));
+            names.push_back("");
+            continue;
+        }
+        std::pair<std::string, int> up = drive.putBuffer(name.c_str(), name.data(), name.size());
+        check(up.second == 0 && !up.first.empty(), "upload of " + name);
+        ids.push_back(up.first);
+        names.push_back(name);
+    }
+
+    unsigned long long before = mock.requests();
+    std::vector<BatchResult> results = drive.batchGetMetadata(ids);
+    check(mock.requests() - before == 3, "250 metadata calls take 3 round trips, took "
+          + std::to_string(mock.requests() - before));
+    check(results.size() == ids.size(), "one metadata result per call");
+    for (std::size_t i = 0; i < results.size(); i++)
+    {
+        const std::string which = "metadata call " + std::to_string((unsigned long long) i);
+        if (names[i].empty())
+        {
+            check(results[i].code == 404, which + " is 404, got " + std::to_string((long long) results[i].code));
+            check(results[i].body["error"]["code"].asInt() == 404, which + " carries its error body");
+        }
+        else
+        {
+            check(results[i].code == 200, which + " is 200, got " + std::to_string((long long) results[i].code));
+            check(results[i].body["id"].asString() == ids[i], which + " answers for its own id");
+            check(results[i].body["name"].asString() == names[i], which + " answers with its own name");
+        }
+    }
+
+    // deletes of the first 120 calls, then the same ids again: 204 once, 404 afterwards
+    std::vector<std::string> doomed(ids.begin(), ids.begin() + 120);
+    before = mock.requests();
+    results = drive.batchDelete(doomed);
+    check(mock.requests() - before == 2, "120 deletes take 2 round trips");
+    for (std::size_t i = 0; i < results.size(); i++)
+        check(results[i].code == (names[i].empty() ? 404 : 204),
+              "delete call " + std::to_string((unsigned long long) i) + " got " + std::to_string((long long) results[i].code));
+    results = drive.batchGetMetadata(doomed);
+    for (std::size_t i = 0; i < results.size(); i++)
+        check(results[i].code == 404, "deleted file " + std::to_string((unsigned long long) i) + " is gone");
+
+    // the server takes 100 calls and refuses 101
+    check(rawBatch(url, ids[200], 100) == 200, "a batch of 100 calls is accepted");
+    check(rawBatch(url, ids[200], 101) == 400, "a batch of 101 calls is refused");
+
+    if (!verbose)
+        silence(false, saved);
+    mock.stop();
+    for (std::size_t i = 0; i < failures.size() && i < 20; i++)
+        std::cout << "FAIL: " << failures[i] << std::endl;
+    std::cout << (failures.empty() ? std::string("Batch test passed")
+                                   : "Batch test failed: " + std::to_string((unsigned long long) failures.size()) + " checks")
+              << std::endl;
+    return failures.empty() ? 0 : 1;
+}
@@ -0,0 +1,308 @@
+/*
+ * Bench.cc
+ *
+ *  Benchmark of GDConnect against the local mock Drive server.
+ *  Each operation is timed call by call and reported as ops/sec,
+ *  p50/p99 latency and MB/s, so regressions show up as numbers.
+ *  The client's own progress output is silenced while timing.
+ *  --tls puts the mock behind HTTPS and --no-reuse gives every request a
+ *  handle and connection of its own, to measure what the handshakes cost.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+#include <unistd.h>
+#include "GDConnect.h"
+#include "MockDrive.h"
+#include "RemoteFile.h"
+
+/* Timings of one operation */
+struct Measure {
+	std::string name;
+	std::vector<double> latencies;  // seconds per call
+	unsigned long long bytes;
+	std::size_t failed;
+	double seconds;                 // wall-clock time for all calls
+};
+
+/* Runs op count times; op returns the bytes it moved, or -1 on failure */
+static Measure run(const char * name, std::size_t count, bool verbose, std::function<long long(std::size_t)> op)
+{
+    Measure m;
+    m.name = name;
+    m.bytes = 0;
+    m.failed = 0;
+    int saved[2];
+    if (!verbose)
+        silence(true, saved);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < count; i++)
+    {
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        long long bytes = op(i);
+        m.latencies.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count());
+        if (bytes < 0)
+            m.failed++;
+        else
+            m.bytes += bytes;
+    }
+    m.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (!verbose)
+        silence(false, saved);
+    return m;
+}
+
+static double percentile(std::vector<double> values, double p)
+{
+    if (values.empty())
+        return 0;
+    std::sort(values.begin(), values.end());
+    std::size_t rank = (std::size_t) (p * (values.size() - 1) + 0.5);
+    return values[rank];
+}
+
+static void report(const std::vector<Measure>& measures)
+{
+    printf("%-26s %7s %7s %10s %10s %10s %9s\n", "operation", "ops", "failed", "ops/sec", "p50 ms", "p99 ms", "MB/s");
+    for (std::size_t i = 0; i < measures.size(); i++)
+    {
+        const Measure& m = measures[i];
+        double seconds = m.seconds > 0 ? m.seconds : 1e-9;
+        printf("%-26s %7zu %7zu %10.1f %10.3f %10.3f %9.2f\n", m.name.c_str(), m.latencies.size(), m.failed,
+               m.latencies.size() / seconds, percentile(m.latencies, 0.5) * 1e3, percentile(m.latencies, 0.99) * 1e3,
+               m.bytes / seconds / 1e6);
+    }
+}
+
+static void usage()
+{
+    std::cout << "Usage: Bench [--ops n] [--small bytes] [--large bytes] [--latency ms] [--bandwidth bytes/s]"
+              << " [--errors rate] [--error-code code] [--rate requests/s] [--url mock-url]"
+              << " [--metrics prometheus-file] [--trace chrome-trace-file] [--tls] [--no-reuse] [--verbose]" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    MockOptions options;
+    std::size_t ops = 200;
+    std::size_t smallSize = 4 << 10;
+    std::size_t largeSize = 32 << 20;
+    double rate = 0;    // the client's request rate limit; none by default, to time the client itself
+    std::string url;
+    std::string metricsFile;
+    std::string traceFile;
+    bool verbose = false;
+    bool reuse = true;     // pooled handles and kept-alive connections; off to time a fresh handshake per request
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--verbose") || !strcmp(argv[i], "--tls") || !strcmp(argv[i], "--no-reuse"))
+        {
+            verbose = verbose || !strcmp(argv[i], "--verbose");
+            options.tls = options.tls || !strcmp(argv[i], "--tls");
+            reuse = reuse && strcmp(argv[i], "--no-reuse");
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            usage();
+            return 1;
+        }
+        const char * value = argv[++i];
+        if (!strcmp(argv[i - 1], "--ops"))
+            ops = std::max(1, atoi(value));
+        else if (!strcmp(argv[i - 1], "--small"))
+            smallSize = strtoull(value, NULL, 10);
+        else if (!strcmp(argv[i - 1], "--large"))
+            largeSize = strtoull(value, NULL, 10);
+        else if (!strcmp(argv[i - 1], "--latency"))
+            options.latencyMs = atoi(value);
+        else if (!strcmp(argv[i - 1], "--bandwidth"))
+            options.bandwidth = atof(value);
+        else if (!strcmp(argv[i - 1], "--errors"))
+            options.errorRate = atof(value);
+        else if (!strcmp(argv[i - 1], "--error-code"))
+            options.errorCode = atoi(value);
+        else if (!strcmp(argv[i - 1], "--rate"))
+            rate = atof(value);
+        else if (!strcmp(argv[i - 1], "--url"))
+            url = value;
+        else if (!strcmp(argv[i - 1], "--metrics"))
+            metricsFile = value;
+        else if (!strcmp(argv[i - 1], "--trace"))
+            traceFile = value;
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    MockDrive mock(options);
+    bool local = url.empty();
+    if (local)
+    {
+        if (!mock.start())
+            return 1;
+        url = mock.url();
+    }
+
+    // output paths are taken before moving to the working directory
+    char * resolved;
+    if (!metricsFile.empty() && metricsFile[0] != '/' && (resolved = getcwd(NULL, 0)))
+    {
+        metricsFile = std::string(resolved) + "/" + metricsFile;
+        free(resolved);
+    }
+    if (!traceFile.empty() && traceFile[0] != '/' && (resolved = getcwd(NULL, 0)))
+    {
+        traceFile = std::string(resolved) + "/" + traceFile;
+        free(resolved);
+    }
+
+    // the client keeps its token and upload sessions in the working directory
+    char workDir[] = "/tmp/gdbench.XXXXXX";
+    if (!mkdtemp(workDir) || chdir(workDir) != 0 || !MockDrive::writeCredentials(url))
+    {
+        std::cerr << "Unable to prepare a working directory" << std::endl;
+        return 1;
+    }
+    std::cout << "Benchmarking against " << url << " from " << workDir
+              << (reuse ? ", reusing connections" : ", a new connection per request") << std::endl;
+
+    GDConnect drive("config.json");
+    drive.setConnectionReuse(reuse);
+    if (local && options.tls)
+    {
+        // the mock's certificate is self-signed: trust it, and nothing else
+        std::ofstream certificate("mock-ca.pem");
+        certificate << mock.certificate();
+        certificate.close();
+        drive.setCACertificates("mock-ca.pem");
+    }
+    int saved[2];
+    if (!verbose)
+        silence(true, saved);
+    int err = drive.init("config.json");
+    if (!verbose)
+        silence(false, saved);
+    if (err || !drive.valid())
+    {
+        std::cerr << "Unable to authenticate against " << url << std::endl;
+        return 1;
+    }
+
+    drive.setRequestRate(rate);
+    if (!traceFile.empty())
+        drive.getMetrics().setTracing(true);
+
+    std::string smallData(smallSize, 'x');
+    std::string largeData(largeSize, '\0');
+    for (std::size_t i = 0; i < largeData.size(); i++)
+        largeData[i] = (char) (i * 2654435761u >> 13);
+    std::size_t largeOps = std::max<std::size_t>(ops / 50, 3);
+    std::vector<std::string> smallIds(ops);
+    std::vector<std::string> largeIds(largeOps);
+    std::vector<Measure> measures;
+
+    measures.push_back(run("token refresh", std::min<std::size_t>(ops, 50), verbose, [&](std::size_t)
+    {
+        return drive.renewToken() ? -1LL : 0LL;
+    }));
+    measures.push_back(run("generateIds", ops, verbose, [&](std::size_t)
+    {
+        return drive.generateIds(1).empty() ? -1LL : 0LL;
+    }));
+    measures.push_back(run("upload small (multipart)", ops, verbose, [&](std::size_t i)
+    {
+        std::string name = "small-" + std::to_string((unsigned long long) i);
+        std::pair<std::string, int> result = drive.putBuffer(name.c_str(), smallData.data(), smallData.size());
+        smallIds[i] = result.first;
+        return result.second ? -1LL : (long long) smallData.size();
+    }));
+    drive.setMultipartThreshold(0);
+    measures.push_back(run("upload small (resumable)", ops, verbose, [&](std::size_t i)
+    {
+        std::string name = "session-" + std::to_string((unsigned long long) i);
+        std::pair<std::string, int> result = drive.putBuffer(name.c_str(), smallData.data(), smallData.size());
+        return result.second ? -1LL : (long long) smallData.size();
+    }));
+    measures.push_back(run("upload large", largeOps, verbose, [&](std::size_t i)
+    {
+        std::string name = "large-" + std::to_string((unsigned long long) i);
+        std::pair<std::string, int> result = drive.putBuffer(name.c_str(), largeData.data(), largeData.size());
+        largeIds[i] = result.first;
+        return result.second ? -1LL : (long long) largeData.size();
+    }));
+    measures.push_back(run("lookup by name", ops, verbose, [&](std::size_t i)
+    {
+        std::string name = "small-" + std::to_string((unsigned long long) i);
+        return drive.getFileId(name.c_str()).empty() ? -1LL : 0LL;
+    }));
+    measures.push_back(run("list all files", 10, verbose, [&](std::size_t)
+    {
+        long long count = 0;
+        int code = drive.listFiles([&count](const FileInfo&) { count++; return true; });
+        return code ? -1LL : 0LL;
+    }));
+    measures.push_back(run("download small", ops, verbose, [&](std::size_t i)
+    {
+        std::vector<char> buffer;
+        int code = drive.getFileById(smallIds[i].c_str(), buffer);
+        return code < 200 || code >= 300 ? -1LL : (long long) buffer.size();
+    }));
+    measures.push_back(run("download large", largeOps, verbose, [&](std::size_t i)
+    {
+        std::vector<char> buffer;
+        int code = drive.getFileById(largeIds[i].c_str(), buffer);
+        return code < 200 || code >= 300 ? -1LL : (long long) buffer.size();
+    }));
+    measures.push_back(run("remote read sequential", largeOps, verbose, [&](std::size_t i)
+    {
+        RemoteFile remote(&drive);
+        if (remote.open(largeIds[i].c_str()))
+            return -1LL;
+        std::vector<char> buffer(128 << 10);
+        long long total = 0;
+        ssize_t n;
+        while ((n = remote.pread(&buffer[0], buffer.size(), total)) > 0)
+            total += n;
+        return n < 0 ? -1LL : total;
+    }));
+    RemoteFile sliced(&drive);
+    sliced.open(largeIds[0].c_str());
+    measures.push_back(run("remote read random 4KiB", ops, verbose, [&](std::size_t i)
+    {
+        char buffer[4096];
+        curl_off_t offset = (curl_off_t) ((i * 2654435761u) % std::max<std::size_t>(largeData.size(), 1));
+        return (long long) sliced.pread(buffer, sizeof(buffer), offset);
+    }));
+    measures.push_back(run("bulk download small", 1, verbose, [&](std::size_t)
+    {
+        std::vector<TransferResult> results;
+        TransferStats stats = drive.getFilesById(smallIds, results);
+        return stats.failed ? -1LL : (long long) stats.bytes;
+    }));
+
+    report(measures);
+    if (!metricsFile.empty())
+    {
+        std::ofstream out(metricsFile.c_str());
+        out << drive.getMetrics().prometheus();
+    }
+    if (!traceFile.empty())
+        drive.getMetrics().writeChromeTrace(traceFile.c_str());
+    if (local)
+        std::cout << "Mock served " << mock.requests() << " requests." << std::endl;
+    for (std::size_t i = 0; i < measures.size(); i++)
+        if (measures[i].failed)
+            return 2;
+    return 0;
+}
@@ -0,0 +1,205 @@
+/*
+ * ListingBench.cc
+ *
+ *  Benchmark of file listing parsing: the whole response buffered and parsed
+ *  into a jsoncpp document, against ListingParser fed chunk by chunk as
+ *  libcurl delivers the body. Each way runs in a child process of its own so
+ *  the peak resident memory it needs can be told apart.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <json/json.h>
+#include "JsonStream.h"
+
+/* Outcome of one way of parsing, sent back by the child that ran it */
+struct Outcome {
+	double seconds;
+	long peakKiB;           // growth of the peak resident set while parsing
+	std::size_t files;
+	char first[128];        // id and name of the first and last files, to compare both ways
+	char last[128];
+};
+
+/* A files.list response in the shape Drive sends, with count files */
+static std::string makePage(std::size_t count)
+{
+    std::string page = "{\n \"kind\": \"drive#fileList\",\n \"nextPageToken\": \"~!!~AI9FV7Tq3mZ0example\",\n"
+                       " \"incompleteSearch\": false,\n \"files\": [\n";
+    char entry[512];
+    for (std::size_t i = 0; i < count; i++)
+    {
+        snprintf(entry, sizeof(entry),
+                 "  {\n   \"kind\": \"drive#file\",\n   \"id\": \"1%032zx\",\n   \"name\": \"result-%zu \\u00e9t\\u00e9.dat\",\n"
+                 "   \"mimeType\": \"application/octet-stream\",\n   \"parents\": [\n    \"0AKz9yQmExampleUk9PVA\"\n   ],\n"
+                 "   \"modifiedTime\": \"2016-06-01T12:%02zu:%02zu.000Z\",\n   \"md5Checksum\": \"%032zx\",\n"
+                 "   \"size\": \"%zu\"\n  }%s\n",
+                 i * 2654435761u, i, i / 60 % 60, i % 60, i * 40503u, 1000 + i * 37, i + 1 < count ? "," : "");
+        page += entry;
+    }
+    page += " ]\n}\n";
+    return page;
+}
+
+static FileInfo fromDocument(const Json::Value& file)
+{
+    FileInfo info;
+    info.id = file["id"].asString();
+    info.name = file["name"].asString();
+    info.mimeType = file["mimeType"].asString();
+    info.md5Checksum = file["md5Checksum"].asString();
+    info.modifiedTime = file["modifiedTime"].asString();
+    info.size = strtoll(file["size"].asString().c_str(), NULL, 10);
+    const Json::Value& parents = file["parents"];
+    for (unsigned int i = 0; i < parents.size(); i++)
+        info.parents.push_back(parents[i].asString());
+    return info;
+}
+
+/* The way listings were read before: body appended to a string, then a document */
+static bool parseDocument(const std::string& page, std::size_t chunk, std::vector<FileInfo>& files)
+{
+    std::string body;
+    for (std::size_t offset = 0; offset < page.size(); offset += chunk)
+        body.append(page, offset, chunk);
+    Json::Value root;
+    Json::Reader reader;
+    if (!reader.parse(body, root))
+        return false;
+    body.clear();
+    const Json::Value& entries = root["files"];
+    for (unsigned int i = 0; i < entries.size(); i++)
+        files.push_back(fromDocument(entries[i]));
+    return true;
+}
+
+static bool parseStream(const std::string& page, std::size_t chunk, std::vector<FileInfo>& files)
+{
+    ListingParser parser;
+    for (std::size_t offset = 0; offset < page.size(); offset += chunk)
+        if (!parser.feed(page.data() + offset, std::min(chunk, page.size() - offset)))
+            return false;
+    if (!parser.finish())
+        return false;
+    files.swap(parser.files);
+    return true;
+}
+
+static long peakKiB()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/* Runs one way of parsing rounds times in a child process */
+static bool measure(bool streaming, const std::string& page, std::size_t chunk, int rounds, Outcome& outcome)
+{
+    int channel[2];
+    if (pipe(channel) != 0)
+        return false;
+    pid_t child = fork();
+    if (child < 0)
+        return false;
+    if (child == 0)
+    {
+        close(channel[0]);
+        Outcome result;
+        memset(&result, 0, sizeof(result));
+        long before = peakKiB();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        bool ok = true;
+        for (int i = 0; i < rounds && ok; i++)
+        {
+            std::vector<FileInfo> files;
+            ok = streaming ? parseStream(page, chunk, files) : parseDocument(page, chunk, files);
+            result.files = files.size();
+            if (ok && !files.empty())
+            {
+                snprintf(result.first, sizeof(result.first), "%s %s %lld", files.front().id.c_str(),
+                         files.front().name.c_str(), files.front().size);
+                snprintf(result.last, sizeof(result.last), "%s %s %lld", files.back().id.c_str(),
+                         files.back().name.c_str(), files.back().size);
+            }
+        }
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        result.peakKiB = peakKiB() - before;
+        bool sent = ok && write(channel[1], &result, sizeof(result)) == (ssize_t) sizeof(result);
+        _exit(sent ? 0 : 1);
+    }
+    close(channel[1]);
+    bool received = read(channel[0], &outcome, sizeof(outcome)) == (ssize_t) sizeof(outcome);
+    close(channel[0]);
+    int status;
+    waitpid(child, &status, 0);
+    return received && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void usage()
+{
+    std::cout << "Usage: ListingBench [--files n] [--chunk bytes] [--rounds n]" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    std::size_t count = 1000;   // a full page at the page size GDConnect asks for
+    std::size_t chunk = 16384;  // what libcurl hands the write callback at most
+    int rounds = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 >= argc)
+        {
+            usage();
+            return 1;
+        }
+        const char * value = argv[++i];
+        if (!strcmp(argv[i - 1], "--files"))
+            count = strtoull(value, NULL, 10);
+        else if (!strcmp(argv[i - 1], "--chunk"))
+            chunk = std::max(1ULL, strtoull(value, NULL, 10));
+        else if (!strcmp(argv[i - 1], "--rounds"))
+            rounds = atoi(value);
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    std::string page = makePage(count);
+    if (rounds <= 0)
+        rounds = (int) std::max<std::size_t>(1, (64 << 20) / page.size()); // about 64 MB parsed each way
+    printf("%zu files, %zu bytes per page, %d rounds, %zu byte chunks\n", count, page.size(), rounds, chunk);
+    printf("%-22s %10s %12s %14s\n", "parser", "MB/s", "files/sec", "peak RSS KiB");
+
+    Outcome outcomes[2];
+    const char * names[2] = { "buffer + document", "streaming" };
+    for (int way = 0; way < 2; way++)
+    {
+        if (!measure(way == 1, page, chunk, rounds, outcomes[way]))
+        {
+            std::cerr << names[way] << " parsing failed" << std::endl;
+            return 1;
+        }
+        const Outcome& o = outcomes[way];
+        double seconds = o.seconds > 0 ? o.seconds : 1e-9;
+        printf("%-22s %10.1f %12.0f %14ld\n", names[way], page.size() * (double) rounds / seconds / 1e6,
+               o.files * (double) rounds / seconds, o.peakKiB);
+    }
+    if (outcomes[0].files != outcomes[1].files || strcmp(outcomes[0].first, outcomes[1].first)
+            || strcmp(outcomes[0].last, outcomes[1].last))
+    {
+        std::cerr << "The parsers disagree: " << outcomes[0].files << " files (" << outcomes[0].last << ") against "
+                  << outcomes[1].files << " (" << outcomes[1].last << ")" << std::endl;
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,1009 @@
+/*
+ * MockDrive.cc
+ *
+ *  Local mock of the Google Drive API
+ *  A small threaded HTTP/1.1 server keeping every file in memory.
+ *  Only what GDConnect uses is implemented, with the same status codes,
+ *  headers and JSON shapes as Drive v3.
+ */
+
+#include "MockDrive.h"
+#include "Md5.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <chrono>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <fstream>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <csignal>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+
+static std::string lowercase(std::string str)
+{
+    std::transform(str.begin(), str.end(), str.begin(), ::tolower);
+    return str;
+}
+
+/* Decodes a query string component */
+static std::string unescape(const std::string& str)
+{
+    std::string out;
+    for (std::size_t i = 0; i < str.size(); i++)
+    {
+        if (str[i] == '+')
+            out += ' ';
+        else if (str[i] == '%' && i + 2 < str.size())
+        {
+            out += (char) strtol(str.substr(i + 1, 2).c_str(), NULL, 16);
+            i += 2;
+        }
+        else
+            out += str[i];
+    }
+    return out;
+}
+
+/* Hex digest to the base64 form used by X-Goog-Hash */
+static std::string hexToBase64(const std::string& hex)
+{
+    static const char * alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string bytes;
+    for (std::size_t i = 0; i + 1 < hex.size(); i += 2)
+        bytes += (char) strtol(hex.substr(i, 2).c_str(), NULL, 16);
+    std::string out;
+    for (std::size_t i = 0; i < bytes.size(); i += 3)
+    {
+        unsigned int n = (unsigned char) bytes[i] << 16;
+        if (i + 1 < bytes.size())
+            n |= (unsigned char) bytes[i + 1] << 8;
+        if (i + 2 < bytes.size())
+            n |= (unsigned char) bytes[i + 2];
+        out += alphabet[(n >> 18) & 63];
+        out += alphabet[(n >> 12) & 63];
+        out += i + 1 < bytes.size() ? alphabet[(n >> 6) & 63] : '=';
+        out += i + 2 < bytes.size() ? alphabet[n & 63] : '=';
+    }
+    return out;
+}
+
+static std::string now()
+{
+    char stamp[32];
+    std::time_t t = std::time(NULL);
+    struct tm parts;
+    gmtime_r(&t, &parts);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S.000Z", &parts);
+    return stamp;
+}
+
+/* Value of a quoted term such as name = 'x' or name="x" in a search query */
+static bool quotedTerm(const std::string& q, const std::string& key, std::string& value)
+{
+    std::size_t pos = q.find(key);
+    if (pos == std::string::npos)
+        return false;
+    pos = q.find_first_of("'\"", pos);
+    if (pos == std::string::npos)
+        return false;
+    std::size_t end = q.find(q[pos], pos + 1);
+    if (end == std::string::npos)
+        return false;
+    value = q.substr(pos + 1, end - pos - 1);
+    return true;
+}
+
+MockDrive::MockDrive(const MockOptions& options)
+    : options(options), tlsContext(NULL), listener(-1), boundPort(0), running(false), served(0), refused(0),
+      nextSession(1), nextToken(1), firstValidToken(0), random(std::random_device()())
+{
+}
+
+MockDrive::~MockDrive()
+{
+    stop();
+    if (tlsContext)
+        SSL_CTX_free(tlsContext);
+}
+
+/* Makes an EC key and a self-signed certificate for 127.0.0.1, valid for a day,
+    and a TLS context serving them */
+bool MockDrive::setupTls()
+{
+    EVP_PKEY * key = NULL;
+    EVP_PKEY_CTX * keyContext = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    bool ok = keyContext && EVP_PKEY_keygen_init(keyContext) > 0
+              && EVP_PKEY_CTX_set_ec_paramgen_curve_nid(keyContext, NID_X9_62_prime256v1) > 0
+              && EVP_PKEY_keygen(keyContext, &key) > 0;
+    EVP_PKEY_CTX_free(keyContext);
+
+    X509 * cert = ok ? X509_new() : NULL;
+    if (cert)
+    {
+        X509_set_version(cert, 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(cert), (long) (random() & 0x7fffffff));
+        X509_gmtime_adj(X509_getm_notBefore(cert), -60);
+        X509_gmtime_adj(X509_getm_notAfter(cert), 24 * 3600);
+        X509_set_pubkey(cert, key);
+        X509_NAME * name = X509_get_subject_name(cert);
+        X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *) "127.0.0.1", -1, -1, 0);
+        X509_set_issuer_name(cert, name);
+        X509V3_CTX extensions;
+        X509V3_set_ctx_nodb(&extensions);
+        X509V3_set_ctx(&extensions, cert, cert, NULL, NULL, 0);
+        X509_EXTENSION * san = X509V3_EXT_conf_nid(NULL, &extensions, NID_subject_alt_name, "IP:127.0.0.1");
+        ok = san && X509_add_ext(cert, san, -1) && X509_sign(cert, key, EVP_sha256()) > 0;
+        X509_EXTENSION_free(san);
+    }
+
+    BIO * pem = BIO_new(BIO_s_mem());
+    if (ok && pem && PEM_write_bio_X509(pem, cert))
+    {
+        char * data;
+        long length = BIO_get_mem_data(pem, &data);
+        certificatePem.assign(data, length);
+    }
+    else
+        ok = false;
+    BIO_free(pem);
+
+    tlsContext = ok ? SSL_CTX_new(TLS_server_method()) : NULL;
+    ok = tlsContext && SSL_CTX_use_certificate(tlsContext, cert) == 1 && SSL_CTX_use_PrivateKey(tlsContext, key) == 1;
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    if (!ok)
+    {
+        ERR_print_errors_fp(stderr);
+        if (tlsContext)
+            SSL_CTX_free(tlsContext);
+        tlsContext = NULL;
+        return false;
+    }
+    // OpenSSL writes to the socket itself, without MSG_NOSIGNAL: a client hanging up must not kill the process
+    signal(SIGPIPE, SIG_IGN);
+    return true;
+}
+
+/* Binds to 127.0.0.1 and starts accepting connections; false if the port could not be bound */
+bool MockDrive::start()
+{
+    if (options.tls && !tlsContext && !setupTls())
+        return false;
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0)
+        return false;
+    int on = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(options.port);
+    socklen_t length = sizeof(addr);
+    if (bind(listener, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(listener, 128) != 0
+            || getsockname(listener, (struct sockaddr *) &addr, &length) != 0)
+    {
+        perror("MockDrive");
+        close(listener);
+        listener = -1;
+        return false;
+    }
+    boundPort = ntohs(addr.sin_port);
+    running = true;
+    acceptor = std::thread(&MockDrive::acceptLoop, this);
+    return true;
+}
+
+/* Closes the listener and every open connection, then waits for their threads */
+void MockDrive::stop()
+{
+    if (!running.exchange(false))
+        return;
+    shutdown(listener, SHUT_RDWR);
+    close(listener);
+    acceptor.join();
+    std::vector<std::thread> finished;
+    {
+        std::lock_guard<std::mutex> guard(connectionLock);
+        for (std::set<int>::iterator it = sockets.begin(); it != sockets.end(); ++it)
+            shutdown(*it, SHUT_RDWR);
+        finished.swap(connections);
+    }
+    for (std::size_t i = 0; i < finished.size(); i++)
+        finished[i].join();
+}
+
+std::string MockDrive::url()
+{
+    return (tlsContext ? "https://127.0.0.1:" : "http://127.0.0.1:") + std::to_string(boundPort);
+}
+
+/* Writes config.json and an expired token.json for a server at url in the
+    working directory, so that init() starts by renewing the token there */
+bool MockDrive::writeCredentials(const std::string& url)
+{
+    Json::Value config;
+    config["installed"]["client_id"] = "mock";
+    config["installed"]["client_secret"] = "mock";
+    config["installed"]["auth_uri"] = url + "/auth";
+    config["installed"]["token_uri"] = url + "/token";
+    config["installed"]["redirect_uris"].append("urn:ietf:wg:oauth:2.0:oob");
+    config["installed"]["api_uri"] = url;
+    Json::Value token;
+    token["access_token"] = "expired";
+    token["refresh_token"] = "mock-refresh";
+    token["timestamp"] = "0";
+    token["expires_in"] = 3600;
+    Json::StyledWriter writer;
+    std::ofstream configFile("config.json");
+    std::ofstream tokenFile("token.json");
+    configFile << writer.write(config);
+    tokenFile << writer.write(token);
+    return configFile.good() && tokenFile.good();
+}
+
+void silence(bool quiet, int saved[2])
+{
+    std::cout.flush();
+    fflush(stdout);
+    fflush(stderr);
+    if (quiet)
+    {
+        saved[0] = dup(1);
+        saved[1] = dup(2);
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, 1);
+        dup2(null, 2);
+        close(null);
+    }
+    else
+    {
+        dup2(saved[0], 1);
+        dup2(saved[1], 2);
+        close(saved[0]);
+        close(saved[1]);
+    }
+}
+
+/* Seeds the drive with a file, returning its ID */
+std::string MockDrive::addFile(const std::string& name, const std::string& content, const std::string& parentId)
+{
+    Json::Value root;
+    root["name"] = name;
+    if (!parentId.empty())
+        root["parents"].append(parentId);
+    Json::FastWriter writer;
+    Response res = store(writer.write(root), "", content);
+    Json::Value obj;
+    Json::Reader reader;
+    reader.parse(res.body, obj);
+    return obj["id"].asString();
+}
+
+std::size_t MockDrive::fileCount()
+{
+    std::lock_guard<std::mutex> guard(dataLock);
+    return files.size();
+}
+
+void MockDrive::acceptLoop()
+{
+    while (running)
+    {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0)
+            continue;
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        std::lock_guard<std::mutex> guard(connectionLock);
+        if (!running)
+        {
+            close(fd);
+            break;
+        }
+        sockets.insert(fd);
+        connections.push_back(std::thread(&MockDrive::serve, this, fd));
+    }
+}
+
+/* Answers requests on one keep-alive connection until the client closes it */
+void MockDrive::serve(int fd)
+{
+    Connection conn = { fd, NULL };
+    bool open = true;
+    if (tlsContext)
+    {
+        conn.ssl = SSL_new(tlsContext);
+        open = conn.ssl && SSL_set_fd(conn.ssl, fd) && SSL_accept(conn.ssl) == 1;
+    }
+    std::string buffer;
+    Request req;
+    while (open && running && readRequest(conn, buffer, req))
+    {
+        served++;
+        pace(req.body.size());
+        if (options.latencyMs > 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(options.latencyMs));
+        Response res = dispatch(req);
+        std::stringstream head;
+        head << "HTTP/1.1 " << res.code << " " << reasonPhrase(res.code) << "\r\n";
+        bool typed = false;
+        for (std::size_t i = 0; i < res.headers.size(); i++)
+        {
+            head << res.headers[i].first << ": " << res.headers[i].second << "\r\n";
+            typed = typed || res.headers[i].first == "Content-Type";
+        }
+        if (!typed && !res.body.empty())
+            head << "Content-Type: application/json; charset=UTF-8\r\n";
+        head << "Content-Length: " << res.body.size() << "\r\n\r\n";
+        std::string headers = head.str();
+        if (!sendAll(conn, headers.data(), headers.size()) || !sendAll(conn, res.body.data(), res.body.size()))
+            break;
+    }
+    if (conn.ssl)
+        SSL_free(conn.ssl);
+    {
+        std::lock_guard<std::mutex> guard(connectionLock);
+        sockets.erase(fd);
+    }
+    close(fd);
+}
+
+const char * MockDrive::reasonPhrase(int code)
+{
+    return code == 200 ? "OK" : code == 206 ? "Partial Content" : code == 308 ? "Resume Incomplete"
+           : code < 300 ? "Success" : "Error";
+}
+
+/* Splits a request target into its path and decoded query parameters */
+void MockDrive::parseTarget(const std::string& target, Request& req)
+{
+    std::size_t question = target.find('?');
+    req.path = target.substr(0, question);
+    if (question != std::string::npos)
+    {
+        std::istringstream query(target.substr(question + 1));
+        std::string pair;
+        while (std::getline(query, pair, '&'))
+        {
+            std::size_t equals = pair.find('=');
+            req.query[unescape(pair.substr(0, equals))] = equals == std::string::npos ? "" : unescape(pair.substr(equals + 1));
+        }
+    }
+}
+
+/* Reads one request, body included, from the connection */
+bool MockDrive::readRequest(Connection& conn, std::string& buffer, Request& req)
+{
+    char chunk[64 * 1024];
+    std::size_t end;
+    while ((end = buffer.find("\r\n\r\n")) == std::string::npos)
+    {
+        ssize_t n = receive(conn, chunk, sizeof(chunk));
+        if (n <= 0)
+            return false;
+        buffer.append(chunk, n);
+    }
+    req = Request();
+    std::istringstream head(buffer.substr(0, end));
+    std::string line;
+    std::string target;
+    std::getline(head, line);
+    std::istringstream requestLine(line);
+    requestLine >> req.method >> target;
+    while (std::getline(head, line))
+    {
+        std::size_t colon = line.find(':');
+        if (colon == std::string::npos)
+            continue;
+        std::string value = line.substr(colon + 1);
+        value.erase(0, value.find_first_not_of(" \t"));
+        value.erase(value.find_last_not_of("\r \t") + 1);
+        req.headers[lowercase(line.substr(0, colon))] = value;
+    }
+    buffer.erase(0, end + 4);
+    parseTarget(target, req);
+
+    if (lowercase(req.headers["expect"]) == "100-continue")
+    {
+        const char * proceed = "HTTP/1.1 100 Continue\r\n\r\n";
+        if (!sendAll(conn, proceed, strlen(proceed)))
+            return false;
+    }
+    std::size_t length = strtoull(req.headers["content-length"].c_str(), NULL, 10);
+    while (buffer.size() < length)
+    {
+        ssize_t n = receive(conn, chunk, sizeof(chunk));
+        if (n <= 0)
+            return false;
+        buffer.append(chunk, n);
+    }
+    req.body = buffer.substr(0, length);
+    buffer.erase(0, length);
+    return true;
+}
+
+/* Reads what the connection has, up to length bytes; 0 or less once it is closed */
+ssize_t MockDrive::receive(Connection& conn, char * data, std::size_t length)
+{
+    if (conn.ssl)
+        return SSL_read(conn.ssl, data, (int) length);
+    return recv(conn.fd, data, length, 0);
+}
+
+/* Sends data in slices paced to the configured bandwidth */
+bool MockDrive::sendAll(Connection& conn, const char * data, std::size_t length)
+{
+    const std::size_t slice = 64 * 1024;
+    while (length > 0)
+    {
+        std::size_t part = std::min(length, slice);
+        ssize_t n = conn.ssl ? SSL_write(conn.ssl, data, (int) part) : send(conn.fd, data, part, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        pace(n);
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+/* Waits for as long as bytes take to cross the simulated link */
+void MockDrive::pace(std::size_t bytes)
+{
+    if (options.bandwidth > 0 && bytes > 0)
+        std::this_thread::sleep_for(std::chrono::microseconds((long long) (bytes * 1e6 / options.bandwidth)));
+}
+
+MockDrive::Response MockDrive::dispatch(const Request& req)
+{
+    if (req.path == "/token")
+        return token(req);
+    // the upload ID of a resumable session stands in for credentials, as with Drive
+    std::map<std::string, std::string>::const_iterator auth = req.headers.find("authorization");
+    if (auth == req.headers.end() && !req.query.count("upload_id"))
+    {
+        refused++;
+        return error(401, "authError", "Login Required");
+    }
+    if (auth != req.headers.end())
+    {
+        std::lock_guard<std::mutex> guard(dataLock);
+        const std::string issued = "Bearer mock-access-";
+        if (firstValidToken > 0 && (auth->second.compare(0, issued.size(), issued) != 0
+                                    || strtoull(auth->second.c_str() + issued.size(), NULL, 10) < firstValidToken))
+        {
+            refused++;
+            return error(401, "authError", "Invalid Credentials");
+        }
+    }
+    if (options.errorRate > 0)
+    {
+        std::lock_guard<std::mutex> guard(dataLock);
+        if (std::uniform_real_distribution<double>(0, 1)(random) < options.errorRate)
+        {
+            const char * reason = options.errorCode == 429 ? "rateLimitExceeded"
+                                  : options.errorCode == 403 ? "userRateLimitExceeded" : "backendError";
+            return error(options.errorCode, reason, "Injected by the mock");
+        }
+    }
+
+    const std::string files = "/drive/v3/files";
+    const std::string uploads = "/upload/drive/v3/files";
+    std::map<std::string, std::string>::const_iterator uploadType = req.query.find("uploadType");
+    if (req.path == "/batch/drive/v3" && req.method == "POST")
+        return batch(req);
+    if (req.path == files + "/generateIds" && req.method == "GET")
+        return generateIds(req);
+    if (req.path == "/drive/v3/changes/startPageToken" || req.path == "/drive/v3/changes")
+        return changes(req);
+    if (req.path == files && req.method == "GET")
+        return list(req);
+    if (req.path == files && req.method == "POST")
+        return createFile(req, "");
+    if (req.path.compare(0, files.size() + 1, files + "/") == 0)
+    {
+        std::string id = req.path.substr(files.size() + 1);
+        std::map<std::string, std::string>::const_iterator alt = req.query.find("alt");
+        if (req.method == "GET" && alt != req.query.end() && alt->second == "media")
+            return media(id, req);
+        if (req.method == "GET")
+            return metadata(id);
+        if (req.method == "DELETE")
+            return remove(id);
+        if (req.method == "PATCH")
+            return createFile(req, id);
+    }
+    if (req.path.compare(0, uploads.size(), uploads) == 0 && uploadType != req.query.end())
+    {
+        std::string id = req.path.size() > uploads.size() ? req.path.substr(uploads.size() + 1) : "";
+        if (req.method == "PUT" && req.query.count("upload_id"))
+            return putChunk(req);
+        if (uploadType->second == "resumable" && (req.method == "POST" || req.method == "PATCH"))
+            return startSession(req, id);
+        if (uploadType->second == "multipart" && (req.method == "POST" || req.method == "PATCH"))
+            return multipart(req, id);
+    }
+    return error(404, "notFound", "Not supported by the mock");
+}
+
+/* multipart/mixed batch of up to 100 calls, each part an HTTP request of its own.
+    The calls run in order, with the credentials of the batch; the answers go
+    back in reverse order, each tagged with the Content-ID of its request as
+    <response-...>, so that clients cannot rely on positions. */
+MockDrive::Response MockDrive::batch(const Request& req)
+{
+    const std::size_t maxCalls = 100;
+    std::map<std::string, std::string>::const_iterator type = req.headers.find("content-type");
+    std::size_t pos = type == req.headers.end() ? std::string::npos : type->second.find("boundary=");
+    if (pos == std::string::npos)
+        return error(400, "badContent", "Missing multipart boundary");
+    std::string boundary = type->second.substr(pos + 9);
+    if (boundary.size() >= 2 && boundary[0] == '"')
+        boundary = boundary.substr(1, boundary.size() - 2);
+    const std::string delimiter = "--" + boundary;
+
+    std::vector<std::pair<std::string, Request> > calls; // Content-ID, request
+    std::size_t start = req.body.find(delimiter);
+    while (start != std::string::npos && req.body.compare(start + delimiter.size(), 2, "--") != 0)
+    {
+        start += delimiter.size();
+        std::size_t end = req.body.find(delimiter, start);
+        if (end == std::string::npos)
+            return error(400, "badContent", "Malformed multipart body");
+        std::string part = req.body.substr(start, end - start);
+        start = end;
+
+        // the part's own headers, then the embedded request
+        std::size_t blank = part.find("\r\n\r\n");
+        if (blank == std::string::npos)
+            return error(400, "badContent", "Malformed batch part");
+        std::string contentId;
+        std::size_t idPos = lowercase(part.substr(0, blank)).find("content-id:");
+        if (idPos != std::string::npos)
+        {
+            std::size_t open = part.find('<', idPos);
+            std::size_t close = part.find('>', idPos);
+            if (open != std::string::npos && close != std::string::npos && open < blank && close > open)
+                contentId = part.substr(open + 1, close - open - 1);
+        }
+        std::string embedded = part.substr(blank + 4);
+        std::size_t lineEnd = embedded.find("\r\n");
+        Request call;
+        std::istringstream requestLine(embedded.substr(0, lineEnd));
+        std::string target;
+        requestLine >> call.method >> target;
+        if (call.method.empty() || target.empty())
+            return error(400, "badContent", "Malformed batch part");
+        parseTarget(target, call);
+        std::size_t headersEnd = lineEnd == std::string::npos ? std::string::npos : embedded.find("\r\n\r\n", lineEnd);
+        if (headersEnd != std::string::npos)
+        {
+            std::istringstream headers(embedded.substr(lineEnd + 2, headersEnd - lineEnd - 2));
+            std::string line;
+            while (std::getline(headers, line))
+            {
+                std::size_t colon = line.find(':');
+                if (colon == std::string::npos)
+                    continue;
+                std::string value = line.substr(colon + 1);
+                value.erase(0, value.find_first_not_of(" \t"));
+                value.erase(value.find_last_not_of("\r \t") + 1);
+                call.headers[lowercase(line.substr(0, colon))] = value;
+            }
+            call.body = embedded.substr(headersEnd + 4);
+            if (call.body.size() >= 2 && call.body.compare(call.body.size() - 2, 2, "\r\n") == 0)
+                call.body.erase(call.body.size() - 2);
+        }
+        std::map<std::string, std::string>::const_iterator auth = req.headers.find("authorization");
+        if (auth != req.headers.end() && !call.headers.count("authorization"))
+            call.headers["authorization"] = auth->second;
+        calls.push_back(std::make_pair(contentId, call));
+        if (calls.size() > maxCalls)
+            return error(400, "limitExceeded", "A batch may hold at most 100 calls");
+    }
+    if (calls.empty())
+        return error(400, "badContent", "Empty batch");
+
+    std::vector<std::string> answers;
+    for (std::size_t i = 0; i < calls.size(); i++)
+    {
+        Response res = dispatch(calls[i].second);
+        std::stringstream answer;
+        answer << "Content-Type: application/http\r\n";
+        if (!calls[i].first.empty())
+            answer << "Content-ID: <response-" << calls[i].first << ">\r\n";
+        answer << "\r\nHTTP/1.1 " << res.code << " " << reasonPhrase(res.code) << "\r\n";
+        if (!res.body.empty())
+            answer << "Content-Type: application/json; charset=UTF-8\r\n";
+        answer << "Content-Length: " << res.body.size() << "\r\n\r\n" << res.body << "\r\n";
+        answers.push_back(answer.str());
+    }
+    const std::string responseBoundary = "batch_mock_" + std::to_string((unsigned long long) served);
+    Response res;
+    for (std::size_t i = answers.size(); i-- > 0;)
+        res.body += "--" + responseBoundary + "\r\n" + answers[i];
+    res.body += "--" + responseBoundary + "--\r\n";
+    res.headers.push_back(std::make_pair("Content-Type", "multipart/mixed; boundary=" + responseBoundary));
+    return res;
+}
+
+MockDrive::Response MockDrive::error(int code, const char * reason, const char * message)
+{
+    Json::Value root;
+    Json::Value detail;
+    detail["domain"] = "global";
+    detail["reason"] = reason;
+    detail["message"] = message;
+    root["error"]["errors"].append(detail);
+    root["error"]["code"] = code;
+    root["error"]["message"] = message;
+    Json::FastWriter writer;
+    Response res;
+    res.code = code;
+    res.body = writer.write(root);
+    return res;
+}
+
+/* Must be called with dataLock held */
+std::string MockDrive::newId()
+{
+    static const char * alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    std::string id = "1";
+    for (int i = 0; i < 32; i++)
+        id += alphabet[random() % 64];
+    return id;
+}
+
+Json::Value MockDrive::describe(const File& file)
+{
+    Json::Value obj;
+    obj["kind"] = "drive#file";
+    obj["id"] = file.id;
+    obj["name"] = file.name;
+    obj["mimeType"] = file.mimeType;
+    obj["modifiedTime"] = file.modifiedTime;
+    for (std::size_t i = 0; i < file.parents.size(); i++)
+        obj["parents"].append(file.parents[i]);
+    if (file.mimeType != "application/vnd.google-apps.folder")
+    {
+        obj["size"] = std::to_string((unsigned long long) file.content.size());
+        obj["md5Checksum"] = file.md5;
+    }
+    for (std::map<std::string, std::string>::const_iterator it = file.appProperties.begin();
+            it != file.appProperties.end(); ++it)
+        obj["appProperties"][it->first] = it->second;
+    return obj;
+}
+
+/* Every access token issued so far is refused from now on, as when they expire
+    or are revoked; any credentials are accepted until the first call */
+void MockDrive::revokeTokens()
+{
+    std::lock_guard<std::mutex> guard(dataLock);
+    firstValidToken = nextToken;
+}
+
+unsigned long long MockDrive::tokensIssued()
+{
+    std::lock_guard<std::mutex> guard(dataLock);
+    return nextToken - 1;
+}
+
+MockDrive::Response MockDrive::token(const Request& req)
+{
+    Json::Value root;
+    {
+        std::lock_guard<std::mutex> guard(dataLock);
+        root["access_token"] = "mock-access-" + std::to_string(nextToken++);
+    }
+    root["expires_in"] = 3600;
+    root["token_type"] = "Bearer";
+    if (req.body.find("grant_type=authorization_code") != std::string::npos)
+        root["refresh_token"] = "mock-refresh";
+    Json::FastWriter writer;
+    Response res;
+    res.body = writer.write(root);
+    return res;
+}
+
+MockDrive::Response MockDrive::generateIds(const Request& req)
+{
+    std::map<std::string, std::string>::const_iterator count = req.query.find("count");
+    int n = count == req.query.end() ? 10 : atoi(count->second.c_str());
+    if (n < 1 || n > 1000)
+        return error(400, "invalid", "count must be between 1 and 1000");
+    Json::Value root;
+    root["kind"] = "drive#generatedIds";
+    root["space"] = "drive";
+    root["ids"] = Json::Value(Json::arrayValue);
+    {
+        std::lock_guard<std::mutex> guard(dataLock);
+        for (int i = 0; i < n; i++)
+            root["ids"].append(newId());
+    }
+    Json::FastWriter writer;
+    Response res;
+    res.body = writer.write(root);
+    return res;
+}
+
+/* Listing with the name and parent terms of the search query honoured; page tokens are offsets */
+MockDrive::Response MockDrive::list(const Request& req)
+{
+    std::map<std::string, std::string>::const_iterator it = req.query.find("q");
+    std::string q = it == req.query.end() ? "" : it->second;
+    std::string name;
+    bool byName = quotedTerm(q, "name", name);
+    std::string parent;
+    std::size_t in = q.find(" in parents");
+    bool byParent = in != std::string::npos && in > 1 && (q[in - 1] == '\'' || q[in - 1] == '"');
+    if (byParent)
+    {
+        std::size_t open = q.rfind(q[in - 1], in - 2);
+        byParent = open != std::string::npos;
+        if (byParent)
+            parent = q.substr(open + 1, in - open - 2);
+    }
+    it = req.query.find("pageSize");
+    int pageSize = it == req.query.end() ? options.pageSize : std::min(std::max(atoi(it->second.c_str()), 1), 1000);
+    it = req.query.find("pageToken");
+    std::size_t offset = it == req.query.end() ? 0 : strtoull(it->second.c_str(), NULL, 10);
+
+    Json::Value root;
+    root["kind"] = "drive#fileList";
+    root["files"] = Json::Value(Json::arrayValue);
+    std::size_t matched = 0;
+    std::lock_guard<std::mutex> guard(dataLock);
+    for (std::map<std::string, File>::const_iterator f = files.begin(); f != files.end(); ++f)
+    {
+        if (byName && f->second.name != name)
+            continue;
+        if (byParent && std::find(f->second.parents.begin(), f->second.parents.end(), parent) == f->second.parents.end())
+            continue;
+        if (matched++ < offset)
+            continue;
+        if ((int) root["files"].size() == pageSize)
+        {
+            root["nextPageToken"] = std::to_string((unsigned long long) (offset + pageSize));
+            break;
+        }
+        root["files"].append(describe(f->second));
+    }
+    Json::FastWriter writer;
+    Response res;
+    res.body = writer.write(root);
+    return res;
+}
+
+MockDrive::Response MockDrive::metadata(const std::string& id)
+{
+    std::lock_guard<std::mutex> guard(dataLock);
+    std::map<std::string, File>::const_iterator it = files.find(id);
+    if (it == files.end())
+        return error(404, "notFound", "File not found");
+    Json::FastWriter writer;
+    Response res;
+    res.body = writer.write(describe(it->second));
+    return res;
+}
+
+/* File content, whole or the single byte range asked for */
+MockDrive::Response MockDrive::media(const std::string& id, const Request& req)
+{
+    Response res;
+    std::string content;
+    {
+        std::lock_guard<std::mutex> guard(dataLock);
+        std::map<std::string, File>::const_iterator it = files.find(id);
+        if (it == files.end())
+            return error(404, "notFound", "File not found");
+        content = it->second.content;
+        res.headers.push_back(std::make_pair("X-Goog-Hash", "md5=" + hexToBase64(it->second.md5)));
+    }
+    res.headers.push_back(std::make_pair("Content-Type", "application/octet-stream"));
+    std::map<std::string, std::string>::const_iterator range = req.headers.find("range");
+    if (range != req.headers.end() && range->second.compare(0, 6, "bytes=") == 0)
+    {
+        std::size_t dash = range->second.find('-');
+        unsigned long long first = strtoull(range->second.c_str() + 6, NULL, 10);
+        unsigned long long last = dash + 1 < range->second.size() ? strtoull(range->second.c_str() + dash + 1, NULL, 10)
+                                  : content.size() - 1;
+        if (first >= content.size())
+            return error(416, "requestedRangeNotSatisfiable", "Range not satisfiable");
+        last = std::min<unsigned long long>(last, content.size() - 1);
+        std::stringstream contentRange;
+        contentRange << "bytes " << first << "-" << last << "/" << content.size();
+        res.headers.push_back(std::make_pair("Content-Range", contentRange.str()));
+        res.code = 206;
+        res.body = content.substr(first, last - first + 1);
+        return res;
+    }
+    res.body.swap(content);
+    return res;
+}
+
+/* Metadata-only create (folders) or update */
+MockDrive::Response MockDrive::createFile(const Request& req, const std::string& fileId)
+{
+    std::string content;
+    if (!fileId.empty())
+    {
+        std::lock_guard<std::mutex> guard(dataLock);
+        std::map<std::string, File>::const_iterator it = files.find(fileId);
+        if (it == files.end())
+            return error(404, "notFound", "File not found");
+        content = it->second.content;
+    }
+    return store(req.body, fileId, content);
+}
+
+MockDrive::Response MockDrive::remove(const std::string& id)
+{
+    std::lock_guard<std::mutex> guard(dataLock);
+    if (!files.erase(id))
+        return error(404, "notFound", "File not found");
+    Response res;
+    res.code = 204;
+    return res;
+}
+
+/* The changes feed of the mock is always empty */
+MockDrive::Response MockDrive::changes(const Request& req)
+{
+    Json::Value root;
+    if (req.path == "/drive/v3/changes/startPageToken")
+        root["startPageToken"] = "1";
+    else
+    {
+        root["newStartPageToken"] = "1";
+        root["changes"] = Json::Value(Json::arrayValue);
+    }
+    Json::FastWriter writer;
+    Response res;
+    res.body = writer.write(root);
+    return res;
+}
+
+MockDrive::Response MockDrive::startSession(const Request& req, const std::string& fileId)
+{
+    Session session;
+    session.metadata = req.body;
+    session.fileId = fileId;
+    std::map<std::string, std::string>::const_iterator length = req.headers.find("x-upload-content-length");
+    session.total = length == req.headers.end() ? -1 : strtoll(length->second.c_str(), NULL, 10);
+    Json::Value root;
+    Json::Reader reader;
+    std::string uploadId;
+    {
+        std::lock_guard<std::mutex> guard(dataLock);
+        // like Drive, a new file's ID is checked as soon as the session is requested
+        if (fileId.empty() && reader.parse(req.body, root) && files.count(root["id"].asString()))
+            return error(409, "duplicate", "A file already exists with the provided ID");
+        uploadId = std::to_string(nextSession++);
+        sessions[uploadId] = session;
+    }
+    Response res;
+    res.headers.push_back(std::make_pair("Location", url() + "/upload/drive/v3/files?uploadType=resumable&upload_id=" + uploadId));
+    return res;
+}
+
+/* One chunk of a resumable upload, or with "bytes * / total" a status query */
+MockDrive::Response MockDrive::putChunk(const Request& req)
+{
+    std::string uploadId = req.query.find("upload_id")->second;
+    std::map<std::string, std::string>::const_iterator header = req.headers.find("content-range");
+    std::string contentRange = header == req.headers.end() ? "" : header->second;
+    Response res;
+    std::string metadata;
+    std::string fileId;
+    std::string content;
+    {
+        std::lock_guard<std::mutex> guard(dataLock);
+        std::map<std::string, Session>::iterator it = sessions.find(uploadId);
+        if (it == sessions.end())
+            return error(404, "notFound", "No such upload session");
+        Session& session = it->second;
+        std::size_t slash = contentRange.find('/');
+        if (slash != std::string::npos && contentRange.compare(slash + 1, 1, "*") != 0)
+            session.total = strtoll(contentRange.c_str() + slash + 1, NULL, 10);
+        if (contentRange.compare(0, 6, "bytes ") == 0 && contentRange.compare(6, 1, "*") != 0)
+        {
+            unsigned long long first = strtoull(contentRange.c_str() + 6, NULL, 10);
+            if (first > session.content.size())
+                return error(400, "badContent", "Chunk does not follow the data received so far");
+            std::size_t overlap = session.content.size() - first;
+            if (overlap < req.body.size())
+                session.content.append(req.body, overlap, std::string::npos);
+        }
+        else if (contentRange.empty())
+            session.content += req.body;
+        if (session.total < 0 || (long long) session.content.size() < session.total)
+        {
+            res.code = 308;
+            if (!session.content.empty())
+                res.headers.push_back(std::make_pair("Range", "bytes=0-" + std::to_string((unsigned long long) session.content.size() - 1)));
+            return res;
+        }
+        metadata.swap(session.metadata);
+        fileId = session.fileId;
+        content.swap(session.content);
+        sessions.erase(it);
+    }
+    return store(metadata, fileId, content);
+}
+
+/* multipart/related upload: a JSON metadata part followed by the content part */
+MockDrive::Response MockDrive::multipart(const Request& req, const std::string& fileId)
+{
+    std::map<std::string, std::string>::const_iterator type = req.headers.find("content-type");
+    std::size_t pos = type == req.headers.end() ? std::string::npos : type->second.find("boundary=");
+    if (pos == std::string::npos)
+        return error(400, "badContent", "Missing multipart boundary");
+    std::string delimiter = "--" + type->second.substr(pos + 9);
+    std::string parts[2];
+    std::size_t start = req.body.find(delimiter);
+    for (int i = 0; i < 2; i++)
+    {
+        std::size_t body = start == std::string::npos ? start : req.body.find("\r\n\r\n", start);
+        std::size_t end = body == std::string::npos ? body : req.body.find("\r\n" + delimiter, body + 4);
+        if (end == std::string::npos)
+            return error(400, "badContent", "Malformed multipart body");
+        parts[i] = req.body.substr(body + 4, end - body - 4);
+        start = end + 2;
+    }
+    return store(parts[0], fileId, parts[1]);
+}
+
+/* Creates a file from its JSON metadata, or replaces fileId's content and updates its metadata */
+MockDrive::Response MockDrive::store(const std::string& metadata, const std::string& fileId, const std::string& content)
+{
+    Json::Value root;
+    Json::Reader reader;
+    if (!metadata.empty() && !reader.parse(metadata, root))
+        return error(400, "parseError", "Invalid JSON metadata");
+    Md5 digest;
+    digest.update(content.data(), content.size());
+    std::lock_guard<std::mutex> guard(dataLock);
+    File file;
+    if (!fileId.empty())
+    {
+        std::map<std::string, File>::iterator it = files.find(fileId);
+        if (it == files.end())
+            return error(404, "notFound", "File not found");
+        file = it->second;
+    }
+    else
+    {
+        file.id = root.isMember("id") ? root["id"].asString() : newId();
+        if (files.count(file.id))
+            return error(409, "duplicate", "A file already exists with the provided ID");
+        file.mimeType = root.get("mimeType", "application/octet-stream").asString();
+        for (unsigned int i = 0; i < root["parents"].size(); i++)
+            file.parents.push_back(root["parents"][i].asString());
+    }
+    if (root.isMember("name"))
+        file.name = root["name"].asString();
+    const Json::Value& tags = root["appProperties"];
+    std::vector<std::string> keys = tags.getMemberNames();
+    for (std::size_t i = 0; i < keys.size(); i++)
+        file.appProperties[keys[i]] = tags[keys[i]].asString();
+    file.content = content;
+    file.md5 = digest.hexDigest();
+    file.modifiedTime = now();
+    files[file.id] = file;
+    Json::FastWriter writer;
+    Response res;
+    res.body = writer.write(describe(file));
+    return res;
+}
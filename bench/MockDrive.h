@@ -0,0 +1,142 @@
+/*
+ * MockDrive.h
+ *
+ *  Local stand-in for the Google Drive API, for benchmarks and tests.
+ *  Serves the OAuth token, files, generateIds, changes, batch, resumable and
+ *  multipart upload and media endpoints from memory over plain HTTP, or
+ *  HTTPS with a throwaway self-signed certificate, with injectable latency,
+ *  bandwidth limit and error rate, and access tokens that can be revoked to
+ *  force renewals.
+ */
+
+#ifndef MOCKDRIVE_H
+#define MOCKDRIVE_H
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <json/json.h>
+#include <openssl/ssl.h>
+
+/* How the mock misbehaves */
+struct MockOptions {
+	int port;               // 0 picks a free port
+	int latencyMs;          // added before every answer
+	double bandwidth;       // bytes per second each way on a connection, 0 for unlimited
+	double errorRate;       // fraction of API calls answered with errorCode instead
+	int errorCode;          // 429, 403 (rate limit) or 5xx
+	int pageSize;           // default listing page size
+	bool tls;               // HTTPS, with a certificate for 127.0.0.1 made at start
+
+	MockOptions() : port(0), latencyMs(0), bandwidth(0), errorRate(0), errorCode(503), pageSize(100), tls(false) {}
+};
+
+class MockDrive {
+public:
+	MockDrive(const MockOptions& options = MockOptions());
+	virtual ~MockDrive();
+	bool start();
+	void stop();
+	int port() { return boundPort; }
+	std::string url();
+	std::string certificate() { return certificatePem; }
+	std::string addFile(const std::string& name, const std::string& content, const std::string& parentId = "");
+	std::size_t fileCount();
+	unsigned long long requests() { return served; }
+	void revokeTokens();
+	unsigned long long tokensIssued();
+	unsigned long long unauthorized() { return refused; }
+	static bool writeCredentials(const std::string& url);
+
+private:
+	struct File {
+		std::string id;
+		std::string name;
+		std::string mimeType;
+		std::string content;
+		std::string md5;
+		std::string modifiedTime;
+		std::vector<std::string> parents;
+		std::map<std::string, std::string> appProperties;
+	};
+	struct Session {
+		std::string metadata;   // JSON body of the session request
+		std::string fileId;     // file being overwritten, if any
+		std::string content;
+		long long total;        // -1 until announced
+	};
+	struct Connection {
+		int fd;
+		SSL * ssl;              // NULL over plain HTTP
+	};
+	struct Request {
+		std::string method;
+		std::string path;
+		std::map<std::string, std::string> query;
+		std::map<std::string, std::string> headers;     // lowercase names
+		std::string body;
+	};
+	struct Response {
+		int code;
+		std::vector<std::pair<std::string, std::string> > headers;
+		std::string body;
+
+		Response() : code(200) {}
+	};
+
+	MockOptions options;
+	SSL_CTX * tlsContext;
+	std::string certificatePem; // what clients must trust with TLS on
+	int listener;
+	int boundPort;
+	std::atomic<bool> running;
+	std::atomic<unsigned long long> served;
+	std::atomic<unsigned long long> refused;    // calls answered 401
+	std::thread acceptor;
+	std::vector<std::thread> connections;
+	std::set<int> sockets;      // open connections, shut down on stop
+	std::mutex connectionLock;
+	std::map<std::string, File> files;
+	std::map<std::string, Session> sessions;
+	unsigned long long nextSession;
+	unsigned long long nextToken;
+	unsigned long long firstValidToken;     // 0 accepts any credentials
+	std::mt19937_64 random;
+	std::mutex dataLock;
+
+	void acceptLoop();
+	void serve(int fd);
+	bool setupTls();
+	bool readRequest(Connection& conn, std::string& buffer, Request& req);
+	ssize_t receive(Connection& conn, char * data, std::size_t length);
+	bool sendAll(Connection& conn, const char * data, std::size_t length);
+	void pace(std::size_t bytes);
+	Response dispatch(const Request& req);
+	Response token(const Request& req);
+	Response generateIds(const Request& req);
+	Response list(const Request& req);
+	Response metadata(const std::string& id);
+	Response media(const std::string& id, const Request& req);
+	Response createFile(const Request& req, const std::string& fileId);
+	Response remove(const std::string& id);
+	Response changes(const Request& req);
+	Response startSession(const Request& req, const std::string& fileId);
+	Response putChunk(const Request& req);
+	Response multipart(const Request& req, const std::string& fileId);
+	Response batch(const Request& req);
+	Response store(const std::string& metadata, const std::string& fileId, const std::string& content);
+	Response error(int code, const char * reason, const char * message);
+	static const char * reasonPhrase(int code);
+	static void parseTarget(const std::string& target, Request& req);
+	std::string newId();
+	static Json::Value describe(const File& file);
+};
+
+/* Points stdout and stderr at /dev/null, or back at the saved descriptors */
+void silence(bool quiet, int saved[2]);
+
+#endif // MOCKDRIVE_H
@@ -0,0 +1,89 @@
+/*
+ * MockDriveMain.cc
+ *
+ *  Standalone mock Drive server, for pointing GDConnect (api_uri and
+ *  token_uri in the config file) or the benchmark at a local endpoint.
+ *  With --tls it serves HTTPS and writes its certificate to the given file,
+ *  for clients to trust (GDConnect::setCACertificates, curl --cacert).
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <fstream>
+#include <iostream>
+#include "MockDrive.h"
+
+static void usage()
+{
+    std::cout << "Usage: MockDrive [--port n] [--latency ms] [--bandwidth bytes/s]"
+              << " [--errors rate] [--error-code code] [--page-size n] [--tls certificate-file]" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    MockOptions options;
+    options.port = 8090;
+    std::string certificateFile;
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 >= argc)
+        {
+            usage();
+            return 1;
+        }
+        const char * value = argv[++i];
+        if (!strcmp(argv[i - 1], "--port"))
+            options.port = atoi(value);
+        else if (!strcmp(argv[i - 1], "--latency"))
+            options.latencyMs = atoi(value);
+        else if (!strcmp(argv[i - 1], "--bandwidth"))
+            options.bandwidth = atof(value);
+        else if (!strcmp(argv[i - 1], "--errors"))
+            options.errorRate = atof(value);
+        else if (!strcmp(argv[i - 1], "--error-code"))
+            options.errorCode = atoi(value);
+        else if (!strcmp(argv[i - 1], "--page-size"))
+            options.pageSize = atoi(value);
+        else if (!strcmp(argv[i - 1], "--tls"))
+        {
+            options.tls = true;
+            certificateFile = value;
+        }
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    // wait for a termination signal on the main thread, with the server threads left undisturbed
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    MockDrive drive(options);
+    if (!drive.start())
+        return 1;
+    if (options.tls)
+    {
+        std::ofstream certificate(certificateFile.c_str());
+        certificate << drive.certificate();
+        if (!certificate.good())
+        {
+            std::cerr << "Unable to write the certificate to " << certificateFile << std::endl;
+            return 1;
+        }
+        std::cout << "Certificate written to " << certificateFile << std::endl;
+    }
+    std::cout << "Mock Drive listening on " << drive.url() << std::endl;
+    std::cout << "Token endpoint: " << drive.url() << "/token" << std::endl;
+    int received;
+    sigwait(&signals, &received);
+    drive.stop();
+    std::cout << "Served " << drive.requests() << " requests." << std::endl;
+    return 0;
+}
@@ -0,0 +1,242 @@
+/*
+ * StressTest.cc
+ *
+ *  Many worker threads sharing one GDConnect against the local mock Drive
+ *  server: each uploads, downloads (whole, ranged and in bulk), lists and
+ *  looks up its own files, the last on the I/O thread, while another thread
+ *  keeps revoking the access token and renewing it, so that renewals happen
+ *  with requests in flight. Every transfer must succeed and come back
+ *  intact. Exits with 0 when every check passes.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <unistd.h>
+#include "GDConnect.h"
+#include "MockDrive.h"
+
+static std::mutex failureLock;
+static std::vector<std::string> failures;
+
+static void check(bool ok, const std::string& what)
+{
+    if (!ok)
+    {
+        std::lock_guard<std::mutex> guard(failureLock);
+        failures.push_back(what);
+    }
+}
+
+/* Content of file round of worker, different for every file */
+static std::string makeContent(std::size_t worker, std::size_t round)
+{
+    std::size_t size = round % 4 == 3 ? 48 << 10 : 1000 + (worker * 37 + round * 101) % 5000;
+    std::string data(size, '\0');
+    for (std::size_t i = 0; i < size; i++)
+        data[i] = (char) ((i + worker * 131 + round * 17) * 2654435761u >> 11);
+    return data;
+}
+
+static std::string readFile(const std::string& path)
+{
+    std::ifstream in(path.c_str(), std::ios::binary);
+    std::stringstream content;
+    content << in.rdbuf();
+    return content.str();
+}
+
+/* One worker: rounds of upload, download and listing of its own files, then a bulk download of all of them */
+static void work(GDConnect& drive, std::size_t worker, std::size_t rounds, std::atomic<unsigned long long>& ops)
+{
+    std::vector<std::string> ids;
+    std::vector<std::string> names;
+    for (std::size_t round = 0; round < rounds; round++)
+    {
+        const std::string name = "stress-" + std::to_string((unsigned long long) worker) + "-"
+                                 + std::to_string((unsigned long long) round);
+        const std::string data = makeContent(worker, round);
+        std::pair<std::string, int> up = drive.putBuffer(name.c_str(), data.data(), data.size());
+        ops++;
+        check(up.second == 0 && !up.first.empty(), "upload of " + name + " returned " + std::to_string((long long) up.second));
+        if (up.second != 0 || up.first.empty())
+            continue;
+        ids.push_back(up.first);
+        names.push_back(name);
+
+        std::vector<char> buffer;
+        int code = drive.getFileById(up.first.c_str(), buffer);
+        ops++;
+        check(code == 200, "download of " + name + " returned " + std::to_string((long long) code));
+        check(std::string(buffer.begin(), buffer.end()) == data, "download of " + name + " differs");
+
+        std::size_t found = 0;
+        const std::string query = "name = '" + name + "'";
+        code = drive.listFiles([&](const FileInfo& file)
+        {
+            found += file.id == up.first;
+            return true;
+        }, query.c_str());
+        ops++;
+        check(code == 0 && found == 1, "listing of " + name + " returned " + std::to_string((long long) code)
+              + " with " + std::to_string((unsigned long long) found) + " matches");
+
+        std::string asyncId = drive.getFileIdAsync(name.c_str()).get();
+        ops++;
+        check(asyncId == up.first, "asynchronous lookup of " + name + " found " + asyncId);
+
+        if (round % 4 == 3)
+        {
+            code = drive.getFileByIdRanged(up.first.c_str(), 8 << 10, 4);
+            ops++;
+            check(code == 200, "ranged download of " + name + " returned " + std::to_string((long long) code));
+            check(readFile(name) == data, "ranged download of " + name + " differs");
+            unlink(name.c_str());
+        }
+    }
+
+    std::vector<TransferResult> results;
+    drive.getFilesById(ids, results, 4);
+    ops++;
+    check(results.size() == ids.size(), "bulk download returned the wrong number of results");
+    for (std::size_t i = 0; i < results.size() && i < ids.size(); i++)
+    {
+        check(results[i].code == 200, "bulk download of " + names[i] + " returned " + std::to_string((long long) results[i].code));
+        std::size_t round = strtoul(names[i].c_str() + names[i].rfind('-') + 1, NULL, 10);
+        check(readFile(results[i].path) == makeContent(worker, round), "bulk download of " + names[i] + " differs");
+        unlink(results[i].path.c_str());
+    }
+}
+
+static void usage()
+{
+    std::cout << "Usage: StressTest [--threads n] [--rounds n] [--latency ms] [--revoke ms] [--rate requests/s] [--verbose]" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    MockOptions options;
+    options.latencyMs = 2;
+    std::size_t threads = 32;
+    std::size_t rounds = 24;
+    int revokeMs = 200;    // pause between two forced renewals, well above the latency of one request
+    double rate = 0;        // the client's request rate limit; none by default, to stress the client itself
+    bool verbose = false;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--verbose"))
+        {
+            verbose = true;
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            usage();
+            return 1;
+        }
+        const char * value = argv[++i];
+        if (!strcmp(argv[i - 1], "--threads"))
+            threads = std::max(1, atoi(value));
+        else if (!strcmp(argv[i - 1], "--rounds"))
+            rounds = std::max(1, atoi(value));
+        else if (!strcmp(argv[i - 1], "--latency"))
+            options.latencyMs = atoi(value);
+        else if (!strcmp(argv[i - 1], "--revoke"))
+            revokeMs = std::max(1, atoi(value));
+        else if (!strcmp(argv[i - 1], "--rate"))
+            rate = atof(value);
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    MockDrive mock(options);
+    if (!mock.start())
+        return 1;
+    const std::string url = mock.url();
+    char workDir[] = "/tmp/gdstress.XXXXXX";
+    if (!mkdtemp(workDir) || chdir(workDir) != 0 || !MockDrive::writeCredentials(url))
+    {
+        std::cerr << "Unable to prepare a working directory" << std::endl;
+        return 1;
+    }
+    std::cout << "Stressing " << url << " with " << threads << " threads from " << workDir << std::endl;
+
+    int saved[2];
+    if (!verbose)
+        silence(true, saved);
+    GDConnect drive("config.json");
+    int err = drive.init("config.json");
+    drive.setRequestRate(rate);
+
+    // every other turn the mock revokes the token, so that requests in flight
+    // come back 401; in between the client renews it on its own initiative
+    std::atomic<bool> done(false);
+    std::atomic<unsigned long long> ops(0);
+    unsigned long long revocations = 0;
+    unsigned long long renewals = 0;
+    std::thread renewer([&]()
+    {
+        for (bool revoke = true; !done; revoke = !revoke)
+        {
+            std::chrono::steady_clock::time_point due = std::chrono::steady_clock::now() + std::chrono::milliseconds(revokeMs);
+            while (!done && std::chrono::steady_clock::now() < due)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            if (done)
+                break;
+            if (!revoke)
+            {
+                check(drive.renewToken() == 0, "renewal on the client's initiative failed");
+                renewals++;
+                continue;
+            }
+            // revoke again only once the client holds a token issued after the last revocation
+            unsigned long long issued = mock.tokensIssued();
+            mock.revokeTokens();
+            revocations++;
+            while (!done && mock.tokensIssued() == issued)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    if (!err && drive.valid())
+        for (std::size_t i = 0; i < threads; i++)
+            workers.push_back(std::thread(work, std::ref(drive), i, rounds, std::ref(ops)));
+    for (std::size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    done = true;
+    renewer.join();
+    if (!verbose)
+        silence(false, saved);
+    mock.stop();
+
+    if (err || !drive.valid())
+    {
+        std::cerr << "Unable to authenticate against " << url << std::endl;
+        return 1;
+    }
+    check(mock.unauthorized() > 0, "no request was ever refused, renewals were not exercised in flight");
+    std::cout << ops << " operations in " << seconds << " s, " << revocations << " revocations, "
+              << renewals << " client renewals, " << mock.unauthorized() << " requests refused with 401, "
+              << mock.tokensIssued() << " tokens issued" << std::endl;
+    for (std::size_t i = 0; i < failures.size() && i < 20; i++)
+        std::cout << "FAIL: " << failures[i] << std::endl;
+    std::cout << (failures.empty() ? std::string("Stress test passed")
+                                   : "Stress test failed: " + std::to_string((unsigned long long) failures.size()) + " checks")
+              << std::endl;
+    return failures.empty() ? 0 : 1;
+}
@@ -0,0 +1,68 @@
+/*
+ * AsyncEngine.h
+ *
+ *  Dedicated I/O thread driving a TransferQueue, so that callers can start
+ *  any number of requests without blocking and be told when they complete.
+ */
+
+#ifndef ASYNCENGINE_H
+#define ASYNCENGINE_H
+#include <cstddef>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <functional>
+#include <curl/curl.h>
+#include "TransferQueue.h"
+
+/* Shared flag through which the caller of an asynchronous operation can cancel it.
+   A cancelled transfer is aborted at its next progress report, and no further
+   steps of the operation are started. */
+class CancelToken {
+private:
+	std::atomic<bool> flag;
+
+public:
+	CancelToken() : flag(false) {}
+	void cancel() { flag = true; }
+	bool cancelled() const { return flag; }
+};
+
+typedef std::shared_ptr<CancelToken> Cancellation;
+
+class AsyncEngine {
+public:
+	typedef std::function<void()> Task;
+
+	AsyncEngine(std::size_t maxInFlight = 64);
+	virtual ~AsyncEngine();
+	void add(CURL * handle, TransferQueue::Completion done);
+	void post(Task task);
+	void after(std::chrono::milliseconds delay, Task task);
+	bool stopping() const { return stop; }
+	static void watch(CURL * handle, CancelToken * token);
+
+private:
+	typedef std::chrono::steady_clock Clock;
+	struct Transfer {
+		CURL * handle;
+		TransferQueue::Completion done;
+	};
+	TransferQueue queue;
+	std::mutex inboxLock;
+	std::vector<Transfer> transfers;
+	std::vector<Task> tasks;
+	std::multimap<Clock::time_point, Task> timers;
+	std::atomic<bool> stop;
+	std::thread loop;
+
+	static int progress(void * clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
+	bool drain(bool dueOnly);
+	void run();
+};
+
+#endif // ASYNCENGINE_H
@@ -0,0 +1,77 @@
+/*
+ * Compression.h
+ *
+ *  Streaming gzip (zlib) stages for transfers: a compression pipeline that
+ *  runs on its own thread ahead of an upload, and an inflater that
+ *  decompresses a download on its way to the caller.
+ */
+
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+#include <cstddef>
+#include <string>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <zlib.h>
+
+/* Compresses a buffer on a worker thread. The output is cut into blocks of
+   exactly blockSize bytes (the last one may be shorter) and handed over
+   through a queue of at most depth blocks, so that compressing the next block
+   overlaps with sending the current one. Consumers that must not block use
+   poll() instead of next(), and are told through ready, called on the worker
+   thread, whenever a block was queued or the stream ended. */
+class CompressionPipeline {
+public:
+	typedef std::function<void()> Notify;
+
+	CompressionPipeline(const char * data, std::size_t length, int level, std::size_t blockSize, std::size_t depth = 2,
+	                    const Notify& ready = Notify());
+	virtual ~CompressionPipeline();
+	bool next(std::string& block, bool& last);
+	int poll(std::string& block, bool& last);
+	unsigned long long compressedSize() { return total; }
+
+private:
+	const char * data;
+	std::size_t length;
+	int level;
+	std::size_t blockSize;
+	std::size_t depth;
+	Notify ready;
+	std::deque<std::string> blocks;
+	bool finished;
+	bool failed;
+	bool stop;
+	unsigned long long total;   // compressed bytes handed out so far
+	std::mutex lock;
+	std::condition_variable changed;
+	std::thread worker;
+
+	bool push(std::string& block, bool last);
+	void fail();
+	void run();
+};
+
+/* Decompresses a gzip stream fed in pieces of any size, passing the output on */
+class Inflater {
+public:
+	typedef std::function<bool(const char * data, std::size_t length)> Output;
+
+	Inflater(const Output& out);
+	virtual ~Inflater();
+	bool write(const char * data, std::size_t length);
+	bool finished() { return done; }
+	unsigned long long produced() { return outputBytes; }
+
+private:
+	z_stream stream;
+	Output out;
+	bool ready;
+	bool done;
+	unsigned long long outputBytes;
+};
+
+#endif // COMPRESSION_H
@@ -0,0 +1,43 @@
+/*
+ * CurlPool.h
+ *
+ *  Pool of reusable cURL easy handles.
+ *  Handles share DNS, TLS session and connection caches through a curl_share
+ *  object so that successive requests reuse kept-alive connections to Google
+ *  instead of paying a fresh TCP + TLS handshake each time.
+ */
+
+#ifndef CURLPOOL_H
+#define CURLPOOL_H
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <curl/curl.h>
+
+class CurlPool {
+private:
+	CURLSH * share;
+	std::vector<CURL *> idle;
+	std::mutex idleLock;
+	std::mutex shareLocks[CURL_LOCK_DATA_LAST];
+	std::size_t maxIdle;
+	bool reuse;             // read and written under idleLock, like caFile
+	std::string caFile;     // certificates to trust instead of the system's, if set
+
+	static void lockShare(CURL * handle, curl_lock_data data, curl_lock_access access, void * userptr);
+	static void unlockShare(CURL * handle, curl_lock_data data, void * userptr);
+	void configure(CURL * handle, bool shared, const std::string& trusted);
+
+public:
+	CurlPool(std::size_t maxIdle = 16);
+	virtual ~CurlPool();
+	CURL * acquire();
+	void release(CURL * handle);
+	void setReuse(bool enable);
+	bool reusing();
+	void setCAFile(const std::string& path);
+	CURLSH * shareHandle() { return share; }
+};
+
+#endif // CURLPOOL_H
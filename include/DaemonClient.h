@@ -0,0 +1,46 @@
+/*
+ * DaemonClient.h
+ *
+ *  Client side of the transfer daemon: the GDConnect calls a solver process
+ *  needs, answered by a TransferDaemon on the same node over its Unix socket,
+ *  so the process skips init() and starts on warm connections. Relative paths
+ *  are resolved against the caller's working directory before being sent.
+ */
+
+#ifndef DAEMONCLIENT_H
+#define DAEMONCLIENT_H
+#include <string>
+#include <utility>
+#include <mutex>
+#include <json/json.h>
+#include "GDConnect.h"
+
+class DaemonClient {
+private:
+	std::string socketPath;
+	int fd;
+	std::mutex lock;            // one request at a time on the connection
+	std::string pending;        // bytes received past the last response
+	unsigned long long nextId;
+
+	bool connectSocket();
+	void disconnect();
+	bool sendRequest(const std::string& line);
+	bool readResponse(Json::Value& response);
+	static std::string absolute(const char * path);
+
+public:
+	DaemonClient(const char * socketPath);
+	virtual ~DaemonClient();
+	bool valid();
+	Json::Value call(const Json::Value& request);
+	std::string getFileId(const char * filename);
+	int getFileById(const char * id, const char * path, std::string * md5 = NULL);
+	int listFiles(FileVisitor visit, const char * query = NULL);
+	std::string createFolder(const char * name, const char * parentId = NULL);
+	std::pair<std::string, int> putFile(const char * filename);
+	std::pair<std::string, int> putFile(const char * filename, const UploadTarget& target, std::string * md5 = NULL);
+	std::string getMetrics();
+};
+
+#endif // DAEMONCLIENT_H
@@ -10,29 +10,253 @@
 #define GDCONNECT_H
 #include <string>
 #include <utility>
+#include <vector>
+#include <map>
+#include <ostream>
+#include <functional>
+#include <ctime>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <memory>
+#include <future>
 #include <json/json.h>
+#include "CurlPool.h"
+#include "AsyncEngine.h"
+#include "RequestScheduler.h"
+#include "Md5.h"
+#include "Metrics.h"
 
+class MetadataIndex;
+class IdPool;
+class JsonStream;
+class ListingParser;
+struct AsyncListing;
+struct AsyncUpload;
+struct AsyncDownload;
+
+/* Receives downloaded data as it arrives; returning false aborts the transfer */
+typedef std::function<bool(const char * data, std::size_t length)> DataSink;
+
+/* Lightweight description of a file in Google Drive */
+struct FileInfo {
+	std::string id;
+	std::string name;
+	std::string mimeType;
+	std::string md5Checksum;
+	std::string modifiedTime;
+	std::vector<std::string> parents;
+	std::map<std::string, std::string> appProperties;  // private tags, e.g. those of compressed uploads
+	long long size;     // 0 for folders and Google Docs
+};
+
+/* Receives each file of a listing; returning false stops the listing */
+typedef std::function<bool(const FileInfo& file)> FileVisitor;
+
+/* One entry of the Drive changes feed */
+struct FileChange {
+	std::string fileId;
+	bool removed;       // deleted, trashed or no longer accessible
+	FileInfo file;      // only meaningful when not removed
+};
+
+/* Receives each entry of the changes feed */
+typedef std::function<void(const FileChange& change)> ChangeVisitor;
+
+/* One API call packed into a batch request */
+struct BatchRequest {
+	std::string method;     // GET, PATCH, DELETE...
+	std::string path;       // e.g. /drive/v3/files/<id>?fields=name
+	std::string body;       // optional JSON body
+};
+
+/* Answer to one call of a batch request */
+struct BatchResult {
+	int code;               // HTTP code of the sub-request, -1 if no answer was found
+	Json::Value body;
+};
+
+/* Outcome of one file in a bulk transfer */
+struct TransferResult {
+	std::string id;
+	std::string name;
+	std::string path;   // local file the content was saved to
+	int code;           // HTTP response code, or -1 if the transfer never completed
+	curl_off_t bytes;
+	double seconds;
+	std::string md5;    // MD5 of the content received
+};
+
+/* Aggregate figures for a bulk transfer */
+struct TransferStats {
+	std::size_t succeeded;
+	std::size_t failed;
+	curl_off_t bytes;
+	double seconds;     // wall-clock time for the whole batch
+	double throughput;  // bytes per second over the whole batch
+};
+
+/* Where an upload goes: a new file, or new content for an existing one */
+struct UploadTarget {
+	std::string name;       // name in Drive; kept as is when updating if empty
+	std::string parentId;   // folder for a new file; empty for the root
+	std::string fileId;     // existing file to overwrite; empty to create a new file
+	std::map<std::string, std::string> appProperties;  // private key/value tags stored with the file
+};
+
+/* Request body handed to cURL straight from memory */
+struct MemoryReader {
+	const char * data;
+	std::size_t remaining;
+};
+
+/* One HTTP request and its response, kept alive until the transfer completes,
+   so the same request setup can be performed synchronously or asynchronously */
+struct Exchange {
+	CURL * handle;
+	struct curl_slist * headers;
+	bool authorized;
+	std::string token;      // bearer token sent with the request
+	std::string url;
+	std::string body;       // request body, read by cURL during the transfer
+	MemoryReader reader;    // upload source for PUT requests
+	DataSink sink;          // if set, receives a successful response body instead of response
+	bool statusChecked;
+	bool sinkAccepted;
+	std::string header;     // raw response headers
+	std::string response;   // response body, or the error body when streaming to a sink
+	RequestScheduler::Priority priority;
+	bool retryable;         // may be performed again after a rate limit or server error
+	int attempts;           // retries so far
+	Md5 * md5;              // if set, hashes the response body passed to the sink
+	const char * operation; // metrics tag; derived from the URL if NULL
+
+	Exchange() : handle(NULL), headers(NULL), authorized(false), statusChecked(false), sinkAccepted(false),
+		priority(RequestScheduler::Metadata), retryable(true), attempts(0), md5(NULL), operation(NULL)
+	{
+		reader.data = NULL;
+		reader.remaining = 0;
+	}
+};
+
+/* Immutable snapshot of the OAuth credentials; renewal publishes a new one */
+struct Credential {
+	std::string accessToken;
+	std::string refreshToken;
+	time_t issued;
+	time_t expiry;
+
+	Credential() : issued(0), expiry(0) {}
+};
+
+/* A client may be shared by any number of threads once init() has returned:
+   requests read the credentials through lock-free snapshots, handles come
+   from a thread-safe pool and token renewal is serialised internally. */
 class GDConnect {
 private:
 	std::string clientID;
 	std::string clientSecret;
 	std::string authURL;
 	std::string tokenURL;
+	std::string apiURL;         // scheme and host of the Drive API, without trailing slash
 	std::string redirectURI;
 	std::string authScope;
 	std::string validationCode;
-	std::string accessToken;
-	std::string refreshToken;
-	time_t timestamp;
+	std::shared_ptr<const Credential> credential; // only accessed through atomic_load/atomic_store
+	std::mutex credentialLock;  // serialises writers building the next snapshot
+	std::mutex renewLock;       // held for the duration of a renewal
+	std::mutex refresherLock;   // guards stopRefresher, pairs with refresherWake
+	std::thread refresher;
+	std::condition_variable refresherWake;
+	bool stopRefresher;
 	bool ok;
+	curl_off_t uploadChunkSize;
+	long uploadBufferSize;
+	MetadataIndex * index;
+	IdPool * ids;
+	CurlPool * pool;
+	AsyncEngine * engine;
+	RequestScheduler * scheduler;
+	Metrics * metrics;
+	bool verifyChecksums;
+	curl_off_t multipartThreshold;  // smaller files are sent in a single request
+	int compressionLevel;       // gzip level for uploads, 0 to send data as is
+	bool decompressDownloads;   // inflate files this client uploaded compressed
+	std::once_flag engineOnce;
 
 	static std::size_t callback(const char* in, std::size_t size, std::size_t num, std::string* out);
 	static std::size_t write_data(void *ptr, size_t size, size_t nmemb, FILE *stream);
+	static std::size_t read_memory(char *buffer, size_t size, size_t nitems, MemoryReader *reader);
+	static std::string headerValue(const std::string& headers, const char * name);
+    struct curl_slist * authorize(struct curl_slist * slist, std::string * used = NULL);
+    static std::size_t write_exchange(char *ptr, size_t size, size_t nmemb, Exchange *ex);
+    bool openExchange(Exchange& ex, bool authorized);
+    void closeExchange(Exchange& ex);
+    const char * operationOf(const Exchange& ex);
+    int perform(Exchange& ex);
+    bool retryUnauthorized(Exchange& ex, bool& stale);
+    static std::string errorReason(const std::string& body);
+    long throttle(Exchange& ex, int code);
+    void resetExchange(Exchange& ex);
+    bool checksumMatches(const char * id, const std::string& headers, const std::string& actual,
+                         const std::string& known = std::string());
+    bool uploadMatches(const char * name, const std::string& response, const std::string& actual);
+    std::pair<std::string, int> exchangeResult(Exchange& ex, int code);
+    std::string escape(const std::string& str);
+    static FileInfo toFileInfo(const Json::Value& file);
+    int getListing(const std::string& url, JsonStream& page, std::string& error);
     int parseTokenFile();
+    std::shared_ptr<const Credential> credentials();
+    void storeCredentials(const std::shared_ptr<const Credential>& next);
+    void updateCredentials(const std::string& access, const std::string& refresh, time_t issued, long expiresIn);
+    time_t refreshDue();
+    void refreshLoop();
+    int refreshAccessToken();
+    int renewAfterUnauthorized(const std::string& staleToken);
     std::pair<std::string, int> post(const char * endpoint, const char * msg, bool authorized);
     std::pair<std::string, int> get(const char * endpoint, const char * msg, bool authorized);
-    std::pair<std::string, int> initUpload(const char * filename, const char * id, long fileSize);
+    std::pair<std::string, int> initUpload(const UploadTarget& target, const std::string& id, long fileSize);
+    bool prepareInitUpload(Exchange& ex, const UploadTarget& target, const std::string& id, long fileSize);
+    bool prepareUploadChunk(Exchange& ex, const std::string& uri, const char * data, curl_off_t offset,
+                            curl_off_t length, curl_off_t total);
+    static curl_off_t committedBytes(const Exchange& ex);
+    int uploadChunk(const std::string& uri, const char * data, curl_off_t offset, curl_off_t length,
+                    curl_off_t total, curl_off_t& committed, std::string& response);
+    int openSession(const UploadTarget& target, curl_off_t total, std::string& id, std::string& uri,
+                    std::string& response);
+    std::pair<std::string, int> store(const UploadTarget& target, const char * data, curl_off_t total,
+                                      const char * path, const struct stat * fileInfo, std::string * md5);
+    std::pair<std::string, int> uploadMultipart(const UploadTarget& target, const char * data, curl_off_t total,
+                                                std::string * md5);
+    bool prepareMultipart(Exchange& ex, const UploadTarget& target, const char * data, curl_off_t total,
+                          std::string& sentMd5, std::string& error);
+    std::pair<std::string, int> multipartResult(const std::string& name, Exchange& ex, int code,
+                                                const std::string& sentMd5, std::string * md5);
+    std::pair<std::string, int> uploadCompressed(const UploadTarget& target, const char * data, curl_off_t total,
+                                                 std::string * md5);
+    std::pair<std::string, int> upload(const UploadTarget& target, const char * data, curl_off_t total,
+                                       const char * path, const struct stat * fileInfo, std::string * md5);
+    int streamFile(const char * id, DataSink& sink, std::string * md5 = NULL, curl_off_t from = 0, Md5 * prefix = NULL,
+                   const Json::Value& remote = Json::Value());
+    bool resumable(const char * id, const Json::Value& previous, const Json::Value& remote);
+    bool resumeOffset(const char * id, const std::string& part, const Json::Value& remote, curl_off_t& offset, Md5& prefix);
     Json::Value getFileMetadataById(const char * id);
+    AsyncEngine * asyncEngine();
+    std::shared_ptr<Exchange> openGet(const std::string& url, bool authorized);
+    void performAsync(std::shared_ptr<Exchange> ex, Cancellation cancel, std::function<void(int)> done, bool retry = true);
+    void listPageAsync(std::shared_ptr<AsyncListing> listing, const std::string& pageToken);
+    void describeAsync(std::shared_ptr<AsyncDownload> dl);
+    void mediaAsync(std::shared_ptr<AsyncDownload> dl);
+    bool preparePart(AsyncDownload& dl);
+    void uploadMultipartAsync(std::shared_ptr<AsyncUpload> up);
+    void startUploadAsync(std::shared_ptr<AsyncUpload> up);
+    void openSessionAsync(std::shared_ptr<AsyncUpload> up);
+    void nextBlockAsync(std::shared_ptr<AsyncUpload> up);
+    void continueUploadAsync(std::shared_ptr<AsyncUpload> up);
+    void sendChunkAsync(std::shared_ptr<AsyncUpload> up);
+    void queryUploadAsync(std::shared_ptr<AsyncUpload> up, bool resuming);
+    void retryUploadAsync(std::shared_ptr<AsyncUpload> up, const std::string& response, int code);
+    void finishUploadAsync(std::shared_ptr<AsyncUpload> up, const std::string& response, int code);
 
 public:
 	GDConnect();
@@ -40,17 +264,67 @@ public:
     virtual ~GDConnect();
     int init(const char * configFilename);
     bool valid() { return ok; }
-    const char * getAccessToken();
-    const char * getRefreshToken();
+    bool decompressing() { return decompressDownloads; }
+    static bool compressedOriginal(const FileInfo& file, long long& size, std::string& md5);
+    static bool usableName(const std::string& name);
+    Metrics& getMetrics() { return *metrics; }
+    std::string getAccessToken();
+    std::string getRefreshToken();
     void setAccessToken(const char * str);
     void setRefreshToken(const char * str);
+    void setConnectionReuse(bool enable);
+    void setCACertificates(const char * pemFile);
+    void setUploadChunkSize(curl_off_t bytes);
+    void setUploadBufferSize(long bytes);
+    void setMetadataIndex(MetadataIndex * idx);
+    void setIdPool(IdPool * pool);
+    void setApiURL(const char * url);
+    void setRequestRate(double perSecond);
+    void setByteRate(double perSecond);
+    void setChecksumVerification(bool enable);
+    void setMultipartThreshold(curl_off_t bytes);
+    void setUploadCompression(int level);
+    void setTransparentDecompression(bool enable);
 	int getToken();
 	int renewToken();
 	int saveToken(Json::Value root);
 	int listFiles();
-	int getFileById(const char * filename);
+	int listFiles(FileVisitor visit, const char * query = NULL, bool prefetch = true);
+	std::string getStartPageToken();
+	int listChanges(std::string& pageToken, ChangeVisitor visit);
+	int getFileById(const char * id);
+	int getFileById(const char * id, const char * path, std::string * md5 = NULL);
+	int getFileById(const char * id, int fd);
+	int getFileById(const char * id, std::ostream& out);
+	int getFileById(const char * id, std::vector<char>& buffer);
+	int getFileById(const char * id, DataSink sink);
+	int getFileByIdRanged(const char * id, curl_off_t segmentSize = 32 << 20, std::size_t parallelism = 4);
+	TransferStats getFilesById(const std::vector<std::string>& ids, std::vector<TransferResult>& results,
+	                           std::size_t maxInFlight = 8);
 	std::string getFileId(const char * filename);
+	int getFileInfo(const char * id, FileInfo& file);
+	std::vector<std::string> generateIds(std::size_t count);
+	std::string createFolder(const char * name, const char * parentId = NULL);
+	std::vector<BatchResult> batch(const std::vector<BatchRequest>& requests);
+	std::vector<BatchResult> batchGetMetadata(const std::vector<std::string>& ids);
+	std::vector<BatchResult> batchDelete(const std::vector<std::string>& ids);
 	std::pair<std::string, int> putFile(const char * filename);
+	std::pair<std::string, int> putFile(const char * filename, const UploadTarget& target, std::string * md5 = NULL);
+	std::pair<std::string, int> putBuffer(const char * name, const void * data, std::size_t length);
+
+	// asynchronous variants: callbacks run on the I/O thread just before the future is ready
+	std::future<std::string> getFileIdAsync(const char * filename,
+	        std::function<void(const std::string&)> done = nullptr, Cancellation cancel = Cancellation());
+	std::future<int> listFilesAsync(FileVisitor visit, const char * query = NULL,
+	        std::function<void(const int&)> done = nullptr, Cancellation cancel = Cancellation());
+	std::future<int> getFileByIdAsync(const char * id, DataSink sink,
+	        std::function<void(const int&)> done = nullptr, Cancellation cancel = Cancellation());
+	std::future<int> getFileByIdAsync(const char * id, const char * path,
+	        std::function<void(const int&)> done = nullptr, Cancellation cancel = Cancellation());
+	std::future<int> getFileRangeAsync(const char * id, curl_off_t offset, curl_off_t length, DataSink sink,
+	        std::function<void(const int&)> done = nullptr, Cancellation cancel = Cancellation());
+	std::future<std::pair<std::string, int> > putFileAsync(const char * filename,
+	        std::function<void(const std::pair<std::string, int>&)> done = nullptr, Cancellation cancel = Cancellation());
 
 };
 
@@ -0,0 +1,57 @@
+/*
+ * IdPool.h
+ *
+ *  Local stock of Drive file IDs obtained in bulk from files.generateIds,
+ *  so that uploads needing an ID up front do not wait for one.
+ *  A background thread tops the stock up below a low-water mark, and
+ *  unused IDs are kept on disk across restarts. IDs leave the pool file
+ *  before they are handed out, a few at a time, and the file belongs to
+ *  one process at a time: another process sharing it keeps its stock in
+ *  memory only.
+ */
+
+#ifndef IDPOOL_H
+#define IDPOOL_H
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include "GDConnect.h"
+
+class IdPool {
+public:
+	static const std::size_t maxBatch = 1000;  // most IDs generateIds hands out per call
+	static const std::size_t reserveBatch = 32; // IDs removed from the pool file at a time
+
+	IdPool(GDConnect * drive, const char * poolFilename = "ids.json", std::size_t lowWater = 100,
+	       std::size_t batchSize = maxBatch);
+	virtual ~IdPool();
+	std::string take();
+	bool tryTake(std::string& id);
+	int save();
+	std::size_t size();
+
+private:
+	GDConnect * drive;
+	std::string poolFilename;
+	std::size_t lowWater;
+	std::size_t batchSize;
+	std::vector<std::string> ids;
+	std::size_t reserved;   // IDs at the back of ids already removed from the pool file
+	int lockFd;             // lock on the pool file, -1 if another process holds it
+	bool refilling;     // a fetch is in progress, by the worker or a starved caller
+	bool stop;
+	std::mutex lock;
+	std::condition_variable changed;
+	std::thread worker;
+
+	int load();
+	int store();
+	std::string hand();
+	bool fetch(std::unique_lock<std::mutex>& guard);
+	void run();
+};
+
+#endif // IDPOOL_H
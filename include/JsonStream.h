@@ -0,0 +1,130 @@
+/*
+ * JsonStream.h
+ *
+ *  Incremental, SAX-style JSON parser.
+ *  Bytes are fed as they arrive, in chunks cut anywhere, and structure, keys
+ *  and scalar values are reported through virtual functions; nothing of the
+ *  document is kept beyond the token being read. ListingParser and
+ *  ChangesParser build on it to turn Drive file listings and the changes feed
+ *  into FileInfo and FileChange records while they download.
+ */
+
+#ifndef JSONSTREAM_H
+#define JSONSTREAM_H
+#include <string>
+#include <vector>
+#include "GDConnect.h"
+
+class JsonStream {
+public:
+	enum Scalar { String, Number, True, False, Null };
+
+	JsonStream();
+	virtual ~JsonStream() {}
+	bool feed(const char * data, std::size_t length);
+	bool finish();
+	void reset();
+	bool failed() const { return error; }
+
+protected:
+	/* Depth of the innermost open container; the top level is 0. In start and
+	   end callbacks, the container being opened or closed is included. */
+	std::size_t depth() const { return stack.size(); }
+	virtual void startObject() {}
+	virtual void endObject() {}
+	virtual void startArray() {}
+	virtual void endArray() {}
+	virtual void key(const std::string& name) {}
+	virtual void scalar(Scalar type, const std::string& text) {}
+
+private:
+	enum State {
+		ExpectValue,        // at the start, after a colon or after a comma in an array
+		ExpectValueOrEnd,   // just after [
+		ExpectKey,          // after a comma in an object
+		ExpectKeyOrEnd,     // just after {
+		ExpectColon,
+		ExpectCommaOrEnd,   // after a value inside a container
+		InString,
+		InNumber,
+		InLiteral,
+		Complete            // the top-level value has been read
+	};
+	State state;
+	std::vector<char> stack;    // '{' or '[' for every open container
+	std::string token;          // text of the string, number or literal being read
+	bool tokenIsKey;
+	int escape;                 // 0 outside escapes, 1 after a backslash, 2 to 5 inside \uXXXX
+	unsigned int codePoint;
+	unsigned int highSurrogate;
+	bool error;
+
+	bool step(char c);
+	bool startValue(char c);
+	void valueDone();
+	bool endString();
+	bool endNumber();
+	bool endLiteral();
+	void appendUtf8(unsigned int cp);
+	void flushSurrogate();
+};
+
+/* Collects the files and nextPageToken of a Drive files.list response */
+class ListingParser : public JsonStream {
+public:
+	std::vector<FileInfo> files;
+	std::string nextPageToken;
+
+	ListingParser();
+	void clear();
+
+protected:
+	void startObject();
+	void endObject();
+	void startArray();
+	void endArray();
+	void key(const std::string& name);
+	void scalar(Scalar type, const std::string& text);
+
+private:
+	std::string topKey;     // member of the response being read
+	std::string fileKey;    // member of the current file being read
+	bool inFiles;           // inside the files array
+	bool inFile;            // inside one of its entries
+	bool inParents;         // inside the parents of that entry
+	bool inProperties;      // inside the appProperties of that entry
+	std::string propertyKey;
+};
+
+/* Collects the changes, nextPageToken and newStartPageToken of a Drive changes.list response.
+   A change whose file is trashed is reported as removed. */
+class ChangesParser : public JsonStream {
+public:
+	std::vector<FileChange> changes;
+	std::string nextPageToken;
+	std::string newStartPageToken;     // only on the last page
+
+	ChangesParser();
+	void clear();
+
+protected:
+	void startObject();
+	void endObject();
+	void startArray();
+	void endArray();
+	void key(const std::string& name);
+	void scalar(Scalar type, const std::string& text);
+
+private:
+	std::string topKey;     // member of the response being read
+	std::string changeKey;  // member of the current change being read
+	std::string fileKey;    // member of the file of that change
+	bool inChanges;         // inside the changes array
+	bool inChange;          // inside one of its entries
+	bool inFile;            // inside the file of that entry
+	bool inParents;         // inside the parents of that file
+	bool inProperties;      // inside the appProperties of that file
+	std::string propertyKey;
+};
+
+#endif // JSONSTREAM_H
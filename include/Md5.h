@@ -0,0 +1,32 @@
+/*
+ * Md5.h
+ *
+ *  Incremental MD5 (RFC 1321), matching the md5Checksum Google Drive
+ *  reports for binary files. Data can be fed in pieces of any size as it
+ *  is read or transferred.
+ */
+
+#ifndef MD5_H
+#define MD5_H
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+class Md5 {
+private:
+	uint32_t state[4];
+	uint64_t length;        // bytes hashed so far
+	unsigned char buffer[64];
+	std::size_t buffered;
+
+	void transform(const unsigned char * block);
+
+public:
+	Md5();
+	void reset();
+	void update(const void * data, std::size_t size);
+	std::string hexDigest();
+	static std::string ofFile(const char * path);
+};
+
+#endif // MD5_H
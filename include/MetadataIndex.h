@@ -0,0 +1,57 @@
+/*
+ * MetadataIndex.h
+ *
+ *  Persistent local index of Google Drive metadata.
+ *  Bootstrapped from a full listing, then kept current through the Drive
+ *  changes feed, so that name and id lookups are answered from memory.
+ *  An index that cannot be brought within its staleness bound answers
+ *  every lookup with a miss, so that callers ask Drive instead.
+ */
+
+#ifndef METADATAINDEX_H
+#define METADATAINDEX_H
+#include <string>
+#include <vector>
+#include <ctime>
+#include <mutex>
+#include <unordered_map>
+#include "GDConnect.h"
+
+class MetadataIndex {
+private:
+	static const int retryPause = 5;    // seconds before syncing again after a failed sync
+
+	GDConnect * drive;
+	std::string indexFilename;
+	std::unordered_map<std::string, FileInfo> files;                 // id -> metadata
+	std::unordered_multimap<std::string, std::string> names;         // name -> ids
+	std::unordered_multimap<std::string, std::string> children;      // parent id -> child ids
+	std::string pageToken;
+	std::time_t lastSync;
+	std::time_t lastAttempt;
+	int maxStaleness;
+	std::mutex dataLock;
+	std::mutex syncLock;
+
+	void insert(const FileInfo& file);
+	void erase(const std::string& id);
+	void clear();
+	int bootstrapLocked();
+	int syncLocked();
+
+public:
+	MetadataIndex(GDConnect * drive, const char * indexFilename = "index.json", int maxStaleness = 60);
+	virtual ~MetadataIndex();
+	int load();
+	int save();
+	int bootstrap();
+	int sync();
+	int refresh();
+	void setMaxStaleness(int seconds) { maxStaleness = seconds; }
+	bool lookup(const std::string& id, FileInfo& file);
+	std::vector<std::string> idsByName(const std::string& name);
+	std::vector<std::string> childrenOf(const std::string& parentId);
+	std::size_t size();
+};
+
+#endif // METADATAINDEX_H
@@ -0,0 +1,119 @@
+/*
+ * Metrics.h
+ *
+ *  Per-request instrumentation of a GDConnect client.
+ *  Every HTTP request is recorded with its libcurl phase timings, bytes,
+ *  status and retries, tagged by operation. The figures are kept as
+ *  histograms, readable in-process or as Prometheus text, and requests and
+ *  multi-step flows can be captured as Chrome trace spans.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <functional>
+#include <curl/curl.h>
+
+/* One finished request */
+struct RequestSample {
+	const char * operation;     // list, metadata, generateIds, initUpload, uploadChunk, media...
+	int code;                   // HTTP status, -1 if no answer was received
+	int retries;                // attempts beyond the first
+	double nameLookup;          // seconds spent in each phase of the last attempt;
+	double connect;             // 0 when a connection was reused
+	double tls;
+	double ttfb;                // from the start of the attempt to the first response byte
+	double total;
+	curl_off_t bytesSent;
+	curl_off_t bytesReceived;
+};
+
+/* Latency histogram with fixed bucket bounds, in seconds */
+class Histogram {
+public:
+	static const int bucketCount = 16;
+	static const double bounds[bucketCount - 1];    // upper bounds; the last bucket is unbounded
+
+	Histogram();
+	void add(double value);
+	double quantile(double q) const;
+	double mean() const { return count ? sum / count : 0; }
+
+	unsigned long long buckets[bucketCount];
+	unsigned long long count;
+	double sum;
+};
+
+/* Aggregated figures of one operation */
+struct OperationStats {
+	enum Phase { NameLookup, Connect, Tls, Ttfb, Total, PhaseCount };
+
+	unsigned long long requests;
+	unsigned long long errors;      // no answer, or a status of 400 and above
+	unsigned long long retries;
+	curl_off_t bytesSent;
+	curl_off_t bytesReceived;
+	std::map<int, unsigned long long> codes;
+	Histogram phases[PhaseCount];
+
+	OperationStats() : requests(0), errors(0), retries(0), bytesSent(0), bytesReceived(0) {}
+};
+
+class Metrics {
+public:
+	typedef std::chrono::steady_clock Clock;
+	typedef std::function<void(const RequestSample& sample)> Observer;
+
+	/* Times a multi-step flow, such as a whole upload, as one trace span */
+	class Span {
+	public:
+		Span(Metrics * metrics, const char * name, const std::string& detail = std::string());
+		~Span();
+	private:
+		Metrics * metrics;
+		const char * name;
+		std::string detail;
+		Clock::time_point start;
+	};
+
+	Metrics();
+	void record(const RequestSample& sample);
+	void record(CURL * handle, const char * operation, int code, int retries);
+	void span(const char * name, const std::string& detail, Clock::time_point start, Clock::time_point end);
+	void setObserver(Observer observer);
+	void setTracing(bool enable, std::size_t maxEvents = 1 << 20);
+	std::map<std::string, OperationStats> snapshot();
+	std::string prometheus();
+	std::string chromeTrace();
+	int writeChromeTrace(const char * path);
+	void reset();
+
+private:
+	struct Event {
+		std::string name;
+		const char * category;  // "request" or "flow"
+		std::string detail;     // what the flow worked on
+		int code;               // requests only
+		curl_off_t bytes;
+		long long start;        // microseconds since the epoch of this object
+		long long duration;
+		int thread;
+	};
+	std::mutex lock;
+	std::map<std::string, OperationStats> operations;
+	Observer observer;
+	bool tracing;
+	std::size_t maxEvents;
+	std::vector<Event> events;
+	std::map<std::thread::id, int> threads;
+	Clock::time_point epoch;
+
+	void trace(Event& event, Clock::time_point start, Clock::time_point end);
+};
+
+#endif // METRICS_H
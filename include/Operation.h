@@ -0,0 +1,23 @@
+/*
+ * Operation.h
+ *
+ *  Operations described as JSON objects, as found in batch manifests and in
+ *  the requests sent to the transfer daemon, and their JSON results.
+ *  Operations: ls {query}, resolve {name}, get {fileId|name, path},
+ *  put {path, name, parent, fileId, appProperties}, mkdir {name, parent},
+ *  sync {direction: up|down, local, remote}. The path of a get is required
+ *  and absolute.
+ */
+
+#ifndef OPERATION_H
+#define OPERATION_H
+#include <json/json.h>
+#include "GDConnect.h"
+#include "TreeSync.h"
+
+void runOperation(GDConnect& connection, const Json::Value& op, Json::Value& result);
+Json::Value describe(const FileInfo& file);
+Json::Value describe(const SyncStats& stats);
+FileInfo fileFromJson(const Json::Value& obj);
+
+#endif // OPERATION_H
@@ -0,0 +1,71 @@
+/*
+ * RemoteFile.h
+ *
+ *  Random-access reads of a Google Drive file without downloading it whole.
+ *  The content is fetched in fixed-size blocks with HTTP Range requests and
+ *  kept in an LRU cache bounded by a memory budget. When reads run
+ *  sequentially, the blocks ahead are requested before they are needed,
+ *  over a window that doubles while the pattern holds.
+ */
+
+#ifndef REMOTEFILE_H
+#define REMOTEFILE_H
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <sys/types.h>
+#include "GDConnect.h"
+
+/* Cache figures of a RemoteFile */
+struct RemoteFileStats {
+	unsigned long long hits;        // blocks found in the cache, or already on their way
+	unsigned long long misses;      // blocks a read had to request
+	unsigned long long prefetched;  // blocks requested ahead of a read
+	unsigned long long evicted;
+	curl_off_t bytesFetched;
+};
+
+class RemoteFile {
+public:
+	RemoteFile(GDConnect * drive, std::size_t blockSize = 1 << 20, std::size_t cacheBytes = 64 << 20,
+	           std::size_t maxReadAhead = 8);
+	virtual ~RemoteFile();
+	int open(const char * id);
+	void close();
+	ssize_t pread(void * buffer, std::size_t length, curl_off_t offset);
+	curl_off_t size() const { return fileSize; }
+	RemoteFileStats stats();
+
+private:
+	enum BlockState { Loading, Ready };
+	struct Block {
+		BlockState state;
+		std::vector<char> data;
+		std::list<std::size_t>::iterator recent;   // position in lru, once Ready
+	};
+
+	GDConnect * drive;
+	std::string fileId;
+	curl_off_t fileSize;
+	std::size_t blockSize;
+	std::size_t capacity;           // blocks the memory budget holds
+	std::size_t maxReadAhead;
+	std::mutex lock;                // guards everything below, pairs with changed
+	std::condition_variable changed;
+	std::unordered_map<std::size_t, Block> blocks;
+	std::list<std::size_t> lru;     // Ready blocks, most recently read first
+	std::size_t loading;            // blocks in flight
+	Cancellation cancel;
+	curl_off_t nextOffset;          // where a sequential read would continue
+	std::size_t window;             // current read-ahead, in blocks
+	RemoteFileStats counters;
+
+	void claim(std::size_t index);
+	void fetch(std::size_t index);
+	void finished(std::size_t index, std::shared_ptr<std::vector<char> > data, int code);
+};
+
+#endif // REMOTEFILE_H
@@ -0,0 +1,55 @@
+/*
+ * RequestScheduler.h
+ *
+ *  Admission control for every HTTP call made by a GDConnect client.
+ *  Token buckets cap requests/sec and bytes/sec, metadata calls go ahead of
+ *  bulk transfers, and Drive's rate limit errors slow the request rate down
+ *  (then let it recover gradually) and are retried with jittered backoff.
+ */
+
+#ifndef REQUESTSCHEDULER_H
+#define REQUESTSCHEDULER_H
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <random>
+#include <curl/curl.h>
+
+class RequestScheduler {
+public:
+	enum Priority { Metadata = 0, Bulk = 1, PriorityCount = 2 };
+
+	RequestScheduler(double requestsPerSecond = 100, double bytesPerSecond = 0);
+	void setRequestRate(double perSecond);
+	void setByteRate(double perSecond);
+	double currentRequestRate();
+	void acquire(Priority priority, curl_off_t bytes = 0);
+	long tryAcquire(Priority priority, curl_off_t bytes = 0);
+	void charge(curl_off_t bytes);
+	long complete(int code, const std::string& reason, long retryAfter, int attempt);
+	long backoff(int attempt);
+
+private:
+	typedef std::chrono::steady_clock Clock;
+	struct Bucket {
+		double rate;        // tokens per second, 0 for unlimited
+		double tokens;      // may go negative: bytes are charged in full, then paid back
+		Clock::time_point last;
+	};
+	std::mutex lock;
+	std::condition_variable wake;
+	Bucket requests;
+	Bucket bytes;
+	double maxRequestRate;
+	int waiting[PriorityCount];
+	Clock::time_point pausedUntil;
+	Clock::time_point lastThrottle;
+	std::mt19937 rng;
+
+	void refill(Bucket& bucket, Clock::time_point now);
+	long delayLocked(Priority priority, Clock::time_point now);
+	void takeLocked(curl_off_t length);
+};
+
+#endif // REQUESTSCHEDULER_H
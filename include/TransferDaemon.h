@@ -0,0 +1,59 @@
+/*
+ * TransferDaemon.h
+ *
+ *  Long-running server sharing one warm GDConnect client, with its token,
+ *  connection pool and metadata index, among the local processes of a node.
+ *  Clients (see DaemonClient) send operations over a Unix domain socket, one
+ *  JSON object per line, and get one JSON result per line back. Identical
+ *  operations in flight at the same time are performed once, and a single
+ *  limit on concurrent operations applies across all clients.
+ */
+
+#ifndef TRANSFERDAEMON_H
+#define TRANSFERDAEMON_H
+#include <string>
+#include <map>
+#include <set>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <future>
+#include <condition_variable>
+#include <json/json.h>
+#include "GDConnect.h"
+
+class TransferDaemon {
+public:
+	TransferDaemon(GDConnect * connection, std::size_t maxConcurrent = 8);
+	virtual ~TransferDaemon();
+	bool start(const char * socketPath);
+	void stop();
+	Json::Value status();
+
+private:
+	GDConnect * connection;
+	std::string path;
+	int listener;
+	std::atomic<bool> listening;
+	std::thread acceptor;
+	std::mutex connectionLock;      // guards sockets and active, pairs with idle
+	std::set<int> sockets;
+	std::size_t active;             // connection threads still running
+	std::condition_variable idle;
+	std::mutex flightLock;          // guards inFlight and the counters below, pairs with slotFree
+	std::map<std::string, std::shared_future<Json::Value> > inFlight;  // operation key -> its result
+	std::condition_variable slotFree;
+	std::size_t maxConcurrent;
+	std::size_t performing;         // operations being performed
+	std::size_t waiting;            // operations queued for a slot
+	unsigned long long served;
+	unsigned long long shared;      // answered with the result of an identical operation
+
+	void acceptLoop();
+	void serve(int fd);
+	Json::Value handle(const Json::Value& request);
+	Json::Value perform(const Json::Value& op);
+	static bool sendAll(int fd, const std::string& data);
+};
+
+#endif // TRANSFERDAEMON_H
@@ -0,0 +1,57 @@
+/*
+ * TransferQueue.h
+ *
+ *  Drives many cURL easy handles concurrently from a single thread
+ *  through a curl_multi event loop, with a bound on transfers in flight.
+ */
+
+#ifndef TRANSFERQUEUE_H
+#define TRANSFERQUEUE_H
+#include <cstddef>
+#include <deque>
+#include <map>
+#include <functional>
+#include <chrono>
+#include <curl/curl.h>
+
+class TransferQueue {
+public:
+	/* Called once a transfer is over and its handle removed from the multi stack.
+	   The completion owns the handle: it must release it or add it again. */
+	typedef std::function<void(CURL *, CURLcode)> Completion;
+	/* Asked before each queued transfer starts: returns 0 to let it start,
+	   or how many milliseconds to hold it (and those queued behind it) back */
+	typedef std::function<long(CURL *)> Gate;
+
+	TransferQueue(std::size_t maxInFlight = 8);
+	virtual ~TransferQueue();
+	void add(CURL * handle, Completion done, long delayMs = 0);
+	int run();
+	int step(int timeoutMs);
+	void wakeup();
+	void abort();
+	void setMaxInFlight(std::size_t n) { maxInFlight = n ? n : 1; }
+	void setGate(Gate g) { gate = g; }
+	std::size_t inFlight() { return active.size(); }
+	std::size_t queued() { return pending.size() + delayed.size(); }
+
+private:
+	struct Transfer {
+		CURL * handle;
+		Completion done;
+	};
+	typedef std::chrono::steady_clock Clock;
+	CURLM * multi;
+	std::deque<Transfer> pending;
+	std::multimap<Clock::time_point, Transfer> delayed;   // transfers held back until their due time
+	std::map<CURL *, Completion> active;
+	std::size_t maxInFlight;
+	Gate gate;
+	long gateDelay;
+
+	void fill();
+	long untilDue();
+	void reap();
+};
+
+#endif // TRANSFERQUEUE_H
@@ -0,0 +1,69 @@
+/*
+ * TreeSync.h
+ *
+ *  Mirrors a local directory tree to a Google Drive folder and back.
+ *  Only new or changed files are transferred: local files are hashed on a
+ *  pool of threads and compared with the md5Checksum Drive keeps for each file.
+ */
+
+#ifndef TREESYNC_H
+#define TREESYNC_H
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <functional>
+#include <sys/types.h>
+#include "GDConnect.h"
+
+/* Outcome of a tree sync */
+struct SyncStats {
+	std::size_t scanned;        // files considered
+	std::size_t transferred;
+	std::size_t skipped;        // identical on both sides
+	std::size_t failed;
+	std::size_t foldersCreated;
+	curl_off_t bytes;
+	double seconds;
+};
+
+class TreeSync {
+private:
+	/* One file present on at least one side, under its path relative to the tree root */
+	struct Entry {
+		std::string path;
+		std::string localPath;
+		bool local;
+		long long localSize;
+		time_t localMtime;
+		bool remote;
+		FileInfo remoteFile;
+		long long expectedSize;     // of a local copy matching remoteFile
+		std::string expectedMd5;
+		bool transfer;
+		bool ok;
+
+		Entry() : local(false), localSize(0), localMtime(0), remote(false), expectedSize(0), transfer(false), ok(false) {}
+	};
+	GDConnect * drive;
+	std::size_t hashThreads;
+	std::size_t maxTransfers;
+
+	static void parallel(std::size_t count, std::size_t threads, const std::function<void(std::size_t)>& work);
+	int listRemote(const std::string& folderId, std::map<std::string, Entry>& entries,
+	               std::map<std::string, std::string>& folders);
+	int listLocal(const std::string& root, const std::string& relative, std::map<std::string, Entry>& entries,
+	              std::vector<std::string>& dirs, std::set<std::pair<dev_t, ino_t> >& visited);
+	std::size_t createFolders(const std::vector<std::string>& dirs, std::map<std::string, std::string>& folders);
+	void compare(std::vector<Entry *>& entries, bool upward);
+
+public:
+	TreeSync(GDConnect * drive, std::size_t hashThreads = 0, std::size_t maxTransfers = 4);
+	virtual ~TreeSync();
+	void setMaxTransfers(std::size_t n) { maxTransfers = n ? n : 1; }
+	SyncStats syncUp(const char * localDir, const char * remoteFolderId);
+	SyncStats syncDown(const char * remoteFolderId, const char * localDir);
+};
+
+#endif // TREESYNC_H
@@ -1,88 +1,420 @@
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <csignal>
 #include <stdlib.h>
+#include <unistd.h>
+#include <json/json.h>
 #include "GDConnect.h"
+#include "Operation.h"
+#include "MetadataIndex.h"
+#include "TransferDaemon.h"
 
 using namespace std;
 
+static void usage()
+{
+    std::cout << "Usage: GDConnect <config.json> [options] [command]" << std::endl
+              << "Without a command, an interactive menu is shown. Commands:" << std::endl
+              << "  ls [query]                       list files, optionally matching a Drive search query" << std::endl
+              << "  resolve <name>                   print the ID of the file with that name" << std::endl
+              << "  get <id> [path]                  download a file, under its Drive name by default" << std::endl
+              << "  put <file> [parentId]            upload a file" << std::endl
+              << "  mkdir <name> [parentId]          create a folder" << std::endl
+              << "  sync up <localDir> <folderId>    mirror a local tree to a Drive folder" << std::endl
+              << "  sync down <folderId> <localDir>  mirror a Drive folder to a local tree" << std::endl
+              << "  batch <manifest|->               run a JSON or NDJSON manifest of operations" << std::endl
+              << "  serve <socket>                   keep the session open and run operations for local" << std::endl
+              << "                                   processes connecting to a Unix socket, until stopped" << std::endl
+              << "Options:" << std::endl
+              << "  --jobs <n>                       operations run in parallel by batch or serve (default 8)" << std::endl
+              << "  --metrics <file>                 write request metrics in Prometheus format on exit" << std::endl
+              << "  --trace <file>                   write a Chrome trace of requests and flows on exit" << std::endl;
+}
+
+/* The original menu-driven mode */
+static int interactive(GDConnect& connection)
+{
+    std::string input;
+    std::pair<std::string, int> result;
+    bool repeat = true;
+    do
+    {
+        std::cout << "Select an option:" << std::endl;
+        std::cout << "1 - List files on Google Drive" << std::endl;
+        std::cout << "2 - Get a file id using filename" << std::endl;
+        std::cout << "3 - Download a file" << std::endl;
+        std::cout << "4 - Upload a file" << std::endl;
+        std::cout << "5 - Renew token" << std::endl;
+        std::cout << "6 - Quit" << std::endl;
+        if (!getline(std::cin, input))
+            break;
+        int choice = atoi(input.c_str());
+        switch(choice)
+        {
+        case 1:
+            std::cout << "Listing files" << std::endl;
+            connection.listFiles();
+            break;
+        case 2:
+            std::cout << "Enter the filename:" << std::endl;
+            getline(std::cin, input);
+            std::cout << "File id: " << connection.getFileId(input.c_str()) << std::endl;
+            break;
+        case 3:
+            std::cout << "Enter the file id:" << std::endl;
+            getline(std::cin, input);
+            connection.getFileById(input.c_str());
+            break;
+        case 4:
+            std::cout << "Enter the file name:" << std::endl;
+            getline(std::cin, input);
+            result = connection.putFile(input.c_str());
+            if (!result.second) {
+                std::cout << "New file id: " << result.first << std::endl;
+            }
+            break;
+        case 5:
+            std::cout << "Renewing token" << std::endl;
+            connection.renewToken();
+            break;
+        case 6:
+            std::cout << "Exiting" << std::endl;
+            repeat = false;
+            break;
+        }
+    }
+    while (repeat);
+    return 0;
+}
+
+/* Resolves the relative paths of an operation against the working directory */
+static void resolvePaths(Json::Value& op)
+{
+    const char * pathFields[] = { "path", "local" };
+    for (int i = 0; i < 2; i++)
+    {
+        if (!op.isMember(pathFields[i]))
+            continue;
+        std::string path = op[pathFields[i]].asString();
+        if (path.empty() || path[0] == '/')
+            continue;
+        char * cwd = getcwd(NULL, 0);
+        if (!cwd)
+            return;
+        op[pathFields[i]] = std::string(cwd) + "/" + path;
+        free(cwd);
+    }
+}
+
+/* Reads a manifest: either a JSON array of operations, or one JSON object per line */
+static bool readManifest(std::istream& in, std::vector<Json::Value>& ops, std::string& error)
+{
+    std::stringstream content;
+    content << in.rdbuf();
+    std::string text = content.str();
+    Json::Reader reader;
+    std::size_t first = text.find_first_not_of(" \t\r\n");
+    if (first != std::string::npos && text[first] == '[')
+    {
+        Json::Value root;
+        if (!reader.parse(text, root) || !root.isArray())
+        {
+            error = reader.getFormattedErrorMessages();
+            return false;
+        }
+        for (unsigned int i = 0; i < root.size(); i++)
+            ops.push_back(root[i]);
+        return true;
+    }
+    std::istringstream lines(text);
+    std::string line;
+    int number = 0;
+    while (std::getline(lines, line))
+    {
+        number++;
+        if (line.find_first_not_of(" \t\r") == std::string::npos)
+            continue;
+        Json::Value op;
+        if (!reader.parse(line, op) || !op.isObject())
+        {
+            std::stringstream message;
+            message << "line " << number << ": " << reader.getFormattedErrorMessages();
+            error = message.str();
+            return false;
+        }
+        ops.push_back(op);
+    }
+    return true;
+}
+
+/* Runs every operation of a manifest on jobs threads sharing one client, so that
+    the token and the pooled connections are reused throughout. One JSON result
+    per operation is written to out as it completes. Returns the number of failures. */
+static std::size_t runBatch(GDConnect& connection, const std::vector<Json::Value>& ops, std::size_t jobs, std::ostream& out)
+{
+    std::atomic<std::size_t> next(0);
+    std::atomic<std::size_t> failed(0);
+    std::mutex outLock;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (std::size_t w = 0; w < std::min(jobs, ops.size()); w++)
+    {
+        workers.push_back(std::thread([&]()
+        {
+            Json::FastWriter writer;
+            std::size_t i;
+            while ((i = next++) < ops.size())
+            {
+                Json::Value result;
+                result["index"] = (Json::UInt64) i;
+                if (ops[i].isMember("id"))
+                    result["id"] = ops[i]["id"];
+                result["op"] = ops[i]["op"];
+                std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+                runOperation(connection, ops[i], result);
+                result["seconds"] = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+                if (!result["ok"].asBool())
+                    failed++;
+                std::string line = writer.write(result);
+                std::lock_guard<std::mutex> guard(outLock);
+                out << line << std::flush;
+            }
+        }));
+    }
+    for (std::size_t w = 0; w < workers.size(); w++)
+        workers[w].join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << "Ran " << ops.size() << " operations (" << failed << " failed) in " << seconds << " seconds: "
+              << (seconds > 0 ? ops.size() / seconds : 0) << " ops/sec" << std::endl;
+    return failed;
+}
+
+/* Builds the manifest entry equivalent to a command line */
+static bool commandOperation(const std::vector<std::string>& args, Json::Value& op)
+{
+    const std::string& command = args[0];
+    op["op"] = command;
+    if (command == "ls" && args.size() <= 2)
+    {
+        if (args.size() == 2)
+            op["query"] = args[1];
+        return true;
+    }
+    if (command == "resolve" && args.size() == 2)
+    {
+        op["name"] = args[1];
+        return true;
+    }
+    if (command == "get" && (args.size() == 2 || args.size() == 3))
+    {
+        op["fileId"] = args[1];
+        if (args.size() == 3)
+            op["path"] = args[2];
+        return true;
+    }
+    if (command == "put" && (args.size() == 2 || args.size() == 3))
+    {
+        op["path"] = args[1];
+        if (args.size() == 3)
+            op["parent"] = args[2];
+        return true;
+    }
+    if (command == "mkdir" && (args.size() == 2 || args.size() == 3))
+    {
+        op["name"] = args[1];
+        if (args.size() == 3)
+            op["parent"] = args[2];
+        return true;
+    }
+    if (command == "sync" && args.size() == 4 && (args[1] == "up" || args[1] == "down"))
+    {
+        op["direction"] = args[1];
+        op["local"] = args[1] == "up" ? args[2] : args[3];
+        op["remote"] = args[1] == "up" ? args[3] : args[2];
+        return true;
+    }
+    return false;
+}
+
+/* Prints the result of a single command for a person (or a shell script) to read */
+static void printResult(const Json::Value& op, const Json::Value& result, std::ostream& out)
+{
+    std::string kind = op["op"].asString();
+    if (!result["ok"].asBool())
+    {
+        std::cerr << kind << " failed";
+        if (result.isMember("error"))
+            std::cerr << ": " << result["error"].asString();
+        else if (result.isMember("code"))
+            std::cerr << " with code " << result["code"].asInt();
+        std::cerr << std::endl;
+    }
+    if (kind == "ls")
+    {
+        const Json::Value& files = result["files"];
+        for (unsigned int i = 0; i < files.size(); i++)
+            out << files[i]["id"].asString() << "\t" << files[i]["size"].asInt64() << "\t"
+                << files[i]["name"].asString() << std::endl;
+    }
+    else if ((kind == "resolve" || kind == "put" || kind == "mkdir") && result["ok"].asBool())
+        out << result["fileId"].asString() << std::endl;
+    else if (kind == "sync")
+    {
+        Json::FastWriter writer;
+        out << writer.write(result["stats"]);
+    }
+}
+
+/* Serves operations over socketPath until SIGINT or SIGTERM, with names resolved
+    from a metadata index kept next to the token */
+static int serve(GDConnect& connection, const char * socketPath, std::size_t jobs, sigset_t& signals)
+{
+    MetadataIndex index(&connection);
+    index.load();
+    connection.setMetadataIndex(&index);
+    TransferDaemon daemon(&connection, jobs);
+    if (!daemon.start(socketPath))
+    {
+        connection.setMetadataIndex(NULL);
+        return 1;
+    }
+    std::cerr << "Serving on " << socketPath << std::endl;
+    int received;
+    sigwait(&signals, &received);
+    daemon.stop();
+    connection.setMetadataIndex(NULL);
+    index.save();
+    Json::Value status = daemon.status();
+    std::cerr << "Served " << status["served"].asUInt64() << " requests ("
+              << status["shared"].asUInt64() << " shared with an identical request)" << std::endl;
+    return 0;
+}
+
 int main(int argc, char* argv[])
 {
-    if (argc != 2)
+    std::vector<std::string> args;
+    std::size_t jobs = 8;
+    std::string metricsFile;
+    std::string traceFile;
+    for (int i = 2; i < argc; i++)
     {
-        std::cout << "Usage: GDConnect <config.json>" << std::endl;
-        return 0;
+        if (!strcmp(argv[i], "--jobs") && i + 1 < argc)
+            jobs = std::max(1, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "--metrics") && i + 1 < argc)
+            metricsFile = argv[++i];
+        else if (!strcmp(argv[i], "--trace") && i + 1 < argc)
+            traceFile = argv[++i];
+        else
+            args.push_back(argv[i]);
     }
+    Json::Value single;
+    std::vector<Json::Value> ops;
+    bool manifest = !args.empty() && args[0] == "batch";
+    bool daemon = !args.empty() && args[0] == "serve";
+    if (argc < 2 || (!args.empty() && !manifest && !daemon && !commandOperation(args, single))
+            || ((manifest || daemon) && args.size() != 2))
+    {
+        usage();
+        return 2;
+    }
+    if (manifest)
+    {
+        std::string error;
+        std::ifstream manifestFile;
+        if (args[1] != "-")
+        {
+            manifestFile.open(args[1].c_str());
+            if (!manifestFile.is_open())
+            {
+                std::cerr << "Unable to open manifest " << args[1] << std::endl;
+                return 2;
+            }
+        }
+        if (!readManifest(args[1] == "-" ? std::cin : manifestFile, ops, error))
+        {
+            std::cerr << "Invalid manifest: " << error << std::endl;
+            return 2;
+        }
+        for (std::size_t i = 0; i < ops.size(); i++)
+            resolvePaths(ops[i]);
+    }
+    resolvePaths(single);
+
+    // the daemon waits for termination signals on the main thread, so every thread
+    // started from here on (by the client as well) must leave them blocked
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    if (daemon)
+        pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    // commands keep stdout for their results: the library's progress messages go to stderr
+    std::ostream out(std::cout.rdbuf());
+    if (!args.empty())
+        std::cout.rdbuf(std::cerr.rdbuf());
+    int status = 0;
     try
     {
         GDConnect connection;
         int err = connection.init(argv[1]);
         if (!connection.valid())
         {
-            std::cout << "Connection did not open properly" << std::endl;
-            return -1;
+            std::cerr << "Connection did not open properly" << std::endl;
+            status = -1;
         }
-
-        if (!err)
+        else if (err)
         {
-            std::string input;
-            std::pair<std::string, int> result;
-            bool repeat = true;
-            do
+            std::cerr << "Unable to acquire access token" << std::endl;
+            status = -1;
+        }
+        else
+        {
+            if (!traceFile.empty())
+                connection.getMetrics().setTracing(true);
+            if (args.empty())
+                status = interactive(connection);
+            else if (daemon)
+                status = serve(connection, args[1].c_str(), jobs, signals);
+            else if (manifest)
+                status = runBatch(connection, ops, jobs, out) ? 1 : 0;
+            else
             {
-                std::cout << "Select an option:" << std::endl;
-                std::cout << "1 - List files on Google Drive" << std::endl;
-                std::cout << "2 - Get a file id using filename" << std::endl;
-                std::cout << "3 - Download a file" << std::endl;
-                std::cout << "4 - Upload a file" << std::endl;
-                std::cout << "5 - Renew token" << std::endl;
-                std::cout << "6 - Quit" << std::endl;
-                getline(std::cin, input);
-                int choice = atoi(input.c_str());
-                switch(choice)
+                // a download without a path goes under the file's Drive name
+                FileInfo file;
+                if (single["op"].asString() == "get" && !single.isMember("path")
+                        && !connection.getFileInfo(single["fileId"].asString().c_str(), file))
                 {
-                case 1:
-                    std::cout << "Listing files" << std::endl;
-                    connection.listFiles();
-                    break;
-                case 2:
-                    std::cout << "Enter the filename:" << std::endl;
-                    getline(std::cin, input);
-                    std::cout << "File id: " << connection.getFileId(input.c_str()) << std::endl;
-                    break;
-                case 3:
-                    std::cout << "Enter the file id:" << std::endl;
-                    getline(std::cin, input);
-                    connection.getFileById(input.c_str());
-                    break;
-                case 4:
-                    std::cout << "Enter the file name:" << std::endl;
-                    getline(std::cin, input);
-                    result = connection.putFile(input.c_str());
-                    if (!result.second) {
-                        std::cout << "New file id: " << result.first << std::endl;
-                    }
-                    break;
-                case 5:
-                    std::cout << "Renewing token" << std::endl;
-                    connection.renewToken();
-                    break;
-                case 6:
-                    std::cout << "Exiting" << std::endl;
-                    repeat = false;
-                    break;
+                    single["path"] = file.name;
+                    resolvePaths(single);
                 }
+                Json::Value result;
+                runOperation(connection, single, result);
+                printResult(single, result, out);
+                status = result["ok"].asBool() ? 0 : 1;
             }
-            while (repeat);
-        }
-        else
-        {
-            std::cout << "Unable to acquire access token" << std::endl;
-            return -1;
+            if (!metricsFile.empty())
+            {
+                std::ofstream metricsOut(metricsFile.c_str());
+                metricsOut << connection.getMetrics().prometheus();
+            }
+            if (!traceFile.empty())
+                connection.getMetrics().writeChromeTrace(traceFile.c_str());
         }
-        return 0;
     }
     catch (const char * e)
     {
-        std::cout << e << std::endl;
+        std::cerr << e << std::endl;
+        status = -1;
     }
-
+    std::cout.rdbuf(out.rdbuf());
+    return status;
 }
@@ -0,0 +1,128 @@
+/*
+ * AsyncEngine.cc
+ *
+ *  I/O thread for asynchronous requests: every transfer and every follow-up
+ *  step of an asynchronous operation runs here, on one curl_multi stack.
+ */
+
+#include "AsyncEngine.h"
+#include <cstdio>
+#include <algorithm>
+
+AsyncEngine::AsyncEngine(std::size_t maxInFlight) : queue(maxInFlight), stop(false)
+{
+    loop = std::thread(&AsyncEngine::run, this);
+}
+
+/* Stops the I/O thread. Transfers still queued or in flight are reported as
+   aborted to their completions, and pending steps are run so that every
+   operation gets to finish (with an error) rather than being dropped. */
+AsyncEngine::~AsyncEngine()
+{
+    stop = true;
+    queue.wakeup();
+    loop.join();
+}
+
+/* Queues a prepared easy handle; safe to call from any thread.
+   done runs on the I/O thread and owns the handle, as with TransferQueue. */
+void AsyncEngine::add(CURL * handle, TransferQueue::Completion done)
+{
+    Transfer transfer;
+    transfer.handle = handle;
+    transfer.done = done;
+    {
+        std::lock_guard<std::mutex> guard(inboxLock);
+        transfers.push_back(transfer);
+    }
+    queue.wakeup();
+}
+
+/* Runs task on the I/O thread as soon as possible; safe to call from any thread */
+void AsyncEngine::post(Task task)
+{
+    {
+        std::lock_guard<std::mutex> guard(inboxLock);
+        tasks.push_back(task);
+    }
+    queue.wakeup();
+}
+
+/* Runs task on the I/O thread once delay has passed, without holding up other transfers.
+   Once the engine is stopping, delayed tasks run straight away. */
+void AsyncEngine::after(std::chrono::milliseconds delay, Task task)
+{
+    {
+        std::lock_guard<std::mutex> guard(inboxLock);
+        timers.insert(std::make_pair(Clock::now() + delay, task));
+    }
+    queue.wakeup();
+}
+
+/* Makes a transfer abort as soon as token is cancelled; token must outlive the transfer */
+void AsyncEngine::watch(CURL * handle, CancelToken * token)
+{
+    if (!token)
+        return;
+    curl_easy_setopt(handle, CURLOPT_XFERINFOFUNCTION, progress);
+    curl_easy_setopt(handle, CURLOPT_XFERINFODATA, token);
+    curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 0L);
+}
+
+/* Progress callback: returning non-zero makes cURL fail the transfer with CURLE_ABORTED_BY_CALLBACK */
+int AsyncEngine::progress(void * clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
+{
+    return static_cast<CancelToken *>(clientp)->cancelled() ? 1 : 0;
+}
+
+/* Moves new transfers onto the queue and runs posted tasks and due timers
+   (all timers if dueOnly is false). Returns true if anything was done. */
+bool AsyncEngine::drain(bool dueOnly)
+{
+    std::vector<Transfer> newTransfers;
+    std::vector<Task> ready;
+    {
+        std::lock_guard<std::mutex> guard(inboxLock);
+        newTransfers.swap(transfers);
+        ready.swap(tasks);
+        std::multimap<Clock::time_point, Task>::iterator end = dueOnly ? timers.upper_bound(Clock::now()) : timers.end();
+        for (std::multimap<Clock::time_point, Task>::iterator it = timers.begin(); it != end; ++it)
+            ready.push_back(it->second);
+        timers.erase(timers.begin(), end);
+    }
+    for (std::size_t i = 0; i < newTransfers.size(); i++)
+        queue.add(newTransfers[i].handle, newTransfers[i].done);
+    for (std::size_t i = 0; i < ready.size(); i++)
+        ready[i](); // tasks may add transfers or post further tasks
+    return !newTransfers.empty() || !ready.empty();
+}
+
+/* Body of the I/O thread */
+void AsyncEngine::run()
+{
+    while (!stop)
+    {
+        drain(true);
+        int timeoutMs = 1000;
+        {
+            std::lock_guard<std::mutex> guard(inboxLock);
+            if (!transfers.empty() || !tasks.empty())
+                timeoutMs = 0;
+            else if (!timers.empty())
+            {
+                long long due = std::chrono::duration_cast<std::chrono::milliseconds>(timers.begin()->first - Clock::now()).count();
+                timeoutMs = (int) std::max(0LL, std::min(due, (long long) timeoutMs));
+            }
+        }
+        if (queue.step(timeoutMs))
+        {
+            fprintf(stderr, "Asynchronous transfer loop failed\n");
+            break;
+        }
+    }
+    // shutting down: abort whatever is left, including steps queued by the aborts themselves
+    stop = true;
+    do
+        queue.abort();
+    while (drain(false));
+}
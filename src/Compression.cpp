@@ -0,0 +1,191 @@
+/*
+ * Compression.cc
+ *
+ *  gzip compression and decompression stages built on zlib.
+ */
+
+#include "Compression.h"
+#include <cstring>
+#include <algorithm>
+
+/* zlib counts input in uInt, so large buffers are fed in slices */
+static const std::size_t sliceSize = 1 << 20;
+
+CompressionPipeline::CompressionPipeline(const char * data, std::size_t length, int level, std::size_t blockSize,
+                                         std::size_t depth, const Notify& ready)
+    : data(data), length(length), level(level), blockSize(blockSize ? blockSize : 1), depth(depth ? depth : 1),
+      ready(ready), finished(false), failed(false), stop(false), total(0)
+{
+    worker = std::thread(&CompressionPipeline::run, this);
+}
+
+/* Abandons compression if the consumer gave up early */
+CompressionPipeline::~CompressionPipeline()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stop = true;
+    }
+    changed.notify_all();
+    worker.join();
+}
+
+/* Waits for the next compressed block. Returns false once the stream is
+   over, or if compression failed; last is set on the final block. */
+bool CompressionPipeline::next(std::string& block, bool& last)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    changed.wait(guard, [this]() { return !blocks.empty() || finished || failed; });
+    if (blocks.empty())
+        return false;
+    block.swap(blocks.front());
+    blocks.pop_front();
+    last = finished && blocks.empty();
+    total += block.size();
+    changed.notify_all(); // room for the worker again
+    return true;
+}
+
+/* Takes the next compressed block if one is ready, without waiting.
+   Returns 1 with a block, 0 if none is ready yet, and -1 once the stream is
+   over or if compression failed; last is set on the final block. */
+int CompressionPipeline::poll(std::string& block, bool& last)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (blocks.empty())
+        return finished || failed ? -1 : 0;
+    block.swap(blocks.front());
+    blocks.pop_front();
+    last = finished && blocks.empty();
+    total += block.size();
+    changed.notify_all();
+    return 1;
+}
+
+/* Worker side: waits for room in the queue. Returns false if the consumer went away */
+bool CompressionPipeline::push(std::string& block, bool last)
+{
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        changed.wait(guard, [this]() { return blocks.size() < depth || stop; });
+        if (stop)
+            return false;
+        blocks.push_back(std::string());
+        blocks.back().swap(block);
+        if (last)
+            finished = true;
+        changed.notify_all();
+    }
+    if (ready)
+        ready();
+    return true;
+}
+
+/* Worker side: gives up on the stream */
+void CompressionPipeline::fail()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        failed = true;
+        changed.notify_all();
+    }
+    if (ready)
+        ready();
+}
+
+void CompressionPipeline::run()
+{
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    // windowBits 15 + 16 writes a gzip header, so the object is also a valid .gz file
+    if (deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        fail();
+        return;
+    }
+    std::string pending;
+    std::size_t offset = 0;
+    char out[256 * 1024];
+    int status = Z_OK;
+    while (status != Z_STREAM_END)
+    {
+        if (stream.avail_in == 0 && offset < length)
+        {
+            std::size_t slice = std::min(sliceSize, length - offset);
+            stream.next_in = (Bytef *) (data + offset);
+            stream.avail_in = (uInt) slice;
+            offset += slice;
+        }
+        stream.next_out = (Bytef *) out;
+        stream.avail_out = sizeof(out);
+        status = deflate(&stream, offset == length && stream.avail_in == 0 ? Z_FINISH : Z_NO_FLUSH);
+        if (status == Z_STREAM_ERROR)
+            break;
+        pending.append(out, sizeof(out) - stream.avail_out);
+        while (pending.size() > blockSize || (pending.size() == blockSize && status != Z_STREAM_END))
+        {
+            std::string block = pending.substr(0, blockSize);
+            pending.erase(0, blockSize);
+            if (!push(block, false))
+            {
+                deflateEnd(&stream);
+                return;
+            }
+        }
+    }
+    deflateEnd(&stream);
+    if (status != Z_STREAM_END)
+    {
+        fail();
+        return;
+    }
+    push(pending, true);
+}
+
+Inflater::Inflater(const Output& out) : out(out), done(false), outputBytes(0)
+{
+    memset(&stream, 0, sizeof(stream));
+    ready = inflateInit2(&stream, 15 + 16) == Z_OK; // gzip wrapper expected
+}
+
+Inflater::~Inflater()
+{
+    if (ready)
+        inflateEnd(&stream);
+}
+
+/* Decompresses one piece of input. Returns false on corrupt input, data past
+   the end of the stream, or if the output refused the data. */
+bool Inflater::write(const char * data, std::size_t length)
+{
+    if (!ready || (done && length > 0))
+        return false;
+    char buffer[256 * 1024];
+    while (length > 0)
+    {
+        std::size_t slice = std::min(sliceSize, length);
+        stream.next_in = (Bytef *) data;
+        stream.avail_in = (uInt) slice;
+        data += slice;
+        length -= slice;
+        do
+        {
+            stream.next_out = (Bytef *) buffer;
+            stream.avail_out = sizeof(buffer);
+            int status = inflate(&stream, Z_NO_FLUSH);
+            if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR)
+                return false;
+            std::size_t n = sizeof(buffer) - stream.avail_out;
+            outputBytes += n;
+            if (n > 0 && !out(buffer, n))
+                return false;
+            if (status == Z_STREAM_END)
+            {
+                done = true;
+                return stream.avail_in == 0 && length == 0;
+            }
+        }
+        while (stream.avail_out == 0 || stream.avail_in > 0);
+    }
+    return true;
+}
@@ -0,0 +1,127 @@
+/*
+ * CurlPool.cc
+ *
+ *  Pool of reusable cURL easy handles sharing DNS, TLS session and
+ *  connection caches across all requests made by a GDConnect client.
+ */
+
+#include "CurlPool.h"
+
+CurlPool::CurlPool(std::size_t maxIdle) : maxIdle(maxIdle), reuse(true)
+{
+    share = curl_share_init();
+    if (share)
+    {
+        curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lockShare);
+        curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlockShare);
+        curl_share_setopt(share, CURLSHOPT_USERDATA, this);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    }
+}
+
+CurlPool::~CurlPool()
+{
+    // every handle must be detached from the share before it can be cleaned up
+    for (std::size_t i = 0; i < idle.size(); i++)
+        curl_easy_cleanup(idle[i]);
+    idle.clear();
+    if (share)
+        curl_share_cleanup(share);
+}
+
+/* Lock callbacks: the share object may be used from several threads at once */
+void CurlPool::lockShare(CURL * handle, curl_lock_data data, curl_lock_access access, void * userptr)
+{
+    CurlPool * pool = static_cast<CurlPool *>(userptr);
+    pool->shareLocks[data].lock();
+}
+
+void CurlPool::unlockShare(CURL * handle, curl_lock_data data, void * userptr)
+{
+    CurlPool * pool = static_cast<CurlPool *>(userptr);
+    pool->shareLocks[data].unlock();
+}
+
+/* Options every pooled handle gets back after curl_easy_reset */
+void CurlPool::configure(CURL * handle, bool shared, const std::string& trusted)
+{
+    if (shared && share)
+        curl_easy_setopt(handle, CURLOPT_SHARE, share);
+    if (!trusted.empty())
+        curl_easy_setopt(handle, CURLOPT_CAINFO, trusted.c_str());
+    curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(handle, CURLOPT_TCP_KEEPIDLE, 60L);
+    curl_easy_setopt(handle, CURLOPT_TCP_KEEPINTVL, 30L);
+}
+
+/* Returns a handle ready for use, either recycled or freshly created.
+   Returns NULL if cURL could not allocate a new handle. */
+CURL * CurlPool::acquire()
+{
+    CURL * handle = NULL;
+    bool shared;
+    std::string trusted;
+    {
+        std::lock_guard<std::mutex> guard(idleLock);
+        shared = reuse;
+        trusted = caFile;
+        if (reuse && !idle.empty())
+        {
+            handle = idle.back();
+            idle.pop_back();
+        }
+    }
+    if (handle)
+        curl_easy_reset(handle); // drops previous options, keeps live connections and caches
+    else
+        handle = curl_easy_init();
+    if (handle)
+        configure(handle, shared, trusted);
+    return handle;
+}
+
+/* Gives a handle back to the pool once its transfer is complete */
+void CurlPool::release(CURL * handle)
+{
+    if (!handle)
+        return;
+    {
+        std::lock_guard<std::mutex> guard(idleLock);
+        if (reuse && idle.size() < maxIdle)
+        {
+            idle.push_back(handle);
+            return;
+        }
+    }
+    curl_easy_cleanup(handle);
+}
+
+/* Enables or disables handle and connection reuse (mostly useful for benchmarking) */
+void CurlPool::setReuse(bool enable)
+{
+    std::lock_guard<std::mutex> guard(idleLock);
+    reuse = enable;
+    if (!reuse)
+    {
+        for (std::size_t i = 0; i < idle.size(); i++)
+            curl_easy_cleanup(idle[i]);
+        idle.clear();
+    }
+}
+
+bool CurlPool::reusing()
+{
+    std::lock_guard<std::mutex> guard(idleLock);
+    return reuse;
+}
+
+/* Trusts the certificates in a PEM file instead of the system's store, for handles
+   acquired from now on (a private endpoint or a local test server) */
+void CurlPool::setCAFile(const std::string& path)
+{
+    std::lock_guard<std::mutex> guard(idleLock);
+    caFile = path;
+}
@@ -0,0 +1,237 @@
+/*
+ * DaemonClient.cc
+ *
+ *  GDConnect calls forwarded to a transfer daemon
+ */
+
+#include "DaemonClient.h"
+#include "Operation.h"
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+DaemonClient::DaemonClient(const char * socketPath) : socketPath(socketPath), fd(-1), nextId(1)
+{
+}
+
+DaemonClient::~DaemonClient()
+{
+    disconnect();
+}
+
+bool DaemonClient::connectSocket()
+{
+    struct sockaddr_un addr;
+    if (socketPath.size() >= sizeof(addr.sun_path))
+        return false;
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return false;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socketPath.c_str());
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+    {
+        disconnect();
+        return false;
+    }
+    return true;
+}
+
+void DaemonClient::disconnect()
+{
+    if (fd >= 0)
+        close(fd);
+    fd = -1;
+    pending.clear();
+}
+
+/* True if the daemon can be reached */
+bool DaemonClient::valid()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return fd >= 0 || connectSocket();
+}
+
+bool DaemonClient::sendRequest(const std::string& line)
+{
+    std::size_t sent = 0;
+    while (sent < line.size())
+    {
+        ssize_t n = send(fd, line.data() + sent, line.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        sent += n;
+    }
+    return true;
+}
+
+bool DaemonClient::readResponse(Json::Value& response)
+{
+    char chunk[16384];
+    std::size_t newline;
+    while ((newline = pending.find('\n')) == std::string::npos)
+    {
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0)
+            return false;
+        pending.append(chunk, n);
+    }
+    std::string line = pending.substr(0, newline);
+    pending.erase(0, newline + 1);
+    Json::Reader reader;
+    return reader.parse(line, response);
+}
+
+/* Sends one operation to the daemon and waits for its result.
+    A connection the daemon closed since the last call is reopened, but a request
+    that reached the daemon is never sent twice. */
+Json::Value DaemonClient::call(const Json::Value& request)
+{
+    Json::Value op = request;
+    Json::Value response;
+    Json::FastWriter writer;
+    std::lock_guard<std::mutex> guard(lock);
+    op["id"] = (Json::UInt64) nextId++;
+    std::string line = writer.write(op);
+    bool sent = false;
+    for (int attempt = 0; attempt < 2 && !sent; attempt++)
+    {
+        if (fd < 0 && !connectSocket())
+            break;
+        sent = sendRequest(line);
+        if (!sent)
+            disconnect();
+    }
+    if (!sent)
+    {
+        response["ok"] = false;
+        response["error"] = "unable to reach the transfer daemon at " + socketPath;
+        return response;
+    }
+    if (!readResponse(response) || response["id"].asUInt64() != op["id"].asUInt64())
+    {
+        disconnect();
+        response = Json::Value();
+        response["ok"] = false;
+        response["error"] = "connection to the transfer daemon lost";
+    }
+    return response;
+}
+
+/* Resolves path against the working directory of this process */
+std::string DaemonClient::absolute(const char * path)
+{
+    if (path[0] == '/')
+        return path;
+    char * cwd = getcwd(NULL, 0);
+    if (!cwd)
+        return path;
+    std::string resolved = std::string(cwd) + "/" + path;
+    free(cwd);
+    return resolved;
+}
+
+static void report(const Json::Value& response)
+{
+    if (response.isMember("error"))
+        std::cerr << "Transfer daemon: " << response["error"].asString() << std::endl;
+}
+
+/* Function for obtaining a Google Drive file's ID using an exact name search */
+std::string DaemonClient::getFileId(const char * filename)
+{
+    Json::Value op;
+    op["op"] = "resolve";
+    op["name"] = filename;
+    Json::Value response = call(op);
+    report(response);
+    return response["ok"].asBool() ? response["fileId"].asString() : std::string();
+}
+
+/* Function for downloading a file to path; returns the HTTP code, or -1 */
+int DaemonClient::getFileById(const char * id, const char * path, std::string * md5)
+{
+    Json::Value op;
+    op["op"] = "get";
+    op["fileId"] = id;
+    op["path"] = absolute(path);
+    Json::Value response = call(op);
+    report(response);
+    if (md5)
+        *md5 = response["md5"].asString();
+    return response.isMember("code") ? response["code"].asInt() : -1;
+}
+
+/* Function for listing files, optionally matching a Drive search query */
+int DaemonClient::listFiles(FileVisitor visit, const char * query)
+{
+    Json::Value op;
+    op["op"] = "ls";
+    if (query)
+        op["query"] = query;
+    Json::Value response = call(op);
+    report(response);
+    if (!response["ok"].asBool())
+        return -1;
+    const Json::Value& files = response["files"];
+    for (unsigned int i = 0; i < files.size(); i++)
+        if (!visit(fileFromJson(files[i])))
+            break;
+    return 0;
+}
+
+std::string DaemonClient::createFolder(const char * name, const char * parentId)
+{
+    Json::Value op;
+    op["op"] = "mkdir";
+    op["name"] = name;
+    if (parentId)
+        op["parent"] = parentId;
+    Json::Value response = call(op);
+    report(response);
+    return response["ok"].asBool() ? response["fileId"].asString() : std::string();
+}
+
+std::pair<std::string, int> DaemonClient::putFile(const char * filename)
+{
+    UploadTarget target;
+    const char * slash = strrchr(filename, '/');
+    target.name = slash ? slash + 1 : filename;
+    return putFile(filename, target);
+}
+
+/* Function for uploading a file; returns its ID and 0, or an error and its code */
+std::pair<std::string, int> DaemonClient::putFile(const char * filename, const UploadTarget& target, std::string * md5)
+{
+    Json::Value op;
+    op["op"] = "put";
+    op["path"] = absolute(filename);
+    if (!target.name.empty())
+        op["name"] = target.name;
+    if (!target.parentId.empty())
+        op["parent"] = target.parentId;
+    if (!target.fileId.empty())
+        op["fileId"] = target.fileId;
+    for (std::map<std::string, std::string>::const_iterator it = target.appProperties.begin();
+            it != target.appProperties.end(); ++it)
+        op["appProperties"][it->first] = it->second;
+    Json::Value response = call(op);
+    report(response);
+    if (!response["ok"].asBool())
+        return std::make_pair(response["error"].asString(), response.get("code", -1).asInt());
+    if (md5)
+        *md5 = response["md5"].asString();
+    return std::make_pair(response["fileId"].asString(), 0);
+}
+
+/* The daemon's request metrics, in Prometheus format */
+std::string DaemonClient::getMetrics()
+{
+    Json::Value op;
+    op["op"] = "metrics";
+    return call(op)["prometheus"].asString();
+}
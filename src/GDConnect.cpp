@@ -11,23 +11,60 @@
 // #define DEBUG
 
 #include "GDConnect.h"
+#include "TransferQueue.h"
+#include "MetadataIndex.h"
+#include "AsyncEngine.h"
+#include "Compression.h"
+#include "IdPool.h"
+#include "JsonStream.h"
 #include <cstdio>
 #include <cstring>
+#include <strings.h>
 #include <string>
 #include <utility>
 #include <ctime>
+#include <chrono>
+#include <algorithm>
+#include <set>
+#include <functional>
+#include <thread>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
 #include <sstream>
 #include <iostream>
 #include <fstream>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <curl/curl.h>
 #include <json/json.h>
 
 
-GDConnect::GDConnect()
+/* cURL's global state is not thread-safe to set up or tear down, and must
+    outlive every client: it is reference-counted across all instances */
+static std::mutex globalLock;
+static int globalUsers = 0;
+
+static void acquireGlobal()
+{
+    std::lock_guard<std::mutex> guard(globalLock);
+    if (globalUsers++ == 0)
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+}
+
+static void releaseGlobal()
+{
+    std::lock_guard<std::mutex> guard(globalLock);
+    if (--globalUsers == 0)
+        curl_global_cleanup();
+}
+
+GDConnect::GDConnect() : GDConnect("config.json")
 {
-    GDConnect("config.json");
 }
 
 /*
@@ -37,12 +74,40 @@ Loads client_id, client_secret and other info required for authentication into m
 GDConnect::GDConnect(const char * configFilename)
 {
     ok = false;
-    curl_global_init(CURL_GLOBAL_DEFAULT);
+    apiURL = "https://www.googleapis.com";
+    credential = std::make_shared<const Credential>();
+    stopRefresher = false;
+    uploadChunkSize = 32 * 256 * 1024;
+    uploadBufferSize = 0;
+    index = NULL;
+    ids = NULL;
+    engine = NULL;
+    verifyChecksums = true;
+    multipartThreshold = 5 << 20;
+    compressionLevel = 0;
+    decompressDownloads = true;
+    scheduler = new RequestScheduler();
+    metrics = new Metrics();
+    acquireGlobal();
+    pool = new CurlPool();
 }
 
 GDConnect::~GDConnect()
 {
-    curl_global_cleanup();
+    if (refresher.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> guard(refresherLock);
+            stopRefresher = true;
+        }
+        refresherWake.notify_all();
+        refresher.join();
+    }
+    delete engine; // its I/O thread still hands handles back to the pool
+    delete pool; // pooled handles must go before cURL's global state
+    delete scheduler;
+    delete metrics;
+    releaseGlobal();
 }
 
 int GDConnect::init(const char * configFilename)
@@ -60,6 +125,8 @@ int GDConnect::init(const char * configFilename)
             authURL = config["installed"]["auth_uri"].asString();
             tokenURL = config["installed"]["token_uri"].asString();
             authScope = "https://www.googleapis.com/auth/drive";
+            if (config["installed"].isMember("api_uri")) // e.g. a local mock server
+                apiURL = config["installed"]["api_uri"].asString();
             redirectURI = config["installed"]["redirect_uris"][0].asString();
             ok = true;
         }
@@ -75,23 +142,101 @@ int GDConnect::init(const char * configFilename)
         return -1;
     }
 
+    int err;
     if (parseTokenFile())
     {
         // if unable to retrieve access & refresh tokens from token.json, obtain new ones from Google
         // using getToken()
-        return getToken();
+        err = getToken();
     }
-
-    std::time_t currentTime;
-    std::time(&currentTime);
-    if (currentTime - timestamp < 3600)
+    else if (std::time(NULL) < refreshDue())
     {
-        // credentials were created / renewed less than an hour ago: access token still valid.
+        // access token has not reached the end of its lifetime yet: still valid.
         std::cout << "Current credentials are still valid." << std::endl;
-        return 0;
+        err = 0;
+    }
+    else
+    {
+        // access token expired or about to: refresh it.
+        err = renewToken();
+    }
+    if (!err && !refresher.joinable())
+        refresher = std::thread(&GDConnect::refreshLoop, this);
+    return err;
+}
+
+/* Returns the current credentials. The snapshot is immutable and stays valid
+    for as long as the caller holds it, even if the token is renewed meanwhile. */
+std::shared_ptr<const Credential> GDConnect::credentials()
+{
+    return std::atomic_load(&credential);
+}
+
+/* Publishes a new credential snapshot and lets the background refresher
+    know when the next renewal is due */
+void GDConnect::storeCredentials(const std::shared_ptr<const Credential>& next)
+{
+    std::atomic_store(&credential, next);
+    {
+        std::lock_guard<std::mutex> guard(refresherLock); // no lost wakeup between the refresher's check and wait
+    }
+    refresherWake.notify_all();
+}
+
+/* Records newly obtained credentials and their lifetime */
+void GDConnect::updateCredentials(const std::string& access, const std::string& refresh, time_t issued, long expiresIn)
+{
+    std::lock_guard<std::mutex> guard(credentialLock);
+    std::shared_ptr<Credential> next = std::make_shared<Credential>(*credentials());
+    next->accessToken = access;
+    if (!refresh.empty())
+        next->refreshToken = refresh;
+    next->issued = issued;
+    next->expiry = issued + (expiresIn > 0 ? expiresIn : 3600);
+    storeCredentials(next);
+}
+
+/* Time at which the access token should be renewed: shortly before it expires,
+    leaving a tenth of its lifetime (at most five minutes) as a safety margin */
+time_t GDConnect::refreshDue()
+{
+    std::shared_ptr<const Credential> current = credentials();
+    time_t margin = std::min<time_t>((current->expiry - current->issued) / 10, 300);
+    return current->expiry - margin;
+}
+
+/* Background thread renewing the access token before it expires, so that
+    long-running processes never hit a wave of 401s at expiry */
+void GDConnect::refreshLoop()
+{
+    const int retryDelay = 30;
+    std::unique_lock<std::mutex> lock(refresherLock);
+    while (!stopRefresher)
+    {
+        std::chrono::system_clock::time_point due = std::chrono::system_clock::from_time_t(refreshDue());
+        if (std::chrono::system_clock::now() < due)
+        {
+            refresherWake.wait_until(lock, due);
+            continue; // woken early: stopping, or the token changed
+        }
+        lock.unlock();
+        int err = renewToken();
+        lock.lock();
+        if (err && !stopRefresher) // Google unreachable or refusing: try again shortly rather than spin
+            refresherWake.wait_for(lock, std::chrono::seconds(retryDelay));
     }
-    // credentials were created / renewed more than an hour ago: refresh access token.
-    return renewToken();
+}
+
+/* Called after a request was refused with 401 while using staleToken.
+    Only one renewal runs at a time: concurrent callers wait for it, then find
+    the token already replaced and simply retry with the new one.
+    Returns 0 if a retry is worthwhile, -1 if no fresh token could be obtained. */
+int GDConnect::renewAfterUnauthorized(const std::string& staleToken)
+{
+    std::lock_guard<std::mutex> renewGuard(renewLock);
+    if (credentials()->accessToken != staleToken)
+        return 0; // somebody else already renewed it
+    return refreshAccessToken();
 }
 
 
@@ -103,6 +248,44 @@ std::size_t GDConnect::callback(const char* in, std::size_t size, std::size_t nu
     return totalBytes;
 }
 
+/* Callback function used by cURL to read request bodies from memory */
+std::size_t GDConnect::read_memory(char *buffer, size_t size, size_t nitems, MemoryReader *reader)
+{
+    std::size_t n = std::min(size * nitems, reader->remaining);
+    if (n > 0)
+    {
+        memcpy(buffer, reader->data, n);
+        reader->data += n;
+        reader->remaining -= n;
+    }
+    return n;
+}
+
+/* Returns the value of a response header, matched case-insensitively
+    since HTTP/2 servers send header names in lower case */
+std::string GDConnect::headerValue(const std::string& headers, const char * name)
+{
+    std::size_t nameLength = strlen(name);
+    std::size_t start = 0;
+    while (start < headers.size())
+    {
+        std::size_t endline = headers.find('\n', start);
+        if (endline == std::string::npos)
+            endline = headers.size();
+        if (endline - start > nameLength && headers[start + nameLength] == ':'
+                && strncasecmp(headers.c_str() + start, name, nameLength) == 0)
+        {
+            std::size_t first = headers.find_first_not_of(" \t", start + nameLength + 1);
+            std::size_t last = headers.find_last_not_of(" \t\r", endline - 1);
+            if (first == std::string::npos || first > last || last >= endline)
+                return std::string();
+            return headers.substr(first, last - first + 1);
+        }
+        start = endline + 1;
+    }
+    return std::string();
+}
+
 /* Callback function used by cURL to write responses to file */
 std::size_t GDConnect::write_data(void *ptr, size_t size, size_t nmemb, FILE *stream)
 {
@@ -110,149 +293,292 @@ std::size_t GDConnect::write_data(void *ptr, size_t size, size_t nmemb, FILE *st
     return written;
 }
 
-const char * GDConnect::getAccessToken()
+std::string GDConnect::getAccessToken()
 {
-    return accessToken.c_str();
+    return credentials()->accessToken;
 }
 
-const char * GDConnect::getRefreshToken()
+std::string GDConnect::getRefreshToken()
 {
-    return refreshToken.c_str();
+    return credentials()->refreshToken;
 }
 
 void GDConnect::setAccessToken(const char * str)
 {
-    accessToken = std::string(str);
+    std::lock_guard<std::mutex> guard(credentialLock);
+    std::shared_ptr<Credential> next = std::make_shared<Credential>(*credentials());
+    next->accessToken = std::string(str);
+    storeCredentials(next);
 }
 
 void GDConnect::setRefreshToken(const char * str)
 {
-    refreshToken = std::string(str);
+    std::lock_guard<std::mutex> guard(credentialLock);
+    std::shared_ptr<Credential> next = std::make_shared<Credential>(*credentials());
+    next->refreshToken = std::string(str);
+    storeCredentials(next);
 }
 
-/* Function for sending basic HTTP Post */
-std::pair<std::string, int> GDConnect::post(const char * endpoint, const char * msg, bool authorized=false)
+/* Turns keep-alive connection reuse on or off for subsequent requests */
+void GDConnect::setConnectionReuse(bool enable)
 {
-    CURL *curlHandle;
-    CURLcode res;
-    struct curl_slist *slist=NULL;
-    std::string response;
-    std::pair<std::string, int> result;
-    curlHandle = curl_easy_init(); // start up cURL with handle
+    pool->setReuse(enable);
+}
 
-    if (curlHandle)
-    {
-        curl_easy_setopt(curlHandle, CURLOPT_URL, endpoint);
-#ifdef DEBUG
-        curl_easy_setopt(curlHandle, CURLOPT_VERBOSE, 1); // for debugging
-        curl_easy_setopt(curlHandle, CURLOPT_HEADER, 1); // for debugging
-#endif
-        curl_easy_setopt(curlHandle, CURLOPT_POST, 1);
-        curl_easy_setopt(curlHandle, CURLOPT_POSTFIELDSIZE, strlen(msg));
-        curl_easy_setopt(curlHandle, CURLOPT_POSTFIELDS, msg);
-        curl_easy_setopt(curlHandle, CURLOPT_WRITEFUNCTION, callback);
-        curl_easy_setopt(curlHandle, CURLOPT_WRITEDATA, &response);
-        if (authorized)
-        {
-            const char * authHeader = ("Authorization: Bearer " + accessToken).c_str();
-            slist = curl_slist_append(slist, authHeader);
-            curl_easy_setopt(curlHandle, CURLOPT_HTTPHEADER, slist);
-        }
-        res = curl_easy_perform(curlHandle);
+/* Trusts the certificates of a PEM file instead of the system's for subsequent
+    requests, e.g. the self-signed one of a test server serving HTTPS */
+void GDConnect::setCACertificates(const char * pemFile)
+{
+    pool->setCAFile(pemFile ? pemFile : "");
+}
 
-        if(res != CURLE_OK)  // something went wrong
+/* Appends the OAuth bearer header to a header list.
+    If used is given, it receives the token sent, for renewAfterUnauthorized. */
+struct curl_slist * GDConnect::authorize(struct curl_slist * slist, std::string * used)
+{
+    std::string token = credentials()->accessToken;
+    if (used)
+        *used = token;
+    std::string authHeader = "Authorization: Bearer " + token;
+    return curl_slist_append(slist, authHeader.c_str());
+}
+
+/* Callback function used by cURL to collect a response body into an exchange,
+    or to pass it on to the exchange's sink once the status is known to be a success */
+std::size_t GDConnect::write_exchange(char *ptr, size_t size, size_t nmemb, Exchange *ex)
+{
+    std::size_t total = size * nmemb;
+    if (ex->sink)
+    {
+        if (!ex->statusChecked)
         {
-            fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-            result.first = "curl_easy_perform() failed";
-            result.second = -1;
+            long code = 0;
+            curl_easy_getinfo(ex->handle, CURLINFO_RESPONSE_CODE, &code);
+            ex->sinkAccepted = code >= 200 && code < 300;
+            ex->statusChecked = true;
         }
-        else
+        if (ex->sinkAccepted)
         {
-            long response_code;
-            curl_easy_getinfo(curlHandle, CURLINFO_RESPONSE_CODE, &response_code);
-            if (response_code == 302)
-            {
-                char * redirectURL;
-                res = curl_easy_getinfo(curlHandle, CURLINFO_REDIRECT_URL, &redirectURL);
-                result.first = redirectURL;
-            }
-            else
-            {
-                result.first = response;
-            }
-            result.second = response_code;
+            if (ex->md5)
+                ex->md5->update(ptr, total); // hashed as it streams past, so checking costs no second read
+            return ex->sink(ptr, total) ? total : 0; // a sink returning false aborts the transfer
         }
     }
-    else
+    if (ex->response.empty())
     {
-        result.first = "Unable to start curl";
-        result.second = -1;
+        // one allocation for the whole body when its length is announced
+        curl_off_t length = -1;
+        curl_easy_getinfo(ex->handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+        if (length > 0)
+            ex->response.reserve((std::size_t) std::min<curl_off_t>(length, 64 << 20));
     }
-    if (authorized)
-        curl_slist_free_all(slist);
-    curl_easy_cleanup(curlHandle);
-    return result;
+    ex->response.append(ptr, total); // error bodies are kept aside for reporting
+    return total;
 }
 
-/* Function for sending basic HTTP get */
-std::pair<std::string, int> GDConnect::get(const char * endpoint, const char * msg = NULL, bool authorized=false)
+/* Starts an exchange with ex.url: takes a pooled handle and sets up response
+    collection and, if authorized, the bearer header. The caller then sets the
+    method, body and any other headers. Returns false if cURL could not start. */
+bool GDConnect::openExchange(Exchange& ex, bool authorized)
 {
-    CURL *curlHandle;
-    CURLcode res;
-    struct curl_slist *slist=NULL;
-    std::string response;
-    std::pair<std::string, int> result;
-    curlHandle = curl_easy_init(); // start up cURL with handle
-    if (curlHandle)
-    {
-        std::string url = std::string(endpoint) + msg;
-        curl_easy_setopt(curlHandle, CURLOPT_URL, url.c_str());
+    ex.handle = pool->acquire(); // reuse a pooled handle and its live connection
+    if (!ex.handle)
+        return false;
+    curl_easy_setopt(ex.handle, CURLOPT_URL, ex.url.c_str());
 #ifdef DEBUG
-        curl_easy_setopt(curlHandle, CURLOPT_VERBOSE, 1); // for debugging
-        curl_easy_setopt(curlHandle, CURLOPT_HEADER, 1); // for debugging
+    curl_easy_setopt(ex.handle, CURLOPT_VERBOSE, 1); // for debugging
 #endif
-        curl_easy_setopt(curlHandle, CURLOPT_HTTPGET, 1);
-        curl_easy_setopt(curlHandle, CURLOPT_WRITEFUNCTION, callback);
-        curl_easy_setopt(curlHandle, CURLOPT_WRITEDATA, &response);
-        if (authorized)
+    curl_easy_setopt(ex.handle, CURLOPT_HEADERFUNCTION, callback);
+    curl_easy_setopt(ex.handle, CURLOPT_HEADERDATA, &ex.header);
+    curl_easy_setopt(ex.handle, CURLOPT_WRITEFUNCTION, write_exchange);
+    curl_easy_setopt(ex.handle, CURLOPT_WRITEDATA, &ex);
+    ex.authorized = authorized;
+    if (authorized)
+        ex.headers = authorize(ex.headers, &ex.token);
+    return true;
+}
+
+/* Gives the exchange's handle back to the pool */
+void GDConnect::closeExchange(Exchange& ex)
+{
+    curl_slist_free_all(ex.headers);
+    ex.headers = NULL;
+    pool->release(ex.handle);
+    ex.handle = NULL;
+}
+
+/* The operation an exchange is counted under in the metrics, from its URL unless set explicitly */
+const char * GDConnect::operationOf(const Exchange& ex)
+{
+    if (ex.operation)
+        return ex.operation;
+    const std::string& url = ex.url;
+    if (!tokenURL.empty() && url.compare(0, tokenURL.size(), tokenURL) == 0)
+        return "auth";
+    if (url.find("upload_id=") != std::string::npos)
+        return "uploadChunk";
+    if (url.find("uploadType=resumable") != std::string::npos)
+        return "initUpload";
+    if (url.find("uploadType=multipart") != std::string::npos)
+        return "multipartUpload";
+    if (url.find("alt=media") != std::string::npos)
+        return "media";
+    if (url.find("/generateIds") != std::string::npos)
+        return "generateIds";
+    if (url.find("/batch/") != std::string::npos)
+        return "batch";
+    if (url.find("/drive/v3/changes") != std::string::npos)
+        return "changes";
+    std::size_t files = url.find("/drive/v3/files");
+    if (files != std::string::npos)
+    {
+        char next = url.size() > files + 15 ? url[files + 15] : '\0';
+        return next == '/' ? "metadata" : "list";
+    }
+    return "other";
+}
+
+/* Performs an exchange on the calling thread once the scheduler lets it start,
+    retrying once with a renewed token on 401, and after a backoff on rate limit
+    and server errors. Returns the HTTP response code, or -1 if the transfer failed. */
+int GDConnect::perform(Exchange& ex)
+{
+    curl_easy_setopt(ex.handle, CURLOPT_HTTPHEADER, ex.headers);
+    int renewals = 0;
+    while (true)
+    {
+        scheduler->acquire(ex.priority, ex.reader.remaining + ex.body.size());
+        CURLcode res = curl_easy_perform(ex.handle);
+        bool stale = true;
+        while (res == CURLE_OK && stale && retryUnauthorized(ex, stale))
         {
-            const char * authHeader = ("Authorization: Bearer " + accessToken).c_str();
-            slist = curl_slist_append(slist, authHeader);
-            curl_easy_setopt(curlHandle, CURLOPT_HTTPHEADER, slist);
+            renewals++;
+            res = curl_easy_perform(ex.handle);
         }
-        res = curl_easy_perform(curlHandle);
-
-        if(res != CURLE_OK)  // something went wrong
+        if (res != CURLE_OK)
         {
             fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-            result.first = "curl_easy_perform() failed";
-            result.second = -1;
+            metrics->record(ex.handle, operationOf(ex), -1, ex.attempts + renewals);
+            return -1;
         }
-        else
+        long response_code;
+        curl_easy_getinfo(ex.handle, CURLINFO_RESPONSE_CODE, &response_code);
+        long delay = throttle(ex, response_code);
+        if (delay < 0)
         {
-            long response_code;
-            curl_easy_getinfo(curlHandle, CURLINFO_RESPONSE_CODE, &response_code);
-            if (response_code == 302)
-            {
-                char * redirectURL;
-                res = curl_easy_getinfo(curlHandle, CURLINFO_REDIRECT_URL, &redirectURL);
-                result.first = redirectURL;
-            }
-            else
-            {
-                result.first = response;
-            }
-            result.second = response_code;
+            metrics->record(ex.handle, operationOf(ex), response_code, ex.attempts + renewals);
+            return response_code;
         }
+        std::cerr << "Request to " << ex.url << " returned " << response_code
+                  << ", retrying in " << delay << " ms" << std::endl;
+        std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+        resetExchange(ex);
     }
-    else
+}
+
+/* Extracts the reason of a Drive error response, e.g. "userRateLimitExceeded" */
+std::string GDConnect::errorReason(const std::string& body)
+{
+    Json::Value obj;
+    Json::Reader reader;
+    if (body.empty() || !reader.parse(body, obj) || !obj.isObject())
+        return std::string();
+    return obj["error"]["errors"][0]["reason"].asString();
+}
+
+/* Reports a finished exchange to the scheduler: its downloaded bytes, and its code so
+    that rate limit errors slow every request down. Returns how many milliseconds to
+    wait before performing it again, or -1 if it is done (or cannot be replayed). */
+long GDConnect::throttle(Exchange& ex, int code)
+{
+    curl_off_t downloaded = 0;
+    curl_easy_getinfo(ex.handle, CURLINFO_SIZE_DOWNLOAD_T, &downloaded);
+    scheduler->charge(downloaded);
+    if (code < 400)
+        return -1;
+    long retryAfter = atol(headerValue(ex.header, "Retry-After").c_str());
+    long delay = scheduler->complete(code, errorReason(ex.response), retryAfter, ex.attempts);
+    if (!ex.retryable || delay < 0)
+        return -1;
+    ex.attempts++;
+    return delay;
+}
+
+/* Clears what a finished exchange received so it can be performed again */
+void GDConnect::resetExchange(Exchange& ex)
+{
+    ex.header.clear();
+    ex.response.clear();
+    ex.statusChecked = false; // nothing reached the sink: error bodies are set aside
+}
+
+/* Checks a finished exchange for 401 Unauthorized. If the token it was sent with
+    can be renewed, puts the new token in its header list, clears the response
+    and returns true so the caller performs the exchange once more.
+    stale tells whether another thread had already replaced that token: such a
+    retry is not the exchange's own renewal and does not use up its second chance.
+    Only bodies held in ex.body can be replayed, which covers every authorized call. */
+bool GDConnect::retryUnauthorized(Exchange& ex, bool& stale)
+{
+    long response_code = 0;
+    curl_easy_getinfo(ex.handle, CURLINFO_RESPONSE_CODE, &response_code);
+    stale = credentials()->accessToken != ex.token;
+    if (!ex.authorized || response_code != 401 || renewAfterUnauthorized(ex.token))
+        return false;
+    struct curl_slist * renewed = authorize(NULL, &ex.token);
+    for (struct curl_slist * item = ex.headers; item; item = item->next)
     {
-        result.first = "Unable to start curl";
-        result.second = -1;
+        if (strncasecmp(item->data, "Authorization:", 14) != 0)
+            renewed = curl_slist_append(renewed, item->data);
     }
-    if (authorized)
-        curl_slist_free_all(slist);
-    curl_easy_cleanup(curlHandle);
+    curl_slist_free_all(ex.headers);
+    ex.headers = renewed;
+    curl_easy_setopt(ex.handle, CURLOPT_HTTPHEADER, renewed);
+    resetExchange(ex);
+    return true;
+}
+
+/* Turns a finished exchange into the (response, code) pair returned by get and post:
+    the redirect target for 302, otherwise the response body */
+std::pair<std::string, int> GDConnect::exchangeResult(Exchange& ex, int code)
+{
+    if (code == -1)
+        return std::pair<std::string, int>("curl_easy_perform() failed", -1);
+    if (code == 302)
+    {
+        char * redirectURL = NULL;
+        curl_easy_getinfo(ex.handle, CURLINFO_REDIRECT_URL, &redirectURL);
+        return std::pair<std::string, int>(redirectURL ? redirectURL : "", code);
+    }
+    return std::pair<std::string, int>(ex.response, code);
+}
+
+/* Function for sending basic HTTP Post */
+std::pair<std::string, int> GDConnect::post(const char * endpoint, const char * msg, bool authorized=false)
+{
+    Exchange ex;
+    ex.url = endpoint;
+    ex.body = msg;
+    if (!openExchange(ex, authorized))
+        return std::pair<std::string, int>("Unable to start curl", -1);
+    curl_easy_setopt(ex.handle, CURLOPT_POST, 1);
+    curl_easy_setopt(ex.handle, CURLOPT_POSTFIELDSIZE, (long) ex.body.size());
+    curl_easy_setopt(ex.handle, CURLOPT_POSTFIELDS, ex.body.c_str());
+    std::pair<std::string, int> result = exchangeResult(ex, perform(ex));
+    closeExchange(ex);
+    return result;
+}
+
+/* Function for sending basic HTTP get */
+std::pair<std::string, int> GDConnect::get(const char * endpoint, const char * msg = NULL, bool authorized=false)
+{
+    Exchange ex;
+    ex.url = std::string(endpoint) + (msg ? msg : "");
+    if (!openExchange(ex, authorized))
+        return std::pair<std::string, int>("Unable to start curl", -1);
+    curl_easy_setopt(ex.handle, CURLOPT_HTTPGET, 1);
+    std::pair<std::string, int> result = exchangeResult(ex, perform(ex));
+    closeExchange(ex);
     return result;
 }
 
@@ -268,14 +594,12 @@ int GDConnect::parseTokenFile()
         {
             std::string stimestamp = obj["timestamp"].asString();
             long int ts = atol(stimestamp.c_str());
-            timestamp = (time_t) ts;
-            accessToken = obj["access_token"].asString();
-            refreshToken = obj["refresh_token"].asString();
+            updateCredentials(obj["access_token"].asString(), obj["refresh_token"].asString(),
+                              (time_t) ts, obj.get("expires_in", 3600).asInt());
         }
         else
         {
             std::cerr << "Could not parse token.json file." << std::endl;
-            timestamp = 0;
             return -1;
         }
         tokenFile.close();
@@ -283,7 +607,6 @@ int GDConnect::parseTokenFile()
     else
     {
         std::cerr << "Could not open token.json file." << std::endl;
-        timestamp = 0;
         return -1;
     }
     return 0;
@@ -402,8 +725,8 @@ int GDConnect::getToken()
     Json::Reader reader;
     if (reader.parse(response.first, root))
     {
-        accessToken = root["access_token"].asString();
-        refreshToken = root["refresh_token"].asString();
+        updateCredentials(root["access_token"].asString(), root["refresh_token"].asString(),
+                          std::time(NULL), root.get("expires_in", 3600).asInt());
     }
     else
     {
@@ -417,8 +740,16 @@ int GDConnect::getToken()
 /* Function for renewing expired token */
 int GDConnect::renewToken()
 {
+    std::lock_guard<std::mutex> renewGuard(renewLock);
+    return refreshAccessToken();
+}
+
+/* Exchanges the refresh token for a new access token; renewLock must be held */
+int GDConnect::refreshAccessToken()
+{
+    std::string refresh = credentials()->refreshToken;
     std::stringstream reqBuilder;
-    reqBuilder << "refresh_token=" << refreshToken << "&"
+    reqBuilder << "refresh_token=" << refresh << "&"
                << "client_id=" << clientID << "&"
                << "client_secret=" << clientSecret << "&"
                << "grant_type=refresh_token" ;
@@ -444,348 +775,2980 @@ int GDConnect::renewToken()
     Json::Reader reader;
     if (reader.parse(response.first, root))
     {
-        accessToken = root["access_token"].asString();
+        updateCredentials(root["access_token"].asString(), refresh,
+                          std::time(NULL), root.get("expires_in", 3600).asInt());
     }
     else
     {
         std::cout << "Error parsing response!" << std::endl;
         return -1;
     }
-    root["refresh_token"] = refreshToken; // need to re-add refresh token since not included in rewnew response.
+    root["refresh_token"] = refresh; // need to re-add refresh token since not included in rewnew response.
     saveToken(root);
     std::cout << "Token renewed." << std::endl;
     return 0;
 }
 
-/* Function for listing files in Google Drive */
-int GDConnect::listFiles()
+/* Requests one page of a files listing or of the changes feed, parsed into page
+    as it downloads, so neither the body nor a document tree is ever held in full.
+    Returns the HTTP code, or -1; the body of an error response is left in error. */
+int GDConnect::getListing(const std::string& url, JsonStream& page, std::string& error)
 {
-    std::pair<std::string, int> response = get("https://www.googleapis.com/drive/v2/files", "", true);
-    if (response.second != 200)
+    Exchange ex;
+    ex.url = url;
+    if (!openExchange(ex, true))
     {
-        std::cerr << "Something went wrong!" << std::endl
-                  << "Request for list of files should return 200 OK and JSON object" << std::endl;
-        std::cerr << "Response code was: " << response.second << std::endl
-                  << "and response was: " << response.first << std::endl;
+        error = "Unable to start curl";
         return -1;
     }
-    Json::Value root;
-    Json::Reader reader;
-    if (reader.parse(response.first, root))
+    curl_easy_setopt(ex.handle, CURLOPT_HTTPGET, 1);
+    ex.sink = [&page](const char * data, std::size_t length) { return page.feed(data, length); };
+    int code = perform(ex);
+    if (page.failed() || (code == 200 && !page.finish()))
     {
-        const Json::Value& items = root["items"];
-        for(unsigned int i=0; i < items.size(); i++)
-        {
-            std::cout << i << "\t" << items[i]["id"].asString() << std::endl
-                      << "\t" <<  items[i]["title"].asString() << std::endl
-                      << "\t" <<  items[i]["originalFilename"].asString() << std::endl;
-        }
+        error = "Malformed JSON response";
+        code = -1;
     }
     else
-    {
-        std::cerr << "Error parsing file list JSON object" << std::endl;
-        return -1;
-    }
-    return 0;
+        error = ex.response;
+    closeExchange(ex);
+    return code;
 }
 
-/* Function for obtaining metadata of Google Drive file using its ID */
-Json::Value GDConnect::getFileMetadataById(const char * id)
+/* Fields requested for each file when listing: just what FileInfo holds */
+static const char * listFields = "nextPageToken,files(id,name,mimeType,size,md5Checksum,modifiedTime,parents,appProperties)";
+
+/* Converts a Drive v3 file resource into a FileInfo */
+FileInfo GDConnect::toFileInfo(const Json::Value& file)
 {
-    const char * endpoint = "https://www.googleapis.com/drive/v3/files/";
-    std::pair<std::string, int> response = get(endpoint, id, true);
-    Json::Value obj;
-    Json::Reader reader;
-    std::string filename;
-    if (reader.parse(response.first, obj))
-    {
-        return obj;
-    }
-    else return 0;
+    FileInfo info;
+    info.id = file["id"].asString();
+    info.name = file["name"].asString();
+    info.mimeType = file["mimeType"].asString();
+    info.md5Checksum = file["md5Checksum"].asString();
+    info.modifiedTime = file["modifiedTime"].asString();
+    info.size = strtoll(file["size"].asString().c_str(), NULL, 10); // sent as a string, absent for folders
+    const Json::Value& parents = file["parents"];
+    for (unsigned int i = 0; i < parents.size(); i++)
+        info.parents.push_back(parents[i].asString());
+    const Json::Value& tags = file["appProperties"];
+    std::vector<std::string> keys = tags.getMemberNames();
+    for (std::size_t i = 0; i < keys.size(); i++)
+        info.appProperties[keys[i]] = tags[keys[i]].asString();
+    return info;
 }
 
-/* Function for downloading a file from Google Drive using its ID */
-int GDConnect::getFileById(const char * id)
+/* Tells whether file was uploaded compressed by this client, from the tags of its
+    appProperties. size and md5 then receive those of the original content; md5 is
+    left empty for uploads older than the tag that records it. */
+bool GDConnect::compressedOriginal(const FileInfo& file, long long& size, std::string& md5)
 {
-    CURL *curlHandle;
-    CURLcode res;
-    FILE *fp;
-    struct curl_slist *slist=NULL;
-    long result;
-    double totalTime, downloadSpeed, downloadSize;
-    Json::Value obj = getFileMetadataById(id);
-    if (!obj)
+    std::map<std::string, std::string>::const_iterator codec = file.appProperties.find("gdconnect.codec");
+    if (codec == file.appProperties.end() || codec->second != "gzip")
+        return false;
+    std::map<std::string, std::string>::const_iterator tag = file.appProperties.find("gdconnect.size");
+    size = tag == file.appProperties.end() ? -1 : strtoll(tag->second.c_str(), NULL, 10);
+    tag = file.appProperties.find("gdconnect.md5");
+    md5 = tag == file.appProperties.end() ? std::string() : tag->second;
+    return true;
+}
+
+/* Drive names are free text: only those naming a single entry of a directory
+    can be used locally */
+bool GDConnect::usableName(const std::string& name)
+{
+    return !name.empty() && name != "." && name != ".." && name.find('/') == std::string::npos
+           && name.find('\0') == std::string::npos;
+}
+
+/* URL-encodes a query string parameter */
+std::string GDConnect::escape(const std::string& str)
+{
+    std::string escaped;
+    CURL *curl = pool->acquire(); // use cURL for url-encoding
+    if (curl)
     {
-        std::cerr << "Error retrieving file id " << id << std::endl;
-        return -1;
+        char * output = curl_easy_escape(curl, str.c_str(), str.size());
+        if (output)
+            escaped = output;
+        curl_free(output);
     }
-    std::string filename = obj["name"].asString();
-    // int64_t filesize = obj["size"].asInt64();
-    std::string url = std::string("https://www.googleapis.com/drive/v3/files/")
-                      + id + "?alt=media";
-    curlHandle = curl_easy_init(); // start up cURL with handle
-    if (curlHandle)
+    pool->release(curl);
+    return escaped;
+}
+
+/* Function for listing files in Google Drive, one page at a time.
+    Each file is passed to visit, which may return false to stop the listing.
+    Pages hold up to 1000 files and only the FileInfo fields are requested.
+    query is an optional Drive search expression (e.g. "trashed = false").
+    With prefetch, the next page is requested while the current one is visited.
+    Returns 0 once every page has been visited (or visit stopped), -1 on error.
+*/
+int GDConnect::listFiles(FileVisitor visit, const char * query, bool prefetch)
+{
+    std::string base = apiURL + "/drive/v3/files?pageSize=1000&fields=" + escape(listFields);
+    if (query && *query)
+        base += std::string("&q=") + escape(query);
+
+    std::shared_ptr<ListingParser> page = std::make_shared<ListingParser>();
+    std::string error;
+    int code = getListing(base, *page, error);
+    while (true)
     {
-        fp = fopen(filename.c_str(), "wb");
-        curl_easy_setopt(curlHandle, CURLOPT_URL, url.c_str());
-#ifdef DEBUG
-        curl_easy_setopt(curlHandle, CURLOPT_VERBOSE, 1); // for debugging
-        curl_easy_setopt(curlHandle, CURLOPT_HEADER, 1); // for debugging
-#endif
-        curl_easy_setopt(curlHandle, CURLOPT_HTTPGET, 1);
-        curl_easy_setopt(curlHandle, CURLOPT_WRITEFUNCTION, write_data);
-        curl_easy_setopt(curlHandle, CURLOPT_WRITEDATA, fp);
-        const char * authHeader = ("Authorization: Bearer " + accessToken).c_str();
-        slist = curl_slist_append(slist, authHeader);
-        curl_easy_setopt(curlHandle, CURLOPT_HTTPHEADER, slist);
-        res = curl_easy_perform(curlHandle);
-        if(res != CURLE_OK)  // something went wrong
+        if (code != 200)
         {
-            fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-            result = -1;
+            std::cerr << "Something went wrong!" << std::endl
+                      << "Request for list of files should return 200 OK and JSON object" << std::endl;
+            std::cerr << "Response code was: " << code << std::endl
+                      << "and response was: " << error << std::endl;
+            return -1;
+        }
+
+        std::future<int> next;
+        std::shared_ptr<ListingParser> nextPage = std::make_shared<ListingParser>();
+        std::shared_ptr<std::string> nextError = std::make_shared<std::string>();
+        std::string url = base + "&pageToken=" + escape(page->nextPageToken);
+        if (!page->nextPageToken.empty() && prefetch)
+            next = std::async(std::launch::async, [this, url, nextPage, nextError]()
+            {
+                return getListing(url, *nextPage, *nextError);
+            });
+
+        for (std::size_t i = 0; i < page->files.size(); i++)
+        {
+            if (!visit(page->files[i]))
+                return 0; // an outstanding prefetch is waited for when next goes out of scope
+        }
+
+        if (page->nextPageToken.empty())
+            return 0;
+        if (prefetch)
+        {
+            code = next.get();
+            page = nextPage;
+            error = *nextError;
         }
         else
         {
-            curl_easy_getinfo(curlHandle, CURLINFO_RESPONSE_CODE, &result);
-            curl_easy_getinfo(curlHandle, CURLINFO_TOTAL_TIME, &totalTime);
-            curl_easy_getinfo(curlHandle, CURLINFO_SIZE_DOWNLOAD, &downloadSize);
-            curl_easy_getinfo(curlHandle, CURLINFO_SPEED_DOWNLOAD, &downloadSpeed);
-            fprintf(stderr, "Size: %.3f Speed: %.3f bytes/sec during %.3f seconds\n",
-                    downloadSize, downloadSpeed, totalTime);
+            page->clear();
+            code = getListing(url, *page, error);
         }
     }
-    else
-    {
-        result = -1;
-    }
-    curl_slist_free_all(slist);
-    curl_easy_cleanup(curlHandle);
-    return result;
-    return 0;
 }
 
-/* Function for obtaining a Google Drive file's ID using an exact name search */
-std::string GDConnect::getFileId(const char * filename)
+/* Function for printing the list of files in Google Drive */
+int GDConnect::listFiles()
 {
-    const char * url = "https://www.googleapis.com/drive/v3/files?";
-    std::string searchString = std::string("name=\"") + filename + "\"";
-
-    CURL *curl = curl_easy_init(); // use cURL for url-encoding
-    char * output;
-    if(curl)
+    unsigned int i = 0;
+    return listFiles([&i](const FileInfo& file)
     {
-        output = curl_easy_escape(curl, searchString.c_str(), 0);
-
-    }
-    std::string msg = std::string("q=") + output;
-    curl_free(output);
-    curl_easy_cleanup(curl);
+        std::cout << i++ << "\t" << file.id << std::endl
+                  << "\t" << file.name << std::endl;
+        return true;
+    });
+}
 
-    std::pair<std::string, int> response = get(url, msg.c_str(), true);
-    std::string id;
+/* Function for obtaining the changes feed position from which later changes will be reported */
+std::string GDConnect::getStartPageToken()
+{
+    std::pair<std::string, int> response = get((apiURL + "/drive/v3/changes/startPageToken").c_str(), "", true);
     Json::Value obj;
     Json::Reader reader;
-    if (reader.parse(response.first, obj))
+    if (response.second != 200 || !reader.parse(response.first, obj))
     {
-        Json::Value files = obj["files"];
-        if (files.size() == 0 )
-        {
-            std::cout << "Error getting file ID: no files found with name " << filename << std::endl;
-        }
-        if (files.size() > 1)
+        std::cerr << "Unable to get changes start page token" << std::endl
+                  << "Response code was: " << response.second << std::endl;
+        return std::string();
+    }
+    return obj["startPageToken"].asString();
+}
+
+/* Function for reading the Drive changes feed from pageToken onwards.
+    Every change is passed to visit; trashed files are reported as removed.
+    On success pageToken is advanced to the position to poll from next time.
+    Returns 0 on success, -1 on error (pageToken then points at the first unread page).
+*/
+int GDConnect::listChanges(std::string& pageToken, ChangeVisitor visit)
+{
+    const std::string endpoint = apiURL + "/drive/v3/changes";
+    std::string fields = std::string("nextPageToken,newStartPageToken,changes(fileId,removed,file(")
+                         + "id,name,mimeType,size,md5Checksum,modifiedTime,parents,appProperties,trashed))";
+    std::string base = endpoint + "?pageSize=1000&fields=" + escape(fields);
+    ChangesParser page;
+    std::string error;
+    while (!pageToken.empty())
+    {
+        page.clear();
+        int code = getListing(base + "&pageToken=" + escape(pageToken), page, error);
+        if (code != 200)
         {
-            std::cout << "Error getting file ID: " << files.size() << " files match name " << filename << std::endl;
+            std::cerr << "Unable to read changes feed" << std::endl
+                      << "Response code was: " << code << std::endl
+                      << "and response was: " << error << std::endl;
+            return -1;
         }
-        if (files.size() == 1)
+        for (std::size_t i = 0; i < page.changes.size(); i++)
+            visit(page.changes[i]);
+        if (!page.newStartPageToken.empty())
         {
-            id = files[0]["id"].asString();
+            pageToken = page.newStartPageToken;
+            return 0;
         }
+        pageToken = page.nextPageToken;
     }
-    return id;
+    return 0;
 }
 
-/* Function for initiating resumable upload of a local file
-    On success, returns location in result.first:
-    HTTP/1.1 200 OK
-    Location: https://www.googleapis.com/upload/drive/v3/files?uploadType=resumable&upload_id=xa298sd_sdlkj2
-    Content-Length: 0
-    The Location header provides a URI for actual upload of file
-*/
-std::pair<std::string, int> GDConnect::initUpload(const char * filename, const char * id, long fileSize)
+/* Caps the number of requests started per second (0 for no limit).
+    After rate limit errors the client runs below this, recovering gradually. */
+void GDConnect::setRequestRate(double perSecond)
 {
-    CURL *curlHandle;
-    CURLcode res;
-    struct curl_slist *slist=NULL;
-    std::string header;
-    std::string response;
-    std::pair<std::string, int> result;
-    const char * url = "https://www.googleapis.com/upload/drive/v3/files?uploadType=resumable";
-
-    Json::Value root;
-    root["name"] = std::string(filename);
-    root["id"] = std::string(id);
-    Json::FastWriter fastWriter;
-    std::string body = fastWriter.write(root);
-
-    curlHandle = curl_easy_init(); // start up cURL with handle
-    if (curlHandle)
-    {
-        curl_easy_setopt(curlHandle, CURLOPT_URL, url);
-#ifdef DEBUG
-        curl_easy_setopt(curlHandle, CURLOPT_VERBOSE, 1); // for debugging
-        curl_easy_setopt(curlHandle, CURLOPT_HEADER, 1); // for debugging
-#endif
-        curl_easy_setopt(curlHandle, CURLOPT_POST, 1);
-        curl_easy_setopt(curlHandle, CURLOPT_POSTFIELDSIZE, strlen(body.c_str()));
-        curl_easy_setopt(curlHandle, CURLOPT_POSTFIELDS, body.c_str());
-        curl_easy_setopt(curlHandle, CURLOPT_HEADERFUNCTION, callback);
-        curl_easy_setopt(curlHandle, CURLOPT_HEADERDATA, &header);
-        curl_easy_setopt(curlHandle, CURLOPT_WRITEFUNCTION, callback);
-        curl_easy_setopt(curlHandle, CURLOPT_WRITEDATA, &response);
-
-        std::stringstream sbuilder;
-        sbuilder << "Authorization: Bearer " << accessToken;
-        std::string authHeader = sbuilder.str();
-        slist = curl_slist_append(slist, authHeader.c_str());
-        sbuilder.str(std::string());
+    scheduler->setRequestRate(perSecond);
+}
 
-        std::string contentType("Content-Type: application/json; charset=UTF-8");
-        slist = curl_slist_append(slist, contentType.c_str());
+/* Caps the bytes sent and received per second across all transfers (0 for no limit) */
+void GDConnect::setByteRate(double perSecond)
+{
+    scheduler->setByteRate(perSecond);
+}
 
-        std::string uploadContentType("X-Upload-Content-Type: application/octet-stream"); // assume binary file
-        slist = curl_slist_append(slist, uploadContentType.c_str());
+/* Answers metadata and name lookups from a local index instead of the API.
+    The index is not owned by the client; pass NULL to go back to remote lookups. */
+void GDConnect::setMetadataIndex(MetadataIndex * idx)
+{
+    index = idx;
+}
 
-        sbuilder << "X-Upload-Content-Length: " << fileSize;
-        std::string uploadContentLength = sbuilder.str();
-        slist = curl_slist_append(slist, uploadContentLength.c_str());
+/* Sets the root every Drive API URL is built on, https://www.googleapis.com by default.
+    Meant for pointing the client at a test server such as the bundled mock. */
+void GDConnect::setApiURL(const char * url)
+{
+    apiURL = url;
+    while (!apiURL.empty() && apiURL[apiURL.size() - 1] == '/')
+        apiURL.erase(apiURL.size() - 1);
+}
 
-        curl_easy_setopt(curlHandle, CURLOPT_HTTPHEADER, slist);
+/* Sets the pool new uploads take their IDs from; NULL requests one per upload.
+    The pool is not owned and must outlive its use by this client. */
+void GDConnect::setIdPool(IdPool * pool)
+{
+    ids = pool;
+}
 
-        res = curl_easy_perform(curlHandle);
-        if (res != CURLE_OK)  // something went wrong
+/* Function for reserving count file IDs (at most 1000) for files yet to be created.
+    Returns an empty list if the request failed. */
+std::vector<std::string> GDConnect::generateIds(std::size_t count)
+{
+    std::vector<std::string> result;
+    std::string msg = "?count=" + std::to_string((unsigned long long) count) + "&space=drive";
+    std::pair<std::string, int> response = get((apiURL + "/drive/v3/files/generateIds").c_str(), msg.c_str(), true);
+    Json::Value obj;
+    Json::Reader reader;
+    if (response.second != 200 || !reader.parse(response.first, obj))
+    {
+        std::cerr << "Could not generate file IDs: " << response.second << " " << response.first << std::endl;
+        return result;
+    }
+    const Json::Value& generated = obj["ids"];
+    for (unsigned int i = 0; i < generated.size(); i++)
+        result.push_back(generated[i].asString());
+    return result;
+}
+
+/* Function for obtaining metadata of Google Drive file using its ID */
+Json::Value GDConnect::getFileMetadataById(const char * id)
+{
+    FileInfo file;
+    if (index && index->lookup(id, file))
+    {
+        Json::Value obj;
+        obj["id"] = file.id;
+        obj["name"] = file.name;
+        obj["mimeType"] = file.mimeType;
+        obj["size"] = std::to_string(file.size);
+        obj["md5Checksum"] = file.md5Checksum;
+        obj["modifiedTime"] = file.modifiedTime;
+        for (std::map<std::string, std::string>::const_iterator it = file.appProperties.begin();
+                it != file.appProperties.end(); ++it)
+            obj["appProperties"][it->first] = it->second;
+        return obj;
+    }
+    const std::string endpoint = apiURL + "/drive/v3/files/";
+    std::string msg = std::string(id) + "?fields=id,name,mimeType,size,md5Checksum,modifiedTime,version,appProperties";
+    std::pair<std::string, int> response = get(endpoint.c_str(), msg.c_str(), true);
+    Json::Value obj;
+    Json::Reader reader;
+    if (response.second == 200 && reader.parse(response.first, obj))
+    {
+        return obj;
+    }
+    else return Json::Value();
+}
+
+/* Function for obtaining the description of a Google Drive file using its ID.
+    Returns 0, or -1 if the file could not be found. */
+int GDConnect::getFileInfo(const char * id, FileInfo& file)
+{
+    Json::Value obj = getFileMetadataById(id);
+    if (!obj)
+        return -1;
+    file = toFileInfo(obj);
+    return 0;
+}
+
+/* Maximum number of sub-requests Drive accepts in one batch */
+static const std::size_t maxBatchSize = 100;
+
+/* Splits a multipart/mixed batch response into per-item results.
+    Each part wraps a full HTTP response; its Content-ID (<response-itemN>)
+    says which request it answers, since parts may come back in any order. */
+static void parseBatchResponse(const std::string& body, const std::string& boundary,
+                               std::vector<BatchResult>& results, std::size_t first, std::size_t count)
+{
+    const std::string delimiter = "--" + boundary;
+    std::size_t pos = body.find(delimiter);
+    while (pos != std::string::npos)
+    {
+        pos += delimiter.size();
+        if (body.compare(pos, 2, "--") == 0)
+            break; // closing delimiter
+        std::size_t end = body.find(delimiter, pos);
+        std::string part = body.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+        pos = end;
+
+        std::size_t item = count;
+        std::size_t idPos = part.find("response-item");
+        if (idPos != std::string::npos)
+            item = strtoul(part.c_str() + idPos + 13, NULL, 10);
+        std::size_t statusPos = part.find("HTTP/");
+        if (item >= count || statusPos == std::string::npos)
+            continue;
+        BatchResult& result = results[first + item];
+        std::size_t space = part.find(' ', statusPos);
+        result.code = space == std::string::npos ? -1 : atoi(part.c_str() + space + 1);
+
+        // the inner body follows the blank line after the inner headers
+        std::size_t blank = part.find("\r\n\r\n", statusPos);
+        std::size_t skip = 4;
+        if (blank == std::string::npos)
+        {
+            blank = part.find("\n\n", statusPos);
+            skip = 2;
+        }
+        if (blank == std::string::npos)
+            continue;
+        Json::Reader reader;
+        reader.parse(part.substr(blank + skip), result.body);
+    }
+}
+
+/* Function for sending up to 100 API calls in a single HTTP request to the batch endpoint.
+    Larger sets are split into several batches. Results come back in request order;
+    an item whose answer could not be found keeps code -1.
+*/
+std::vector<BatchResult> GDConnect::batch(const std::vector<BatchRequest>& requests)
+{
+    const std::string url = apiURL + "/batch/drive/v3";
+    const std::string boundary = "gdconnect_batch_boundary";
+    std::vector<BatchResult> results(requests.size());
+    for (std::size_t i = 0; i < results.size(); i++)
+        results[i].code = -1;
+
+    for (std::size_t first = 0; first < requests.size(); first += maxBatchSize)
+    {
+        std::size_t count = std::min(maxBatchSize, requests.size() - first);
+        std::stringstream body;
+        for (std::size_t i = 0; i < count; i++)
+        {
+            const BatchRequest& request = requests[first + i];
+            body << "--" << boundary << "\r\n"
+                 << "Content-Type: application/http\r\n"
+                 << "Content-ID: <item" << i << ">\r\n\r\n"
+                 << request.method << " " << request.path << "\r\n";
+            if (!request.body.empty())
+                body << "Content-Type: application/json; charset=UTF-8\r\n"
+                     << "Content-Length: " << request.body.size() << "\r\n\r\n"
+                     << request.body;
+            body << "\r\n";
+        }
+        body << "--" << boundary << "--\r\n";
+
+        Exchange ex;
+        ex.url = url;
+        ex.body = body.str();
+        if (!openExchange(ex, true))
+            break;
+        curl_easy_setopt(ex.handle, CURLOPT_POST, 1);
+        curl_easy_setopt(ex.handle, CURLOPT_POSTFIELDSIZE, (long) ex.body.size());
+        curl_easy_setopt(ex.handle, CURLOPT_POSTFIELDS, ex.body.c_str());
+        std::string contentType = "Content-Type: multipart/mixed; boundary=" + boundary;
+        ex.headers = curl_slist_append(ex.headers, contentType.c_str());
+        int response_code = perform(ex);
+        closeExchange(ex);
+
+        if (response_code != 200)
+        {
+            std::cerr << "Batch request failed" << std::endl
+                      << "Response code was: " << response_code << std::endl
+                      << "and response was: " << ex.response << std::endl;
+            continue;
+        }
+        // the response uses its own boundary, announced in its Content-Type
+        std::string responseType = headerValue(ex.header, "Content-Type");
+        std::size_t b = responseType.find("boundary=");
+        if (b == std::string::npos)
+            continue;
+        std::string responseBoundary = responseType.substr(b + 9);
+        responseBoundary = responseBoundary.substr(0, responseBoundary.find(';'));
+        if (responseBoundary.size() >= 2 && responseBoundary[0] == '"')
+            responseBoundary = responseBoundary.substr(1, responseBoundary.size() - 2);
+        parseBatchResponse(ex.response, responseBoundary, results, first, count);
+    }
+    return results;
+}
+
+/* Function for obtaining the metadata of many files with batched requests */
+std::vector<BatchResult> GDConnect::batchGetMetadata(const std::vector<std::string>& ids)
+{
+    std::vector<BatchRequest> requests(ids.size());
+    for (std::size_t i = 0; i < ids.size(); i++)
+    {
+        requests[i].method = "GET";
+        requests[i].path = "/drive/v3/files/" + ids[i] + "?fields=id,name,mimeType,size,md5Checksum,modifiedTime,appProperties";
+    }
+    return batch(requests);
+}
+
+/* Function for deleting many files with batched requests; success is code 204 */
+std::vector<BatchResult> GDConnect::batchDelete(const std::vector<std::string>& ids)
+{
+    std::vector<BatchRequest> requests(ids.size());
+    for (std::size_t i = 0; i < ids.size(); i++)
+    {
+        requests[i].method = "DELETE";
+        requests[i].path = "/drive/v3/files/" + ids[i];
+    }
+    return batch(requests);
+}
+
+/* Function for streaming the content of a Google Drive file into a sink.
+    The MD5 of the content is computed on the way and, if md5 is given, stored there.
+    Files uploaded compressed by this client are inflated before reaching the sink,
+    unless transparent decompression was turned off; md5 is then that of the stored data.
+    With from, only the content from that offset on is requested and passed to the sink,
+    as stored, and prefix holds the MD5 state of the bytes before it. remote is the
+    file's metadata if the caller has it; otherwise it is looked up before the media
+    request whenever decompression may apply, since it tells whether to inflate.
+    Returns the HTTP response code, or -1 if the transfer failed, was aborted by the
+    sink or delivered content not matching the file's md5Checksum. */
+int GDConnect::streamFile(const char * id, DataSink& sink, std::string * md5, curl_off_t from, Md5 * prefix,
+                          const Json::Value& remote)
+{
+    Metrics::Span span(metrics, "getFileById", id);
+    Json::Value metadata = remote;
+    if (!metadata && decompressDownloads && from == 0)
+    {
+        metadata = getFileMetadataById(id);
+        if (!metadata)
+        {
+            std::cerr << "Error retrieving file id " << id << std::endl;
+            return -1;
+        }
+    }
+    Md5 own;
+    Md5& digest = from > 0 && prefix ? *prefix : own;
+    Exchange ex;
+    std::unique_ptr<Inflater> inflater;
+    long long originalSize = -1;
+    std::string originalMd5;
+    if (decompressDownloads && from == 0 && metadata
+            && compressedOriginal(toFileInfo(metadata), originalSize, originalMd5))
+        inflater.reset(new Inflater(sink));
+    std::string storedMd5 = metadata ? metadata["md5Checksum"].asString() : std::string();
+    bool rangeChecked = from == 0;
+    curl_off_t skip = 0;  // bytes before from, when the server sent the whole content anyway
+    ex.url = apiURL + "/drive/v3/files/" + id + "?alt=media";
+    ex.sink = [&](const char * data, std::size_t length)
+    {
+        if (!rangeChecked)
+        {
+            rangeChecked = true;
+            long code = 0;
+            curl_easy_getinfo(ex.handle, CURLINFO_RESPONSE_CODE, &code);
+            if (code != 206)
+            {
+                std::cerr << "Range ignored for " << id << ", skipping the first " << from << " bytes" << std::endl;
+                digest.reset();
+                skip = from;
+            }
+        }
+        if (from > 0)
+        {
+            digest.update(data, length); // the exchange hashes only unranged downloads
+            std::size_t dropped = (std::size_t) std::min<curl_off_t>(skip, length);
+            skip -= dropped;
+            data += dropped;
+            length -= dropped;
+            if (length == 0)
+                return true;
+        }
+        return inflater ? inflater->write(data, length) : sink(data, length);
+    };
+    if (from == 0)
+        ex.md5 = &digest;
+    ex.priority = RequestScheduler::Bulk;
+    if (!openExchange(ex, true))
+        return -1;
+    curl_easy_setopt(ex.handle, CURLOPT_HTTPGET, 1);
+    if (from > 0) // perform() hands the header list to cURL
+        ex.headers = curl_slist_append(ex.headers, ("Range: bytes=" + std::to_string((long long) from) + "-").c_str());
+    int result = perform(ex);
+    if (result != -1)
+    {
+        if (result >= 200 && result < 300)
+        {
+            std::string actual = digest.hexDigest();
+            if (md5)
+                *md5 = actual;
+            if (!checksumMatches(id, ex.header, actual, storedMd5))
+                result = -1;
+            if (inflater && (!inflater->finished() || (long long) inflater->produced() != originalSize))
+            {
+                std::cerr << "Decompressed " << id << " to " << inflater->produced() << " bytes instead of "
+                          << originalSize << std::endl;
+                result = -1;
+            }
+        }
+        else
+            std::cerr << "Download of " << id << " failed with code " << result << ": " << ex.response << std::endl;
+    }
+    closeExchange(ex);
+    return result;
+}
+
+/* Turns a base64 digest, as found in X-Goog-Hash, into lowercase hex */
+static std::string base64ToHex(const std::string& b64)
+{
+    static const char * alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string hex;
+    unsigned int bits = 0;
+    int count = 0;
+    for (std::size_t i = 0; i < b64.size() && b64[i] != '='; i++)
+    {
+        const char * pos = strchr(alphabet, b64[i]);
+        if (!pos || !*pos)
+            return std::string();
+        bits = (bits << 6) | (pos - alphabet);
+        count += 6;
+        if (count >= 8)
+        {
+            count -= 8;
+            char byte[3];
+            snprintf(byte, sizeof(byte), "%02x", (bits >> count) & 0xff);
+            hex += byte;
+        }
+    }
+    return hex;
+}
+
+/* The MD5 Google announces for a media response in its X-Goog-Hash header(s), if any */
+static std::string announcedMd5(const std::string& headers)
+{
+    std::size_t start = 0;
+    while (start < headers.size())
+    {
+        std::size_t end = headers.find('\n', start);
+        if (end == std::string::npos)
+            end = headers.size();
+        if (strncasecmp(headers.c_str() + start, "X-Goog-Hash:", 12) == 0)
+        {
+            std::size_t md5 = headers.find("md5=", start);
+            if (md5 != std::string::npos && md5 < end)
+            {
+                md5 += 4;
+                std::size_t stop = headers.find_first_of(",\r\n", md5);
+                return base64ToHex(headers.substr(md5, stop - md5));
+            }
+        }
+        start = end + 1;
+    }
+    return std::string();
+}
+
+/* Turns checksum verification of transfers on or off (on by default) */
+void GDConnect::setChecksumVerification(bool enable)
+{
+    verifyChecksums = enable;
+}
+
+/* Checks the MD5 of downloaded content against the one Drive keeps for the file:
+    announced in the response headers if Google sent it, otherwise looked up.
+    Content Drive keeps no checksum for is accepted as is. */
+bool GDConnect::checksumMatches(const char * id, const std::string& headers, const std::string& actual,
+                                const std::string& known)
+{
+    if (!verifyChecksums)
+        return true;
+    std::string expected = announcedMd5(headers);
+    if (expected.empty())
+        expected = known;
+    if (expected.empty())
+    {
+        FileInfo file;
+        if (index && index->lookup(id, file))
+            expected = file.md5Checksum;
+        else
+        {
+            std::string msg = std::string(id) + "?fields=md5Checksum";
+            std::pair<std::string, int> response = get((apiURL + "/drive/v3/files/").c_str(), msg.c_str(), true);
+            Json::Value obj;
+            Json::Reader reader;
+            if (response.second == 200 && reader.parse(response.first, obj))
+                expected = obj["md5Checksum"].asString();
+        }
+    }
+    if (expected.empty() || expected == actual)
+        return true;
+    std::cerr << "Checksum mismatch for " << id << ": expected " << expected << ", got " << actual << std::endl;
+    return false;
+}
+
+/* Sink writing everything it receives to a file descriptor */
+static DataSink fileSink(int fd)
+{
+    return [fd](const char * data, std::size_t length)
+    {
+        while (length > 0)
+        {
+            ssize_t n = write(fd, data, length);
+            if (n < 0)
+                return false;
+            data += n;
+            length -= n;
+        }
+        return true;
+    };
+}
+
+/* Function for downloading a file from Google Drive using its ID
+    The file is saved under its Drive name in the current directory */
+int GDConnect::getFileById(const char * id)
+{
+    Json::Value obj = getFileMetadataById(id);
+    if (!obj)
+    {
+        std::cerr << "Error retrieving file id " << id << std::endl;
+        return -1;
+    }
+    std::string filename = obj["name"].asString();
+    return getFileById(id, filename.c_str());
+}
+
+/* What a partial download was taken from: enough to tell whether the remote
+    content is still the same when resuming */
+static Json::Value partialSource(const char * id, const Json::Value& remote)
+{
+    Json::Value source;
+    source["id"] = id;
+    source["size"] = remote["size"].asString();
+    source["md5Checksum"] = remote["md5Checksum"].asString();
+    source["modifiedTime"] = remote["modifiedTime"].asString();
+    if (remote.isMember("version"))
+        source["version"] = remote["version"].asString();
+    return source;
+}
+
+/* Reads the sidecar left next to a partial download, describing its source */
+static bool readSidecar(const std::string& part, Json::Value& previous)
+{
+    Json::Reader reader;
+    std::ifstream sidecarFile((part + ".json").c_str());
+    return sidecarFile.is_open() && reader.parse(sidecarFile, previous) && previous.isObject();
+}
+
+/* Records what a download into part is taken from, so that a later attempt can pick it up */
+static void writeSidecar(const std::string& part, const char * id, const Json::Value& remote)
+{
+    std::string sidecar = part + ".json";
+    Json::StyledWriter writer;
+    std::ofstream sidecarFile(sidecar.c_str(), std::ofstream::trunc);
+    sidecarFile << writer.write(partialSource(id, remote));
+    if (!sidecarFile.good())
+        std::cerr << "Unable to write " << sidecar << ", the download will not be resumable" << std::endl;
+}
+
+/* Feeds the bytes of a partial download to prefix, provided there are some and
+    fewer than size, the size of the whole content. Returns how many, or 0 with
+    prefix left untouched if there is nothing to keep. */
+static curl_off_t hashPart(const std::string& part, long long size, Md5& prefix)
+{
+    struct stat partInfo;
+    if (stat(part.c_str(), &partInfo) != 0 || partInfo.st_size <= 0 || partInfo.st_size >= size)
+        return 0; // nothing to keep, or complete but rejected last time
+    int fd = open(part.c_str(), O_RDONLY);
+    if (fd < 0)
+        return 0;
+    Md5 digest;
+    std::vector<char> buffer(1 << 20);
+    curl_off_t hashed = 0;
+    ssize_t n;
+    while (hashed < partInfo.st_size
+            && (n = read(fd, &buffer[0], std::min<curl_off_t>(buffer.size(), partInfo.st_size - hashed))) > 0)
+    {
+        digest.update(&buffer[0], n);
+        hashed += n;
+    }
+    close(fd);
+    if (hashed != partInfo.st_size)
+        return 0;
+    prefix = digest;
+    return hashed;
+}
+
+/* Tells whether a partial download whose sidecar says previous can be continued
+    now that the file is described by remote */
+bool GDConnect::resumable(const char * id, const Json::Value& previous, const Json::Value& remote)
+{
+    Json::Value current = partialSource(id, remote);
+    if (previous["id"] != current["id"] || previous["size"] != current["size"]
+            || previous["md5Checksum"] != current["md5Checksum"] || previous["modifiedTime"] != current["modifiedTime"])
+        return false;
+    // the metadata index knows no versions; compare them when both sides have one
+    if (previous.isMember("version") && current.isMember("version") && previous["version"] != current["version"])
+        return false;
+    // an inflated stream cannot be picked up halfway
+    long long original;
+    std::string originalMd5;
+    return !(decompressDownloads && compressedOriginal(toFileInfo(remote), original, originalMd5));
+}
+
+/* Decides where the download of id into part can pick up: the size of part if
+    its sidecar describes the same remote content, in which case prefix is fed
+    those bytes. Leaves offset at 0 to start over. */
+bool GDConnect::resumeOffset(const char * id, const std::string& part, const Json::Value& remote, curl_off_t& offset,
+                             Md5& prefix)
+{
+    Json::Value previous;
+    offset = 0;
+    if (!readSidecar(part, previous) || !resumable(id, previous, remote))
+        return false;
+    offset = hashPart(part, strtoll(remote["size"].asString().c_str(), NULL, 10), prefix);
+    return offset > 0;
+}
+
+/* Downloads a file to an explicit path, replacing anything already there.
+    The content goes to path.part, described by the sidecar path.part.json, and is
+    renamed to path once complete and verified, so path never holds a partial file.
+    If a previous attempt left a partial download of the same remote content, the
+    transfer picks up where it stopped with a Range request.
+    The content's MD5 is stored in md5 if given. */
+int GDConnect::getFileById(const char * id, const char * path, std::string * md5)
+{
+    Json::Value remote = getFileMetadataById(id);
+    if (!remote)
+    {
+        std::cerr << "Error retrieving file id " << id << std::endl;
+        return -1;
+    }
+    std::string part = std::string(path) + ".part";
+    std::string sidecar = part + ".json";
+    curl_off_t offset;
+    Md5 prefix;
+    if (resumeOffset(id, part, remote, offset, prefix))
+        std::cout << "Resuming download of " << path << " at byte " << offset << std::endl;
+    else
+        writeSidecar(part, id, remote);
+    int fd = open(part.c_str(), O_WRONLY | O_CREAT | (offset ? 0 : O_TRUNC), 0644);
+    if (fd < 0)
+    {
+        std::cerr << "Unable to open " << part << " for writing" << std::endl;
+        return -1;
+    }
+    if (offset && lseek(fd, offset, SEEK_SET) != offset)
+    {
+        close(fd);
+        return -1;
+    }
+    DataSink sink = fileSink(fd);
+    int result = streamFile(id, sink, md5, offset, &prefix, remote);
+    if (close(fd) != 0)
+        result = -1;
+    if (result >= 200 && result < 300)
+    {
+        if (rename(part.c_str(), path) != 0)
+        {
+            std::cerr << "Unable to move " << part << " to " << path << std::endl;
+            return -1;
+        }
+        unlink(sidecar.c_str());
+    }
+    else if (result != -1)
+    {
+        // the server refused the file: what was received so far is no use
+        unlink(part.c_str());
+        unlink(sidecar.c_str());
+    }
+    return result;
+}
+
+/* Downloads a file into an already open file descriptor, from its current position */
+int GDConnect::getFileById(const char * id, int fd)
+{
+    DataSink sink = fileSink(fd);
+    return streamFile(id, sink);
+}
+
+/* Downloads a file into a stream */
+int GDConnect::getFileById(const char * id, std::ostream& out)
+{
+    DataSink sink = [&out](const char * data, std::size_t length)
+    {
+        out.write(data, length);
+        return out.good();
+    };
+    return streamFile(id, sink);
+}
+
+/* Downloads a file into memory, appending to buffer.
+    The buffer is grown once up front from the size in the file's metadata. */
+int GDConnect::getFileById(const char * id, std::vector<char>& buffer)
+{
+    Json::Value obj = getFileMetadataById(id);
+    if (!obj)
+    {
+        std::cerr << "Error retrieving file id " << id << std::endl;
+        return -1;
+    }
+    long long filesize = strtoll(obj["size"].asString().c_str(), NULL, 10);
+    if (filesize > 0)
+        buffer.reserve(buffer.size() + filesize);
+    DataSink sink = [&buffer](const char * data, std::size_t length)
+    {
+        buffer.insert(buffer.end(), data, data + length);
+        return true;
+    };
+    return streamFile(id, sink, NULL, 0, NULL, obj);
+}
+
+/* Downloads a file straight into a caller-supplied callback; no file is written */
+int GDConnect::getFileById(const char * id, DataSink sink)
+{
+    return streamFile(id, sink);
+}
+
+/* One HTTP Range segment of a parallel download, written in place with pwrite */
+struct RangeSegment
+{
+    int fd;
+    CURL * handle;      // transfer currently fetching the segment
+    curl_off_t offset;  // first byte of the segment
+    curl_off_t length;
+    curl_off_t written; // bytes of the segment already on disk
+    int attempts;
+    bool renewed;       // already sent again after a 401
+    std::string token;  // bearer token of the current attempt
+};
+
+static std::size_t write_range(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+    RangeSegment * seg = static_cast<RangeSegment *>(userdata);
+    std::size_t total = size * nmemb;
+    long code = 0;
+    curl_easy_getinfo(seg->handle, CURLINFO_RESPONSE_CODE, &code);
+    if (code >= 200 && code < 300 && code != 206)
+        return 0; // the whole content instead of the range: stop it now rather than download it
+    if (code != 206)
+        return total; // error body: must not land in the file
+    if (seg->written + (curl_off_t) total > seg->length)
+        return 0; // more than was asked for: abort rather than overwrite a neighbour
+    std::size_t done = 0;
+    while (done < total)
+    {
+        ssize_t n = pwrite(seg->fd, ptr + done, total - done, seg->offset + seg->written);
+        if (n < 0)
+            return 0;
+        done += n;
+        seg->written += n;
+    }
+    return total;
+}
+
+/* Function for downloading a large file using parallel HTTP Range requests.
+    The file is preallocated as name.part to the size reported in the file metadata,
+    then split into segments of segmentSize bytes; up to parallelism segments are
+    fetched at once and each is written at its own offset. The part is renamed once
+    every segment is in, and removed if the download fails.
+    A segment that fails is retried from the last byte written, after the scheduler's
+    backoff for throttling and server errors, and once with a renewed token after a 401.
+    A server that answers with the whole content instead of a range gets a plain download,
+    and so does a file stored compressed, which has to be inflated in one stream.
+    Returns 200 on success, otherwise the failing HTTP code or -1.
+*/
+int GDConnect::getFileByIdRanged(const char * id, curl_off_t segmentSize, std::size_t parallelism)
+{
+    const int maxAttempts = 3;
+    Json::Value obj = getFileMetadataById(id);
+    if (!obj)
+    {
+        std::cerr << "Error retrieving file id " << id << std::endl;
+        return -1;
+    }
+    std::string filename = obj["name"].asString();
+    long long originalSize;
+    std::string originalMd5;
+    if (decompressDownloads && compressedOriginal(toFileInfo(obj), originalSize, originalMd5))
+    {
+        // a gzip stream can only be inflated from its start
+        std::cerr << id << " is stored compressed, downloading it whole" << std::endl;
+        return getFileById(id, filename.c_str());
+    }
+    std::string part = filename + ".part";
+    curl_off_t filesize = strtoll(obj["size"].asString().c_str(), NULL, 10);
+    if (segmentSize <= 0)
+        segmentSize = filesize > 0 ? filesize : 1;
+
+    int fd = open(part.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        std::cerr << "Unable to open " << part << " for writing" << std::endl;
+        return -1;
+    }
+    if (filesize > 0 && posix_fallocate(fd, 0, filesize) != 0 && ftruncate(fd, filesize) != 0)
+    {
+        std::cerr << "Unable to allocate " << filesize << " bytes for " << filename << std::endl;
+        close(fd);
+        unlink(part.c_str());
+        return -1;
+    }
+
+    std::vector<RangeSegment> segments;
+    for (curl_off_t offset = 0; offset < filesize; offset += segmentSize)
+    {
+        RangeSegment seg;
+        seg.fd = fd;
+        seg.offset = offset;
+        seg.length = std::min(segmentSize, filesize - offset);
+        seg.handle = NULL;
+        seg.written = 0;
+        seg.attempts = 0;
+        seg.renewed = false;
+        segments.push_back(seg);
+    }
+
+    std::string url = apiURL + "/drive/v3/files/" + id + "?alt=media";
+    std::string token;
+    struct curl_slist * slist = authorize(NULL, &token);
+    std::vector<struct curl_slist *> retired; // header lists of a previous token, still read by transfers in flight
+    TransferQueue queue(parallelism);
+    queue.setGate([this](CURL *) { return scheduler->tryAcquire(RequestScheduler::Bulk); });
+    int result = 200;
+    bool rangeIgnored = false;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    std::function<void(RangeSegment *, long)> fetch;
+    fetch = [&](RangeSegment * seg, long delay)
+    {
+        if (rangeIgnored)
+            return; // a plain download takes over
+        CURL * curlHandle = pool->acquire();
+        if (!curlHandle)
+        {
+            result = -1;
+            return;
+        }
+        if (credentials()->accessToken != token)
+        {
+            // renewed since the last request went out: later requests carry the new token
+            retired.push_back(slist);
+            slist = authorize(NULL, &token);
+        }
+        std::stringstream range;
+        range << seg->offset + seg->written << "-" << seg->offset + seg->length - 1;
+        seg->attempts++;
+        seg->handle = curlHandle;
+        seg->token = token;
+        curl_easy_setopt(curlHandle, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curlHandle, CURLOPT_HTTPGET, 1);
+        curl_easy_setopt(curlHandle, CURLOPT_RANGE, range.str().c_str());
+        curl_easy_setopt(curlHandle, CURLOPT_WRITEFUNCTION, write_range);
+        curl_easy_setopt(curlHandle, CURLOPT_WRITEDATA, seg);
+        curl_easy_setopt(curlHandle, CURLOPT_HTTPHEADER, slist);
+        queue.add(curlHandle, [&, seg](CURL * handle, CURLcode res)
+        {
+            long code = -1;
+            curl_off_t bytes = 0;
+            if (res == CURLE_OK || res == CURLE_WRITE_ERROR)
+                curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &code);
+            curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+            metrics->record(handle, "media", code, seg->attempts - 1);
+            pool->release(handle);
+            scheduler->charge(bytes);
+            if (code >= 200 && code < 300 && code != 206)
+            {
+                rangeIgnored = true;
+                return;
+            }
+            // the same renewal perform() goes through; a token found already replaced costs no second chance
+            bool stale = credentials()->accessToken != seg->token;
+            if (code == 401 && (stale || !seg->renewed) && !renewAfterUnauthorized(seg->token))
+            {
+                seg->renewed = seg->renewed || !stale;
+                seg->attempts--;
+                fetch(seg, 0);
+                return;
+            }
+            long delay = scheduler->complete(code, "", 0, seg->attempts - 1);
+            if (delay >= 0 && seg->attempts < maxAttempts)
+            {
+                // throttled or server error: the segment waits out its backoff, the others carry on
+                fetch(seg, delay);
+                return;
+            }
+            if (code == 206 && seg->written == seg->length)
+                return;
+            if (code == 206 || res != CURLE_OK)
+            {
+                // short or interrupted segment: pick up where it stopped
+                if (seg->attempts < maxAttempts)
+                {
+                    fetch(seg, 0);
+                    return;
+                }
+            }
+            fprintf(stderr, "Segment at offset %" CURL_FORMAT_CURL_OFF_T " failed: %s (HTTP %ld)\n",
+                    seg->offset, curl_easy_strerror(res), code);
+            result = code == 206 ? -1 : code;
+        }, delay);
+    };
+    for (std::size_t i = 0; i < segments.size(); i++)
+        fetch(&segments[i], 0);
+
+    if (queue.run())
+        result = -1;
+    curl_slist_free_all(slist);
+    for (std::size_t i = 0; i < retired.size(); i++)
+        curl_slist_free_all(retired[i]);
+    if (close(fd) != 0)
+        result = -1;
+
+    if (rangeIgnored)
+    {
+        std::cerr << "Range requests ignored for " << id << ", downloading it whole" << std::endl;
+        unlink(part.c_str());
+        result = getFileById(id, filename.c_str());
+    }
+    else if (result == 200 && rename(part.c_str(), filename.c_str()) != 0)
+    {
+        std::cerr << "Unable to move " << part << " to " << filename << std::endl;
+        result = -1;
+    }
+    if (result != 200 && !rangeIgnored)
+        unlink(part.c_str()); // zero-filled gaps must never pass for content
+
+    metrics->span("getFileByIdRanged", id, start, std::chrono::steady_clock::now());
+    return result;
+}
+
+/* State of one file moving through getFilesById: metadata lookup, then media download */
+struct MultiDownload
+{
+    TransferResult * result;
+    CURL * handle;
+    std::string metadata;
+    std::string expectedMd5;
+    std::string part;       // where the content goes until it is complete and verified
+    std::string error;      // body of a failed media response
+    struct curl_slist * slist;
+    std::string token;      // bearer token in slist
+    bool renewed;           // already sent again after a 401
+    int attempts;           // retries of the current stage after a rate limit or server error
+    FILE * fp;
+    Md5 digest;             // of the content as stored
+    std::unique_ptr<Inflater> inflater; // for files uploaded compressed by this client
+    long long originalSize;
+    std::string originalMd5;
+    Md5 inflatedDigest;     // of the content once inflated
+};
+
+/* Starts inflating a compressed bulk download from the beginning, into its file */
+static void startInflater(MultiDownload * dl)
+{
+    dl->inflatedDigest.reset();
+    dl->inflater.reset(new Inflater([dl](const char * data, std::size_t length)
+    {
+        dl->inflatedDigest.update(data, length);
+        return fwrite(data, 1, length, dl->fp) == length;
+    }));
+}
+
+/* Writes a successful bulk download to its file, hashing it on the way.
+    The body of an error response is kept aside rather than written. */
+static std::size_t write_hashed(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+    MultiDownload * dl = static_cast<MultiDownload *>(userdata);
+    long code = 0;
+    curl_easy_getinfo(dl->handle, CURLINFO_RESPONSE_CODE, &code);
+    if (code < 200 || code >= 300)
+    {
+        dl->error.append(ptr, size * nmemb);
+        return size * nmemb;
+    }
+    dl->digest.update(ptr, size * nmemb);
+    if (dl->inflater)
+        return dl->inflater->write(ptr, size * nmemb) ? size * nmemb : 0;
+    return fwrite(ptr, size, nmemb, dl->fp);
+}
+
+/* Function for downloading many files concurrently from Google Drive.
+    Each file goes through two transfers on the same event loop: a metadata
+    request for its name, then the media download itself. Files uploaded
+    compressed by this client are inflated on the way, as by getFileById. At most maxInFlight
+    transfers run at once, sharing the client's pooled connections. A request
+    refused with 401 is sent once more with a renewed token; one throttled or
+    failing on the server side waits out the scheduler's backoff and is sent
+    again, while the other transfers carry on.
+    Content goes to name.part and is renamed to name once complete and verified;
+    a name already taken by another file of the same call gets the file's ID
+    appended (name.id), and a name that is not a plain file name is refused.
+    Per-file outcomes, with the path each file was saved to, are stored in
+    results, in the same order as ids; the returned figures sum them up.
+*/
+TransferStats GDConnect::getFilesById(const std::vector<std::string>& ids, std::vector<TransferResult>& results,
+                                      std::size_t maxInFlight)
+{
+    TransferStats stats = TransferStats();
+    results.assign(ids.size(), TransferResult());
+    std::vector<MultiDownload> downloads(ids.size());
+    TransferQueue queue(maxInFlight);
+    queue.setGate([this](CURL *) { return scheduler->tryAcquire(RequestScheduler::Bulk); });
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::set<std::string> claimed;  // destinations of this call, only touched by the event loop
+
+    // every request goes out with the current token
+    std::function<void(MultiDownload *)> authorizeCurrent = [this](MultiDownload * dl)
+    {
+        if (dl->slist && credentials()->accessToken == dl->token)
+            return;
+        curl_slist_free_all(dl->slist);
+        dl->slist = authorize(NULL, &dl->token);
+        curl_easy_setopt(dl->handle, CURLOPT_HTTPHEADER, dl->slist);
+    };
+    // one more attempt after a 401 once the token is renewed; a token found
+    // already replaced by another thread is simply retried with the new one
+    std::function<bool(MultiDownload *)> renewed = [this](MultiDownload * dl)
+    {
+        bool stale = credentials()->accessToken != dl->token;
+        if (dl->renewed && !stale)
+            return false;
+        dl->renewed = dl->renewed || !stale;
+        return renewAfterUnauthorized(dl->token) == 0;
+    };
+    std::function<void(MultiDownload *, long)> fetchMedia = [this, &queue, &authorizeCurrent, &renewed,
+                                                             &fetchMedia](MultiDownload * dl, long delay)
+    {
+        std::string url = apiURL + "/drive/v3/files/" + dl->result->id + "?alt=media";
+        authorizeCurrent(dl);
+        curl_easy_setopt(dl->handle, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(dl->handle, CURLOPT_WRITEFUNCTION, write_hashed);
+        curl_easy_setopt(dl->handle, CURLOPT_WRITEDATA, dl);
+        queue.add(dl->handle, [this, dl, &renewed, &fetchMedia](CURL * handle, CURLcode res)
+        {
+            long code = -1;
+            if (res == CURLE_OK)
+                curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &code);
+            metrics->record(handle, "media", code, dl->attempts);
+            if (code == 401 && renewed(dl))
+            {
+                dl->error.clear(); // nothing reached the file
+                fetchMedia(dl, 0);
+                return;
+            }
+            if (res == CURLE_OK)
+            {
+                curl_off_t bytes;
+                double seconds;
+                curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+                curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME, &seconds);
+                scheduler->charge(bytes);
+                // a 429 also slows the other transfers down
+                long delay = scheduler->complete(code, errorReason(dl->error), 0, dl->attempts);
+                if (delay >= 0)
+                {
+                    // start the file over once the backoff is waited out
+                    dl->attempts++;
+                    dl->error.clear();
+                    dl->digest.reset();
+                    if (dl->inflater)
+                        startInflater(dl);
+                    fflush(dl->fp);
+                    if (ftruncate(fileno(dl->fp), 0) == 0)
+                    {
+                        rewind(dl->fp);
+                        fetchMedia(dl, delay);
+                        return;
+                    }
+                }
+                dl->result->code = code;
+                dl->result->bytes = bytes;
+                dl->result->seconds = seconds;
+                dl->result->md5 = dl->digest.hexDigest();
+                if (code != 200)
+                    std::cerr << "Download of " << dl->result->id << " failed with code " << code << ": "
+                              << dl->error << std::endl;
+                else if (verifyChecksums && !dl->expectedMd5.empty() && dl->expectedMd5 != dl->result->md5)
+                {
+                    std::cerr << "Checksum mismatch for " << dl->result->id << ": expected "
+                              << dl->expectedMd5 << ", got " << dl->result->md5 << std::endl;
+                    dl->result->code = -1;
+                }
+                else if (dl->inflater && (!dl->inflater->finished()
+                                          || (long long) dl->inflater->produced() != dl->originalSize))
+                {
+                    std::cerr << "Decompressed " << dl->result->id << " to " << dl->inflater->produced()
+                              << " bytes instead of " << dl->originalSize << std::endl;
+                    dl->result->code = -1;
+                }
+                else if (dl->inflater && verifyChecksums && !dl->originalMd5.empty()
+                         && dl->originalMd5 != dl->inflatedDigest.hexDigest())
+                {
+                    std::cerr << "Checksum mismatch for " << dl->result->id << " once decompressed: expected "
+                              << dl->originalMd5 << ", got " << dl->inflatedDigest.hexDigest() << std::endl;
+                    dl->result->code = -1;
+                }
+            }
+            else
+                std::cerr << "Download of " << dl->result->id << " failed: " << curl_easy_strerror(res) << std::endl;
+            if (fclose(dl->fp) != 0 && dl->result->code == 200)
+                dl->result->code = -1;
+            dl->fp = NULL;
+            if (dl->result->code == 200 && rename(dl->part.c_str(), dl->result->path.c_str()) != 0)
+            {
+                std::cerr << "Unable to move " << dl->part << " to " << dl->result->path << std::endl;
+                dl->result->code = -1;
+            }
+            if (dl->result->code != 200)
+                unlink(dl->part.c_str());
+            pool->release(handle);
+            dl->handle = NULL;
+        }, delay);
+    };
+    std::function<void(MultiDownload *, long)> fetchMetadata = [this, &queue, &claimed, &authorizeCurrent, &renewed,
+                                                                &fetchMedia, &fetchMetadata](MultiDownload * dl, long delay)
+    {
+        dl->metadata.clear();
+        authorizeCurrent(dl);
+        std::string url = apiURL + "/drive/v3/files/" + dl->result->id + "?fields=name,size,md5Checksum,appProperties";
+        curl_easy_setopt(dl->handle, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(dl->handle, CURLOPT_HTTPGET, 1);
+        curl_easy_setopt(dl->handle, CURLOPT_WRITEFUNCTION, callback);
+        curl_easy_setopt(dl->handle, CURLOPT_WRITEDATA, &dl->metadata);
+        queue.add(dl->handle, [this, dl, &claimed, &renewed, &fetchMedia, &fetchMetadata](CURL * handle, CURLcode res)
+        {
+            long code = -1;
+            if (res == CURLE_OK)
+                curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &code);
+            metrics->record(handle, "metadata", code, dl->attempts);
+            if (code == 401 && renewed(dl))
+            {
+                fetchMetadata(dl, 0);
+                return;
+            }
+            long delay = res == CURLE_OK ? scheduler->complete(code, errorReason(dl->metadata), 0, dl->attempts) : -1;
+            if (delay >= 0)
+            {
+                dl->attempts++;
+                fetchMetadata(dl, delay);
+                return;
+            }
+            Json::Value obj;
+            Json::Reader reader;
+            if (code != 200 || !reader.parse(dl->metadata, obj))
+            {
+                std::cerr << "Error retrieving file id " << dl->result->id << std::endl;
+                dl->result->code = code;
+                pool->release(handle);
+                dl->handle = NULL;
+                return;
+            }
+            dl->result->name = obj["name"].asString();
+            dl->expectedMd5 = obj["md5Checksum"].asString();
+            dl->result->path = dl->result->name;
+            if (claimed.count(dl->result->path))
+                dl->result->path += "." + dl->result->id; // same name as another file of the call
+            if (!usableName(dl->result->name) || !claimed.insert(dl->result->path).second)
+            {
+                std::cerr << "Unable to save " << dl->result->id << ": its name " << dl->result->name
+                          << " cannot be used as a local file name" << std::endl;
+                dl->result->path.clear();
+                pool->release(handle);
+                dl->handle = NULL;
+                return;
+            }
+            dl->part = dl->result->path + ".part";
+            dl->fp = fopen(dl->part.c_str(), "wb");
+            if (!dl->fp)
+            {
+                std::cerr << "Unable to open " << dl->part << " for writing" << std::endl;
+                pool->release(handle);
+                dl->handle = NULL;
+                return;
+            }
+            if (decompressDownloads && compressedOriginal(toFileInfo(obj), dl->originalSize, dl->originalMd5))
+                startInflater(dl);
+            dl->renewed = false; // the media request gets its own second chance and retries
+            dl->attempts = 0;
+            fetchMedia(dl, 0); // second stage: same handle, now fetching the content
+        }, delay);
+    };
+
+    for (std::size_t i = 0; i < ids.size(); i++)
+    {
+        MultiDownload * dl = &downloads[i];
+        dl->result = &results[i];
+        dl->result->id = ids[i];
+        dl->result->code = -1;
+        dl->slist = NULL;
+        dl->renewed = false;
+        dl->attempts = 0;
+        dl->fp = NULL;
+        dl->handle = pool->acquire();
+        if (dl->handle)
+            fetchMetadata(dl, 0);
+    }
+
+    if (queue.run())
+        std::cerr << "Transfer loop failed" << std::endl;
+
+    for (std::size_t i = 0; i < downloads.size(); i++)
+    {
+        curl_slist_free_all(downloads[i].slist);
+        if (downloads[i].fp)
+        {
+            fclose(downloads[i].fp);
+            unlink(downloads[i].part.c_str());
+        }
+        pool->release(downloads[i].handle);
+        if (results[i].code == 200)
+        {
+            stats.succeeded++;
+            stats.bytes += results[i].bytes;
+        }
+        else
+        {
+            stats.failed++;
+        }
+    }
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (stats.seconds > 0)
+        stats.throughput = stats.bytes / stats.seconds;
+    metrics->span("getFilesById", std::to_string((unsigned long long) ids.size()) + " files", start,
+                  std::chrono::steady_clock::now());
+    return stats;
+}
+
+/* Function for creating a folder, inside parentId if given.
+    Returns the new folder's ID, or an empty string on error. */
+std::string GDConnect::createFolder(const char * name, const char * parentId)
+{
+    Json::Value root;
+    root["name"] = std::string(name);
+    root["mimeType"] = "application/vnd.google-apps.folder";
+    if (parentId && *parentId)
+        root["parents"].append(std::string(parentId));
+    Json::FastWriter fastWriter;
+    std::string msg = fastWriter.write(root);
+
+    Exchange ex;
+    ex.url = apiURL + "/drive/v3/files?fields=id";
+    ex.operation = "create";
+    ex.body = msg;
+    if (!openExchange(ex, true))
+        return std::string();
+    curl_easy_setopt(ex.handle, CURLOPT_POST, 1);
+    curl_easy_setopt(ex.handle, CURLOPT_POSTFIELDSIZE, (long) ex.body.size());
+    curl_easy_setopt(ex.handle, CURLOPT_POSTFIELDS, ex.body.c_str());
+    ex.headers = curl_slist_append(ex.headers, "Content-Type: application/json; charset=UTF-8");
+    int code = perform(ex);
+    Json::Value obj;
+    Json::Reader reader;
+    std::string id;
+    if (code == 200 && reader.parse(ex.response, obj))
+        id = obj["id"].asString();
+    else
+        std::cerr << "Unable to create folder " << name << " (code " << code << "): " << ex.response << std::endl;
+    closeExchange(ex);
+    return id;
+}
+
+/* Function for obtaining a Google Drive file's ID using an exact name search */
+std::string GDConnect::getFileId(const char * filename)
+{
+    const std::string url = apiURL + "/drive/v3/files?";
+    if (index)
+    {
+        std::vector<std::string> ids = index->idsByName(filename);
+        if (ids.size() == 1)
+            return ids[0];
+        if (ids.size() > 1)
+        {
+            std::cout << "Error getting file ID: " << ids.size() << " files match name " << filename << std::endl;
+            return std::string();
+        }
+        // not indexed yet: fall through to a remote search
+    }
+    std::string searchString = std::string("name=\"") + filename + "\"";
+
+    std::string msg = "q=" + escape(searchString);
+
+    ListingParser page;
+    std::string error;
+    std::string id;
+    if (getListing(url + msg, page, error) == 200)
+    {
+        if (page.files.size() == 0 )
+        {
+            std::cout << "Error getting file ID: no files found with name " << filename << std::endl;
+        }
+        if (page.files.size() > 1)
+        {
+            std::cout << "Error getting file ID: " << page.files.size() << " files match name " << filename << std::endl;
+        }
+        if (page.files.size() == 1)
+        {
+            id = page.files[0].id;
+        }
+    }
+    return id;
+}
+
+/* Function for initiating resumable upload of a local file
+    On success, returns location in result.first:
+    HTTP/1.1 200 OK
+    Location: https://www.googleapis.com/upload/drive/v3/files?uploadType=resumable&upload_id=xa298sd_sdlkj2
+    Content-Length: 0
+    The Location header provides a URI for actual upload of file
+*/
+std::pair<std::string, int> GDConnect::initUpload(const UploadTarget& target, const std::string& id, long fileSize)
+{
+    Exchange ex;
+    if (!prepareInitUpload(ex, target, id, fileSize))
+        return std::pair<std::string, int>("Unable to start curl", -1);
+    int code = perform(ex);
+    std::pair<std::string, int> result;
+    if (code == 200)
+        result.first = headerValue(ex.header, "Location"); // URI for the resumable upload
+    else if (code == -1)
+        result.first = "curl_easy_perform() failed";
+    else
+        result.first = ex.response;
+    result.second = code;
+    closeExchange(ex);
+    return result;
+}
+
+/* Sets up the request starting a resumable upload session: a new file
+    created under id, or new content for target.fileId if it is set */
+bool GDConnect::prepareInitUpload(Exchange& ex, const UploadTarget& target, const std::string& id, long fileSize)
+{
+    Json::Value root(Json::objectValue);
+    if (!target.name.empty())
+        root["name"] = target.name;
+    for (std::map<std::string, std::string>::const_iterator it = target.appProperties.begin();
+            it != target.appProperties.end(); ++it)
+        root["appProperties"][it->first] = it->second;
+    if (target.fileId.empty())
+    {
+        root["id"] = id;
+        if (!target.parentId.empty())
+            root["parents"].append(target.parentId);
+        ex.url = apiURL + "/upload/drive/v3/files?uploadType=resumable";
+    }
+    else
+        ex.url = apiURL + "/upload/drive/v3/files/" + target.fileId + "?uploadType=resumable";
+    ex.url += "&fields=id,md5Checksum"; // the final answer of the session carries the stored checksum
+    Json::FastWriter fastWriter;
+    ex.body = fastWriter.write(root);
+    if (!openExchange(ex, true))
+        return false;
+    curl_easy_setopt(ex.handle, CURLOPT_POST, 1);
+    if (!target.fileId.empty())
+        curl_easy_setopt(ex.handle, CURLOPT_CUSTOMREQUEST, "PATCH");
+    curl_easy_setopt(ex.handle, CURLOPT_POSTFIELDSIZE, (long) ex.body.size());
+    curl_easy_setopt(ex.handle, CURLOPT_POSTFIELDS, ex.body.c_str());
+
+    std::stringstream sbuilder;
+    ex.headers = curl_slist_append(ex.headers, "Content-Type: application/json; charset=UTF-8");
+    ex.headers = curl_slist_append(ex.headers, "X-Upload-Content-Type: application/octet-stream"); // assume binary file
+    if (fileSize >= 0) // unknown for streams compressed on the fly
+    {
+        sbuilder << "X-Upload-Content-Length: " << fileSize;
+        ex.headers = curl_slist_append(ex.headers, sbuilder.str().c_str());
+    }
+    return true;
+}
+
+/* Sets the amount of data sent per upload request.
+    Drive requires chunks to be a multiple of 256 KiB, so the size is rounded down to one. */
+void GDConnect::setUploadChunkSize(curl_off_t bytes)
+{
+    const curl_off_t unit = 256 * 1024;
+    uploadChunkSize = bytes < unit ? unit : bytes - bytes % unit;
+}
+
+/* Sets the size of the buffer cURL fills from the upload source on each read.
+    Larger buffers mean fewer read callbacks and larger socket writes; 0 keeps cURL's default. */
+void GDConnect::setUploadBufferSize(long bytes)
+{
+    uploadBufferSize = bytes;
+}
+
+/* Resumable upload sessions are recorded next to the source file so that
+    an interrupted upload can be picked up again, even by another process */
+static std::string sessionFilename(const char * filename)
+{
+    return std::string(filename) + ".upload.json";
+}
+
+static int loadUploadSession(const char * filename, const struct stat& fileInfo, std::string& uri, std::string& id)
+{
+    Json::Value obj;
+    Json::Reader reader;
+    std::ifstream sessionFile(sessionFilename(filename).c_str());
+    if (!sessionFile.is_open() || !reader.parse(sessionFile, obj))
+        return -1;
+    // the session is only good for the exact file it was started for
+    if (obj["size"].asString() != std::to_string((long long) fileInfo.st_size)
+            || obj["mtime"].asString() != std::to_string((long long) fileInfo.st_mtime))
+        return -1;
+    uri = obj["uri"].asString();
+    id = obj["id"].asString();
+    return uri.empty() ? -1 : 0;
+}
+
+static int saveUploadSession(const char * filename, const struct stat& fileInfo, const std::string& uri, const std::string& id)
+{
+    Json::Value obj;
+    obj["uri"] = uri;
+    obj["id"] = id;
+    obj["size"] = std::to_string((long long) fileInfo.st_size);
+    obj["mtime"] = std::to_string((long long) fileInfo.st_mtime);
+    Json::StyledWriter writer;
+    std::ofstream sessionFile(sessionFilename(filename).c_str(), std::ofstream::trunc);
+    if (!sessionFile.is_open())
+    {
+        std::cerr << "Unable to save upload session for " << filename << std::endl;
+        return -1;
+    }
+    sessionFile << writer.write(obj);
+    return 0;
+}
+
+/* Sends bytes [offset, offset + length) of a total-byte upload to a resumable session URI.
+    With length 0 nothing is sent and the request only asks Google how far the upload got.
+    Returns the HTTP code: 308 while the upload is incomplete, 200 or 201 once it is done,
+    -1 if the request itself failed. On 308, committed is set to the number of bytes
+    Google has persisted, from which the next chunk must start.
+*/
+int GDConnect::uploadChunk(const std::string& uri, const char * data, curl_off_t offset, curl_off_t length,
+                           curl_off_t total, curl_off_t& committed, std::string& response)
+{
+    Exchange ex;
+    if (!prepareUploadChunk(ex, uri, data, offset, length, total))
+    {
+        response = "Unable to start curl";
+        return -1;
+    }
+    int result = perform(ex);
+    if (result == 308)
+        committed = committedBytes(ex);
+    response = ex.response;
+    closeExchange(ex);
+    return result;
+}
+
+/* Sets up one chunk upload (or, with length 0, a status query) on a resumable session.
+    total is -1 until the size of the whole upload is known. */
+bool GDConnect::prepareUploadChunk(Exchange& ex, const std::string& uri, const char * data, curl_off_t offset,
+                                   curl_off_t length, curl_off_t total)
+{
+    ex.url = uri;
+    ex.priority = RequestScheduler::Bulk;
+    ex.retryable = false; // the data is consumed, and upload() asks where to resume instead
+    if (!openExchange(ex, false)) // the session URI itself authorizes the upload
+        return false;
+    std::stringstream contentRange;
+    if (length > 0)
+        contentRange << "Content-Range: bytes " << offset << "-" << offset + length - 1 << "/";
+    else
+        contentRange << "Content-Range: bytes */";
+    if (total >= 0)
+        contentRange << total;
+    else
+        contentRange << "*"; // the final size is not known yet
+    ex.headers = curl_slist_append(ex.headers, contentRange.str().c_str());
+    ex.headers = curl_slist_append(ex.headers, "Expect:"); // don't wait a round trip for 100-continue
+
+    ex.reader.data = data;
+    ex.reader.remaining = length;
+    curl_easy_setopt(ex.handle, CURLOPT_UPLOAD, 1L);
+    curl_easy_setopt(ex.handle, CURLOPT_READFUNCTION, read_memory);
+    curl_easy_setopt(ex.handle, CURLOPT_READDATA, &ex.reader);
+    curl_easy_setopt(ex.handle, CURLOPT_INFILESIZE_LARGE, length);
+    if (uploadBufferSize > 0)
+        curl_easy_setopt(ex.handle, CURLOPT_UPLOAD_BUFFERSIZE, uploadBufferSize);
+    return true;
+}
+
+/* Number of bytes Google has stored, from a 308 answer to a chunk or status query:
+    "Range: bytes=0-N" means bytes 0 to N are stored; no Range header means none are */
+curl_off_t GDConnect::committedBytes(const Exchange& ex)
+{
+    std::string range = headerValue(ex.header, "Range");
+    std::size_t dash = range.find('-');
+    return dash == std::string::npos ? 0 : strtoll(range.c_str() + dash + 1, NULL, 10) + 1;
+}
+
+/* Function for uploading a local file.
+    The file is memory-mapped and chunks are handed to cURL straight from the
+    mapping, so the data is never staged through a stdio buffer.
+*/
+std::pair<std::string, int> GDConnect::putFile(const char * filename)
+{
+    UploadTarget target;
+    target.name = filename;
+    return putFile(filename, target);
+}
+
+/* Uploads a local file to an explicit target: a new file with the given name
+    (inside target.parentId if set), or new content for the existing target.fileId.
+    Returns the Drive ID of the file in result.first on success, and the MD5
+    of what was sent in md5 if given. */
+std::pair<std::string, int> GDConnect::putFile(const char * filename, const UploadTarget& target, std::string * md5)
+{
+    std::cout << "Uploading file " << filename << std::endl;
+    Metrics::Span span(metrics, "putFile", filename);
+
+    struct stat fileInfo;
+    int fd;
+    const char * data = NULL;
+
+    fd = open(filename, O_RDONLY); /* open file to upload */
+    if (fd < 0)
+    {
+        return std::pair<std::string, int>("Unable to open file", -1); /* can't continue */
+    }
+
+    /* to get the file size */
+    if (fstat(fd, &fileInfo) != 0)
+    {
+        close(fd);
+        return std::pair<std::string, int>("Unable to get file stats", -1); /* can't continue */
+    }
+
+    if (fileInfo.st_size > 0)
+    {
+        void * map = mmap(NULL, fileInfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+        {
+            close(fd);
+            return std::pair<std::string, int>("Unable to map file", -1); /* can't continue */
+        }
+        madvise(map, fileInfo.st_size, MADV_SEQUENTIAL);
+        data = static_cast<const char *>(map);
+    }
+
+    std::pair<std::string, int> result = store(target, data, fileInfo.st_size, filename, &fileInfo, md5);
+    if (data)
+        munmap(const_cast<char *>(data), fileInfo.st_size);
+    close(fd);
+    return result;
+}
+
+/* Function for uploading data held in memory under the given file name,
+    without writing it to a temporary file first. The caller keeps ownership
+    of the buffer, which must stay valid until the call returns.
+*/
+std::pair<std::string, int> GDConnect::putBuffer(const char * name, const void * data, std::size_t length)
+{
+    std::cout << "Uploading buffer as " << name << std::endl;
+    Metrics::Span span(metrics, "putBuffer", name);
+    UploadTarget target;
+    target.name = name;
+    return store(target, static_cast<const char *>(data), length, NULL, NULL, NULL);
+}
+
+/* Picks the upload method for total bytes: a single multipart request below
+    the multipart threshold, otherwise a resumable session, compressed or not */
+std::pair<std::string, int> GDConnect::store(const UploadTarget& target, const char * data, curl_off_t total,
+                                             const char * path, const struct stat * fileInfo, std::string * md5)
+{
+    if (total < multipartThreshold)
+        return uploadMultipart(target, data, total, md5);
+    if (compressionLevel > 0)
+        return uploadCompressed(target, data, total, md5);
+    return upload(target, data, total, path, fileInfo, md5);
+}
+
+/* Sets the size below which files are sent in a single multipart request
+    rather than through a resumable session; 0 always uses sessions */
+void GDConnect::setMultipartThreshold(curl_off_t bytes)
+{
+    multipartThreshold = bytes;
+}
+
+/* Feeds the bytes between hashed and committed to digest */
+static void hashCommitted(Md5& digest, const char * data, curl_off_t& hashed, curl_off_t committed)
+{
+    if (committed > hashed)
+    {
+        digest.update(data + hashed, committed - hashed);
+        hashed = committed;
+    }
+}
+
+/* Checks the MD5 of uploaded content against the md5Checksum in Google's final answer */
+bool GDConnect::uploadMatches(const char * name, const std::string& response, const std::string& actual)
+{
+    Json::Value obj;
+    Json::Reader reader;
+    if (!verifyChecksums || !reader.parse(response, obj) || !obj.isObject() || obj["md5Checksum"].asString().empty())
+        return true;
+    if (obj["md5Checksum"].asString() == actual)
+        return true;
+    std::cerr << "Checksum mismatch for " << name << ": sent " << actual << ", Drive stored "
+              << obj["md5Checksum"].asString() << std::endl;
+    return false;
+}
+
+/* Compresses uploads with gzip at the given zlib level (1 to 9), or not at all with 0 (the default) */
+void GDConnect::setUploadCompression(int level)
+{
+    compressionLevel = std::max(0, std::min(level, 9));
+}
+
+/* Turns transparent decompression of downloads compressed by this client on or off (on by default) */
+void GDConnect::setTransparentDecompression(bool enable)
+{
+    decompressDownloads = enable;
+}
+
+/* Sets the appProperties by which downloads and tree syncs recognise content
+    compressed by this client: the codec, and the size and MD5 of the original */
+static void tagCompressed(UploadTarget& target, const char * data, curl_off_t total)
+{
+    Md5 original;
+    original.update(data, total);
+    target.appProperties["gdconnect.codec"] = "gzip";
+    target.appProperties["gdconnect.size"] = std::to_string((long long) total);
+    target.appProperties["gdconnect.md5"] = original.hexDigest();
+}
+
+/* Upload of total bytes at data to target, gzip-compressed on the way.
+    A worker thread compresses the next chunk while the current one is sent, so
+    compression and the network overlap. The compressed size is only known at
+    the end, so chunks go out with an open total. The object is tagged through
+    appProperties with the codec, original size and original MD5 so that downloads
+    restore it and tree syncs can compare it with local files.
+    Only the chunk in flight is kept in memory, which is why compressed uploads
+    are not recorded for resumption by a later run.
+    md5 receives the MD5 of the compressed stream, which is what Drive stores.
+*/
+std::pair<std::string, int> GDConnect::uploadCompressed(const UploadTarget& target, const char * data, curl_off_t total,
+                                                        std::string * md5)
+{
+    const int maxRetries = 5;
+    UploadTarget tagged = target;
+    tagCompressed(tagged, data, total);
+    std::string id;
+    std::string uri;
+    std::string response;
+    int code = openSession(tagged, -1, id, uri, response);
+    if (code != 200)
+        return std::pair<std::string, int>(response, code); /* can't continue */
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    CompressionPipeline pipeline(data, total, compressionLevel, uploadChunkSize);
+    Md5 digest;
+    std::string block;
+    bool last = false;
+    curl_off_t blockStart = 0;
+    curl_off_t committed = 0;
+    code = 308;
+    while (code == 308 && pipeline.next(block, last))
+    {
+        curl_off_t blockEnd = blockStart + block.size();
+        curl_off_t streamTotal = last ? blockEnd : -1;
+        int failures = 0;
+        while (code == 308 && committed < blockEnd)
+        {
+            if (committed < blockStart)
+            {
+                response = "Data from an earlier chunk was lost and is no longer available";
+                code = -1;
+                break;
+            }
+            curl_off_t before = committed;
+            code = uploadChunk(uri, block.data() + (committed - blockStart), committed, blockEnd - committed,
+                               streamTotal, committed, response);
+            if (code == 308 && committed <= before)
+            {
+                // Google kept none of the chunk: retry like a dropped connection, not forever
+                response = "Upload made no progress";
+                code = -1;
+            }
+            if (code == 308 || code == 200 || code == 201)
+            {
+                failures = 0;
+                continue;
+            }
+            if ((code != -1 && code < 500) || ++failures > maxRetries)
+                break;
+            // connection dropped or server error: wait, then find out what Google kept
+            std::this_thread::sleep_for(std::chrono::milliseconds(scheduler->backoff(failures)));
+            code = uploadChunk(uri, NULL, 0, 0, streamTotal, committed, response);
+            if (code == -1 || code >= 500)
+                code = 308; // ask again on the next round
+        }
+        if (code == 308 || code == 200 || code == 201)
+            digest.update(block.data(), block.size());
+        blockStart = blockEnd;
+    }
+    if (code == 308)
+        response = "Compression failed"; // the pipeline ended before its last block
+
+    if (code != 200 && code != 201)
+    {
+        std::cerr << "Compressed upload of " << target.name << " failed at byte " << committed << std::endl;
+        std::cerr << "Response code was: " << code << std::endl
+                  << "and response was: " << response << std::endl;
+        return std::pair<std::string, int>(response, code);
+    }
+    std::string actual = digest.hexDigest();
+    if (md5)
+        *md5 = actual;
+    if (!uploadMatches(target.name.c_str(), response, actual))
+        return std::pair<std::string, int>("Checksum mismatch", -1);
+
+    std::stringstream detail;
+    detail << target.name << ": " << total << " bytes compressed to " << pipeline.compressedSize();
+    metrics->span("uploadCompressed", detail.str(), start, std::chrono::steady_clock::now());
+    return std::pair<std::string, int>(id, 0);
+}
+
+/* Upload of total bytes at data to target in one multipart/related request
+    carrying both the metadata and the content. Drive assigns the ID, so there
+    is neither an ID request nor a session to open: one round trip per file,
+    at the price of resending everything if the request fails.
+    Compression, when enabled, is applied to the whole content up front.
+*/
+std::pair<std::string, int> GDConnect::uploadMultipart(const UploadTarget& target, const char * data, curl_off_t total,
+                                                       std::string * md5)
+{
+    Exchange ex;
+    std::string sent;
+    std::string error;
+    if (!prepareMultipart(ex, target, data, total, sent, error))
+    {
+        closeExchange(ex);
+        return std::pair<std::string, int>(error, -1);
+    }
+    int code = perform(ex);
+    std::pair<std::string, int> result = multipartResult(target.name, ex, code, sent, md5);
+    closeExchange(ex);
+    return result;
+}
+
+/* Sets up the single request of a multipart upload, compressing the content
+    first when enabled. sentMd5 receives the MD5 of the content as it goes out.
+    Returns false, with the reason in error, if the request could not be set up. */
+bool GDConnect::prepareMultipart(Exchange& ex, const UploadTarget& target, const char * data, curl_off_t total,
+                                 std::string& sentMd5, std::string& error)
+{
+    UploadTarget tagged = target;
+    std::string compressed;
+    if (compressionLevel > 0)
+    {
+        CompressionPipeline pipeline(data, total, compressionLevel, uploadChunkSize);
+        std::string block;
+        bool last = false;
+        while (!last && pipeline.next(block, last))
+            compressed += block;
+        if (!last)
+        {
+            error = "Compression failed";
+            return false;
+        }
+        tagCompressed(tagged, data, total);
+        data = compressed.data();
+        total = compressed.size();
+    }
+    Md5 digest;
+    digest.update(data, total);
+    sentMd5 = digest.hexDigest();
+
+    Json::Value root(Json::objectValue);
+    if (!tagged.name.empty())
+        root["name"] = tagged.name;
+    for (std::map<std::string, std::string>::const_iterator it = tagged.appProperties.begin();
+            it != tagged.appProperties.end(); ++it)
+        root["appProperties"][it->first] = it->second;
+    if (tagged.fileId.empty() && !tagged.parentId.empty())
+        root["parents"].append(tagged.parentId);
+    Json::FastWriter fastWriter;
+
+    // the boundary must not occur in the content; retry with another one in the rare case it does
+    std::string boundary;
+    unsigned long long salt = std::chrono::steady_clock::now().time_since_epoch().count();
+    do
+    {
+        std::stringstream sbuilder;
+        sbuilder << "gdconnect_" << std::hex << salt++;
+        boundary = sbuilder.str();
+    }
+    while (total > 0 && std::search(data, data + total, boundary.begin(), boundary.end()) != data + total);
+
+    ex.body.reserve(total + 512);
+    ex.body += "--" + boundary + "\r\nContent-Type: application/json; charset=UTF-8\r\n\r\n";
+    ex.body += fastWriter.write(root);
+    ex.body += "\r\n--" + boundary + "\r\nContent-Type: application/octet-stream\r\n\r\n";
+    if (total > 0)
+        ex.body.append(data, total);
+    ex.body += "\r\n--" + boundary + "--\r\n";
+
+    if (tagged.fileId.empty())
+        ex.url = apiURL + "/upload/drive/v3/files?uploadType=multipart";
+    else
+        ex.url = apiURL + "/upload/drive/v3/files/" + tagged.fileId + "?uploadType=multipart";
+    ex.url += "&fields=id,md5Checksum";
+    if (!openExchange(ex, true))
+    {
+        error = "Unable to start curl";
+        return false;
+    }
+    curl_easy_setopt(ex.handle, CURLOPT_POST, 1);
+    if (!tagged.fileId.empty())
+        curl_easy_setopt(ex.handle, CURLOPT_CUSTOMREQUEST, "PATCH");
+    curl_easy_setopt(ex.handle, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t) ex.body.size());
+    curl_easy_setopt(ex.handle, CURLOPT_POSTFIELDS, ex.body.c_str());
+    std::string contentType = "Content-Type: multipart/related; boundary=" + boundary;
+    ex.headers = curl_slist_append(ex.headers, contentType.c_str());
+    return true;
+}
+
+/* Interprets the answer to a multipart upload: the new file's ID and code 0,
+    or the error. The checksum Drive stored is checked against sentMd5. */
+std::pair<std::string, int> GDConnect::multipartResult(const std::string& name, Exchange& ex, int code,
+                                                       const std::string& sentMd5, std::string * md5)
+{
+    std::pair<std::string, int> result = exchangeResult(ex, code);
+    if (code != 200)
+    {
+        std::cerr << "Upload of " << name << " failed" << std::endl;
+        std::cerr << "Response code was: " << code << std::endl
+                  << "and response was: " << result.first << std::endl;
+        return result;
+    }
+
+    Json::Value obj;
+    Json::Reader reader;
+    if (!reader.parse(result.first, obj) || obj["id"].asString().empty())
+        return std::pair<std::string, int>(result.first, -1);
+    if (md5)
+        *md5 = sentMd5;
+    if (!uploadMatches(name.c_str(), result.first, sentMd5))
+        return std::pair<std::string, int>("Checksum mismatch", -1);
+    return std::pair<std::string, int>(obj["id"].asString(), 0);
+}
+
+/* Starts a resumable upload session for target, generating an ID first for a new
+    file. total may be -1 while the size is unknown. Returns the HTTP code of the
+    session request, 200 on success with the session URI in uri. A generated ID
+    Drive reports as already in use is dropped for another. */
+int GDConnect::openSession(const UploadTarget& target, curl_off_t total, std::string& id, std::string& uri,
+                           std::string& response)
+{
+    const int maxConflicts = 3;
+    std::pair<std::string, int> initResponse;
+    for (int conflicts = 0; conflicts <= maxConflicts; conflicts++)
+    {
+        if (target.fileId.empty() && ids)
+            id = ids->take();
+        else if (target.fileId.empty())
         {
-            fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-            result.first = "curl_easy_perform() failed";
-            result.second = -1;
+            std::cout << "Requesting Google Drive ID for new file." << std::endl;
+            std::vector<std::string> fresh = generateIds(1);
+            if (!fresh.empty())
+                id = fresh[0];
         }
         else
+            id = target.fileId; // new content for an existing file
+
+        // std::cout << "File id will be " << id << std::endl;
+        std::cout << "Initiating upload" << std::endl;
+
+        initResponse = initUpload(target, id, (long) total);
+        if (initResponse.second != 409 || !target.fileId.empty())
+            break;
+        // the ID was used already, by an earlier run that did not record it: drop it
+        std::cerr << "File ID " << id << " is already in use, trying another" << std::endl;
+    }
+
+    // std::cout << "Upload URI is " << std::endl << initResponse.first << std::endl;
+
+    if (initResponse.second != 200)
+    {
+        std::cerr << "Something went wrong!" << std::endl
+                  << "Request for upload URI should return 200 OK and location" << std::endl;
+        std::cerr << "Response code was: " << initResponse.second << std::endl
+                  << "and response was: " << initResponse.first << std::endl;
+        response = initResponse.first;
+        return initResponse.second;
+    }
+    uri = initResponse.first;
+    return 200;
+}
+
+/* Resumable upload of total bytes at data to target, in chunks of uploadChunkSize.
+    When path and fileInfo are given, the session is recorded next to that file
+    so an interrupted upload of it can be resumed later.
+*/
+std::pair<std::string, int> GDConnect::upload(const UploadTarget& target, const char * data, curl_off_t total,
+                                              const char * path, const struct stat * fileInfo, std::string * md5)
+{
+    const char * name = target.name.c_str();
+    Md5 digest;
+    curl_off_t hashed = 0;
+    if (!path)
+        fileInfo = NULL;
+    const int maxRetries = 5;
+    std::string id;
+    std::string uri;
+    std::string response;
+    curl_off_t committed = 0;
+    int code = -1;
+
+    if (fileInfo && !loadUploadSession(path, *fileInfo, uri, id))
+    {
+        // ask Google how much of the previous attempt it kept
+        code = uploadChunk(uri, NULL, 0, 0, total, committed, response);
+        if (code == 308)
+            std::cout << "Resuming upload at byte " << committed << std::endl;
+        else if (code != 200 && code != 201)
+            uri.clear(); // session expired or unknown: start over
+    }
+
+    if (uri.empty())
+    {
+        code = openSession(target, total, id, uri, response);
+        if (code != 200)
+            return std::pair<std::string, int>(response, code); /* can't continue */
+        if (fileInfo)
+            saveUploadSession(path, *fileInfo, uri, id);
+        committed = 0;
+        code = total > 0 ? 308 : -1;
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int failures = 0;
+    while (code != 200 && code != 201)
+    {
+        curl_off_t length = std::min(uploadChunkSize, total - committed);
+        curl_off_t before = committed;
+        code = uploadChunk(uri, length > 0 ? data + committed : NULL, committed, length, total, committed, response);
+        if (code == 308 && committed <= before)
+        {
+            // Google kept none of the chunk: retry like a dropped connection, not forever
+            response = "Upload made no progress";
+            code = -1;
+        }
+        if (code == 308 || code == 200 || code == 201)
+        {
+            // hash what Google has accepted while it is still hot in the page cache
+            hashCommitted(digest, data, hashed, code == 308 ? committed : total);
+            failures = 0;
+            continue;
+        }
+        if (code != -1 && code < 500)
+            break; // rejected: retrying will not help
+        if (++failures > maxRetries)
+            break;
+        // connection dropped or server error: wait, then find out what Google kept
+        std::this_thread::sleep_for(std::chrono::milliseconds(scheduler->backoff(failures)));
+        code = uploadChunk(uri, NULL, 0, 0, total, committed, response);
+        if (code != -1 && code != 308 && code != 200 && code != 201 && code < 500)
+            break;
+    }
+
+    if (code != 200 && code != 201)
+    {
+        std::cerr << "Upload of " << name << " failed at byte " << committed << " of " << total << std::endl;
+        std::cerr << "Response code was: " << code << std::endl
+                  << "and response was: " << response << std::endl;
+        if (fileInfo && (code == 404 || code == 410))
+            remove(sessionFilename(path).c_str()); // session is gone for good
+        return std::pair<std::string, int>(response, code);
+    }
+    if (fileInfo)
+        remove(sessionFilename(path).c_str());
+    hashCommitted(digest, data, hashed, total); // a resumed session may already have been complete
+    std::string actual = digest.hexDigest();
+    if (md5)
+        *md5 = actual;
+    if (!uploadMatches(name, response, actual))
+        return std::pair<std::string, int>("Checksum mismatch", -1);
+
+    metrics->span("upload", target.name, start, std::chrono::steady_clock::now());
+    return std::pair<std::string, int>(id, 0);
+}
+
+/* Asynchronous API.
+    Every operation below returns at once with a future; its requests are driven by
+    a single I/O thread, so any number of them can be in flight together. The optional
+    callback runs on the I/O thread with the result just before the future becomes
+    ready, and must not block. A cancelled operation completes with a -1 code. */
+
+template <typename T>
+static void settle(std::promise<T>& promise, const std::function<void(const T&)>& callback, const T& value)
+{
+    if (callback)
+        callback(value);
+    promise.set_value(value);
+}
+
+/* The I/O thread is only started by the first asynchronous call */
+AsyncEngine * GDConnect::asyncEngine()
+{
+    std::call_once(engineOnce, [this]() { engine = new AsyncEngine(); });
+    return engine;
+}
+
+/* Opens an exchange for an asynchronous GET of url; returns NULL if cURL could not start */
+std::shared_ptr<Exchange> GDConnect::openGet(const std::string& url, bool authorized)
+{
+    std::shared_ptr<Exchange> ex = std::make_shared<Exchange>();
+    ex->url = url;
+    if (!openExchange(*ex, authorized))
+        return std::shared_ptr<Exchange>();
+    curl_easy_setopt(ex->handle, CURLOPT_HTTPGET, 1);
+    return ex;
+}
+
+/* Performs an exchange on the I/O thread once the scheduler lets it start, retrying
+    once with a renewed token on 401, and after a backoff on rate limit and server errors;
+    waits are timers, so they hold up nothing else.
+    done runs on the I/O thread with the HTTP code, or -1 if the transfer failed or
+    was cancelled; the exchange is closed once done returns.
+    A renewal blocks the I/O thread for one token request, which only happens around expiry. */
+void GDConnect::performAsync(std::shared_ptr<Exchange> ex, Cancellation cancel, std::function<void(int)> done, bool retry)
+{
+    if ((cancel && cancel->cancelled()) || asyncEngine()->stopping())
+    {
+        done(-1);
+        closeExchange(*ex);
+        return;
+    }
+    long wait = scheduler->tryAcquire(ex->priority, ex->reader.remaining + ex->body.size());
+    if (wait > 0)
+    {
+        asyncEngine()->after(std::chrono::milliseconds(wait), [this, ex, cancel, done, retry]()
+        {
+            performAsync(ex, cancel, done, retry);
+        });
+        return;
+    }
+    curl_easy_setopt(ex->handle, CURLOPT_HTTPHEADER, ex->headers);
+    AsyncEngine::watch(ex->handle, cancel.get());
+    asyncEngine()->add(ex->handle, [this, ex, cancel, done, retry](CURL * handle, CURLcode res)
+    {
+        bool stale = false;
+        if (res == CURLE_OK && retry && retryUnauthorized(*ex, stale))
+        {
+            performAsync(ex, cancel, done, stale);
+            return;
+        }
+        long response_code = -1;
+        if (res == CURLE_OK)
         {
-            long response_code;
-            curl_easy_getinfo(curlHandle, CURLINFO_RESPONSE_CODE, &response_code);
-            if (response_code == 200)
+            curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &response_code);
+            long delay = throttle(*ex, response_code);
+            if (delay >= 0)
             {
-                // if upload init request successful, Google returns URI for resumable upload in Location header
-                std::size_t start = header.find("Location: ");
-                std::size_t endline = header.find('\n', start);
-                std::string uri = header.substr(start +10, endline - start - 11); // trim URI from header
-                result.first = uri;
+                resetExchange(*ex);
+                asyncEngine()->after(std::chrono::milliseconds(delay), [this, ex, cancel, done]()
+                {
+                    performAsync(ex, cancel, done, true);
+                });
+                return;
             }
+        }
+        else if (res != CURLE_ABORTED_BY_CALLBACK)
+            fprintf(stderr, "Asynchronous transfer failed: %s\n", curl_easy_strerror(res));
+        metrics->record(handle, operationOf(*ex), response_code, ex->attempts + (retry ? 0 : 1));
+        done(response_code);
+        closeExchange(*ex);
+    });
+}
+
+/* Asynchronous getFileId. The answer is an empty string if no single file has that name.
+    The metadata index is not consulted, as refreshing it would block the I/O thread. */
+std::future<std::string> GDConnect::getFileIdAsync(const char * filename, std::function<void(const std::string&)> done,
+                                                   Cancellation cancel)
+{
+    std::shared_ptr<std::promise<std::string> > promise = std::make_shared<std::promise<std::string> >();
+    std::future<std::string> result = promise->get_future();
+    std::string searchString = std::string("name=\"") + filename + "\"";
+    std::shared_ptr<Exchange> ex = openGet(apiURL + "/drive/v3/files?q=" + escape(searchString), true);
+    if (!ex)
+    {
+        settle(*promise, done, std::string());
+        return result;
+    }
+    std::string name = filename;
+    std::shared_ptr<ListingParser> page = std::make_shared<ListingParser>();
+    ex->sink = [page](const char * data, std::size_t length) { return page->feed(data, length); };
+    performAsync(ex, cancel, [ex, promise, done, name, page](int code)
+    {
+        std::string id;
+        if (code == 200 && !page->failed() && page->finish())
+        {
+            if (page->files.size() == 1)
+                id = page->files[0].id;
             else
+                std::cout << "Error getting file ID: " << page->files.size() << " files match name " << name << std::endl;
+        }
+        settle(*promise, done, id);
+    });
+    return result;
+}
+
+/* State of an asynchronous listing, carried from one page to the next */
+struct AsyncListing
+{
+    FileVisitor visit;
+    std::string base;
+    std::promise<int> promise;
+    std::function<void(const int&)> done;
+    Cancellation cancel;
+};
+
+/* Asynchronous listFiles: every file is passed to visit on the I/O thread.
+    Completes with 0 once every page has been visited (or visit stopped), -1 on error. */
+std::future<int> GDConnect::listFilesAsync(FileVisitor visit, const char * query, std::function<void(const int&)> done,
+                                           Cancellation cancel)
+{
+    std::shared_ptr<AsyncListing> listing = std::make_shared<AsyncListing>();
+    listing->visit = visit;
+    listing->base = apiURL + "/drive/v3/files?pageSize=1000&fields=" + escape(listFields);
+    if (query && *query)
+        listing->base += std::string("&q=") + escape(query);
+    listing->done = done;
+    listing->cancel = cancel;
+    std::future<int> result = listing->promise.get_future();
+    listPageAsync(listing, std::string());
+    return result;
+}
+
+void GDConnect::listPageAsync(std::shared_ptr<AsyncListing> listing, const std::string& pageToken)
+{
+    std::string url = listing->base;
+    if (!pageToken.empty())
+        url += "&pageToken=" + escape(pageToken);
+    std::shared_ptr<Exchange> ex = openGet(url, true);
+    if (!ex)
+    {
+        settle(listing->promise, listing->done, -1);
+        return;
+    }
+    std::shared_ptr<ListingParser> page = std::make_shared<ListingParser>();
+    ex->sink = [page](const char * data, std::size_t length) { return page->feed(data, length); };
+    performAsync(ex, listing->cancel, [this, ex, listing, page](int code)
+    {
+        if (page->failed() || (code == 200 && !page->finish()))
+        {
+            std::cerr << "Error parsing file list JSON object" << std::endl;
+            settle(listing->promise, listing->done, -1);
+            return;
+        }
+        if (code != 200)
+        {
+            if (code != -1)
+                std::cerr << "Listing failed with code " << code << ": " << ex->response << std::endl;
+            settle(listing->promise, listing->done, -1);
+            return;
+        }
+        for (std::size_t i = 0; i < page->files.size(); i++)
+        {
+            if (!listing->visit(page->files[i]))
+            {
+                settle(listing->promise, listing->done, 0);
+                return;
+            }
+        }
+        std::string next = page->nextPageToken;
+        if (next.empty())
+            settle(listing->promise, listing->done, 0);
+        else
+            listPageAsync(listing, next);
+    });
+}
+
+/* State of an asynchronous download, carried from the metadata lookup to the media request */
+struct AsyncDownload
+{
+    std::string id;
+    DataSink sink;
+    Json::Value remote;     // the file's metadata, if it was looked up
+    std::unique_ptr<Inflater> inflater;
+    long long originalSize;
+    Md5 digest;             // of the content as stored
+    curl_off_t from;        // first byte requested
+    curl_off_t skip;        // bytes before from still to drop, if the server ignored the range
+    bool rangeChecked;
+    std::string part;       // for downloads to a file: where the content goes until complete
+    int fd;
+    Json::Value previous;   // sidecar of a partial download found at the start
+    curl_off_t partial;     // bytes of it hashed into digest
+    std::promise<int> promise;
+    std::function<void(const int&)> done;
+    Cancellation cancel;
+};
+
+/* Asynchronous download straight into sink, which runs on the I/O thread.
+    As with the blocking downloads, files uploaded compressed by this client are
+    inflated unless transparent decompression was turned off: the file's metadata
+    is then requested first, to know before the content arrives.
+    Completes with the HTTP response code, or -1 if the transfer failed, was
+    aborted by the sink, was cancelled or delivered content not matching its checksum. */
+std::future<int> GDConnect::getFileByIdAsync(const char * id, DataSink sink, std::function<void(const int&)> done,
+                                             Cancellation cancel)
+{
+    std::shared_ptr<AsyncDownload> dl = std::make_shared<AsyncDownload>();
+    dl->id = id;
+    dl->sink = sink;
+    dl->originalSize = -1;
+    dl->from = 0;
+    dl->skip = 0;
+    dl->rangeChecked = true;
+    dl->fd = -1;
+    dl->partial = 0;
+    dl->done = done;
+    dl->cancel = cancel;
+    std::future<int> result = dl->promise.get_future();
+    if (decompressDownloads)
+        describeAsync(dl);
+    else
+        mediaAsync(dl);
+    return result;
+}
+
+/* Looks up the metadata of the file being downloaded, then requests its content,
+    from where a partial download stopped if there is one to pick up */
+void GDConnect::describeAsync(std::shared_ptr<AsyncDownload> dl)
+{
+    std::shared_ptr<Exchange> ex = openGet(apiURL + "/drive/v3/files/" + dl->id
+                                           + "?fields=id,name,mimeType,size,md5Checksum,modifiedTime,version,appProperties", true);
+    if (!ex)
+    {
+        settle(dl->promise, dl->done, -1);
+        return;
+    }
+    performAsync(ex, dl->cancel, [this, ex, dl](int code)
+    {
+        Json::Reader reader;
+        if (code != 200 || !reader.parse(ex->response, dl->remote) || !dl->remote.isObject())
+        {
+            if (code != -1)
+                std::cerr << "Error retrieving file id " << dl->id << ": " << code << " " << ex->response << std::endl;
+            settle(dl->promise, dl->done, code == 200 ? -1 : code);
+            return;
+        }
+        if (!dl->part.empty() && !preparePart(*dl))
+        {
+            std::cerr << "Unable to write " << dl->part << std::endl;
+            settle(dl->promise, dl->done, -1);
+            return;
+        }
+        std::string originalMd5;
+        if (decompressDownloads && dl->from == 0
+                && compressedOriginal(toFileInfo(dl->remote), dl->originalSize, originalMd5))
+            dl->inflater.reset(new Inflater(dl->sink));
+        mediaAsync(dl);
+    });
+}
+
+/* Requests the content of the file being downloaded, and checks what arrived */
+void GDConnect::mediaAsync(std::shared_ptr<AsyncDownload> dl)
+{
+    std::shared_ptr<Exchange> ex = openGet(apiURL + "/drive/v3/files/" + dl->id + "?alt=media", true);
+    if (!ex)
+    {
+        settle(dl->promise, dl->done, -1);
+        return;
+    }
+    if (dl->inflater)
+    {
+        Inflater * inflater = dl->inflater.get();
+        ex->sink = [inflater](const char * data, std::size_t length) { return inflater->write(data, length); };
+    }
+    else if (dl->from > 0)
+    {
+        CURL * handle = ex->handle;
+        AsyncDownload * state = dl.get();
+        ex->sink = [handle, state](const char * data, std::size_t length)
+        {
+            if (!state->rangeChecked)
+            {
+                state->rangeChecked = true;
+                long code = 0;
+                curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &code);
+                if (code != 206)
+                {
+                    std::cerr << "Range ignored for " << state->id << ", skipping the first " << state->from
+                              << " bytes" << std::endl;
+                    state->digest.reset();
+                    state->skip = state->from;
+                }
+            }
+            state->digest.update(data, length); // the exchange hashes only unranged downloads
+            std::size_t dropped = (std::size_t) std::min<curl_off_t>(state->skip, length);
+            state->skip -= dropped;
+            return length == dropped || state->sink(data + dropped, length - dropped);
+        };
+        ex->headers = curl_slist_append(ex->headers, ("Range: bytes=" + std::to_string((long long) dl->from) + "-").c_str());
+        dl->rangeChecked = false;
+    }
+    else
+        ex->sink = dl->sink;
+    if (dl->from == 0)
+        ex->md5 = &dl->digest;
+    ex->priority = RequestScheduler::Bulk;
+    performAsync(ex, dl->cancel, [this, ex, dl](int code)
+    {
+        if (code < 200 || code >= 300)
+        {
+            if (code != -1)
+                std::cerr << "Download of " << dl->id << " failed with code " << code << ": " << ex->response << std::endl;
+            settle(dl->promise, dl->done, code);
+            return;
+        }
+        if (dl->inflater && (!dl->inflater->finished() || (long long) dl->inflater->produced() != dl->originalSize))
+        {
+            std::cerr << "Decompressed " << dl->id << " to " << dl->inflater->produced() << " bytes instead of "
+                      << dl->originalSize << std::endl;
+            settle(dl->promise, dl->done, -1);
+            return;
+        }
+        std::string actual = dl->digest.hexDigest();
+        std::string expected = verifyChecksums ? announcedMd5(ex->header) : actual;
+        if (expected.empty() && dl->remote)
+            expected = dl->remote["md5Checksum"].asString();
+        std::shared_ptr<Exchange> metadata;
+        if (expected.empty() && !dl->remote)
+            metadata = openGet(apiURL + "/drive/v3/files/" + dl->id + "?fields=md5Checksum", true);
+        if (!metadata)
+        {
+            if (!expected.empty() && expected != actual)
             {
-                result.first = response;
+                std::cerr << "Checksum mismatch for " << dl->id << ": expected " << expected << ", got " << actual << std::endl;
+                code = -1;
             }
-            result.second = response_code;
+            settle(dl->promise, dl->done, code);
+            return;
         }
+        // Google did not announce the checksum: look it up, still without blocking
+        performAsync(metadata, dl->cancel, [metadata, dl, actual, code](int metadataCode)
+        {
+            Json::Value obj;
+            Json::Reader reader;
+            int result = code;
+            if (metadataCode == 200 && reader.parse(metadata->response, obj))
+            {
+                std::string expected = obj["md5Checksum"].asString();
+                if (!expected.empty() && expected != actual)
+                {
+                    std::cerr << "Checksum mismatch for " << dl->id << ": expected " << expected << ", got " << actual << std::endl;
+                    result = -1;
+                }
+            }
+            settle(dl->promise, dl->done, result);
+        });
+    });
+}
+
+/* For a download to a file, once the file's metadata is in: carries on where a
+    partial download of the same content stopped, or starts the part file afresh
+    with a sidecar describing what it is taken from. Runs on the I/O thread; the
+    partial content was hashed beforehand by the caller. */
+bool GDConnect::preparePart(AsyncDownload& dl)
+{
+    if (dl.partial > 0 && resumable(dl.id.c_str(), dl.previous, dl.remote))
+    {
+        dl.from = dl.partial;
+        std::cout << "Resuming download of " << dl.id << " at byte " << dl.from << std::endl;
     }
     else
     {
-        result.first = "Unable to start curl";
-        result.second = -1;
+        dl.digest.reset();
+        writeSidecar(dl.part, dl.id.c_str(), dl.remote);
+        if (ftruncate(dl.fd, 0) != 0)
+            return false;
     }
-    curl_slist_free_all(slist);
-    curl_easy_cleanup(curlHandle);
-    return result;
+    return lseek(dl.fd, dl.from, SEEK_SET) == dl.from;
 }
 
-std::pair<std::string, int> GDConnect::putFile(const char * filename)
+/* Asynchronous download to an explicit path, replacing anything already there.
+    As with the blocking download, the content goes to path.part, described by
+    path.part.json, and is renamed to path once complete and verified; a partial
+    download of the same content left by an earlier attempt is picked up with a
+    Range request. The partial content is hashed before this returns. */
+std::future<int> GDConnect::getFileByIdAsync(const char * id, const char * path, std::function<void(const int&)> done,
+                                             Cancellation cancel)
 {
-    std::cout << "Uploading file " << filename << std::endl;
+    std::string target = path;
+    std::string part = target + ".part";
+    int fd = open(part.c_str(), O_WRONLY | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        std::cerr << "Unable to open " << part << " for writing" << std::endl;
+        std::promise<int> failed;
+        settle(failed, done, -1);
+        return failed.get_future();
+    }
+    std::shared_ptr<std::promise<int> > promise = std::make_shared<std::promise<int> >();
+    std::shared_ptr<AsyncDownload> dl = std::make_shared<AsyncDownload>();
+    dl->id = id;
+    dl->sink = fileSink(fd);
+    dl->originalSize = -1;
+    dl->from = 0;
+    dl->skip = 0;
+    dl->rangeChecked = true;
+    dl->part = part;
+    dl->fd = fd;
+    dl->partial = 0;
+    if (readSidecar(part, dl->previous))
+        dl->partial = hashPart(part, strtoll(dl->previous["size"].asString().c_str(), NULL, 10), dl->digest);
+    dl->cancel = cancel;
+    dl->done = [fd, part, target, promise, done](const int& code)
+    {
+        int result = close(fd) == 0 ? code : -1;
+        if (result >= 200 && result < 300)
+        {
+            if (rename(part.c_str(), target.c_str()) != 0)
+            {
+                std::cerr << "Unable to move " << part << " to " << target << std::endl;
+                result = -1;
+            }
+            else
+                unlink((part + ".json").c_str());
+        }
+        else if (result != -1)
+        {
+            // the server refused the file: what was received so far is no use
+            unlink(part.c_str());
+            unlink((part + ".json").c_str());
+        }
+        settle(*promise, done, result);
+    };
+    describeAsync(dl);
+    return promise->get_future();
+}
+
+/* Asynchronous read of length bytes of a file's content from offset, with an
+    HTTP Range request; sink runs on the I/O thread. The content is passed on as
+    stored, and no checksum can be verified on a slice. Completes with 206, the
+    failing HTTP code, or -1 if the transfer failed, was cancelled, or the server
+    did not honour the range. */
+std::future<int> GDConnect::getFileRangeAsync(const char * id, curl_off_t offset, curl_off_t length, DataSink sink,
+                                              std::function<void(const int&)> done, Cancellation cancel)
+{
+    std::shared_ptr<std::promise<int> > promise = std::make_shared<std::promise<int> >();
+    std::future<int> result = promise->get_future();
+    std::shared_ptr<Exchange> ex = openGet(apiURL + "/drive/v3/files/" + id + "?alt=media", true);
+    if (!ex || length <= 0)
+    {
+        if (ex)
+            closeExchange(*ex);
+        settle(*promise, done, -1);
+        return result;
+    }
+    std::string range = "Range: bytes=" + std::to_string((long long) offset) + "-"
+                        + std::to_string((long long) (offset + length - 1));
+    ex->headers = curl_slist_append(ex->headers, range.c_str());
+    ex->operation = "range";
+    ex->priority = RequestScheduler::Bulk;
+    CURL * handle = ex->handle;
+    ex->sink = [handle, sink](const char * data, std::size_t size)
+    {
+        long code = 0;
+        curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &code);
+        return code == 206 && sink(data, size); // a whole file sent in answer would not fit the slice
+    };
+    std::string fileId = id;
+    performAsync(ex, cancel, [ex, promise, done, fileId](int code)
+    {
+        if (code != 206 && code != -1)
+            std::cerr << "Range read of " << fileId << " failed with code " << code << ": " << ex->response << std::endl;
+        settle(*promise, done, code == 206 ? code : (code >= 200 && code < 300 ? -1 : code));
+    });
+    return result;
+}
 
+/* State of an asynchronous upload, carried from one step to the next */
+struct AsyncUpload
+{
+    std::string name;       // local path
+    UploadTarget target;
+    int fd;
+    const char * data;
     struct stat fileInfo;
-    double uploadSpeed, uploadSize, totalTime;
-    FILE *fd;
     std::string id;
+    std::string uri;
+    curl_off_t committed;
+    int failures;
+    int conflicts;          // IDs found already in use
+    Md5 digest;             // of the bytes Google has accepted so far
+    curl_off_t hashed;
+    std::unique_ptr<CompressionPipeline> pipeline; // compressed uploads only
+    std::string block;      // compressed block being sent
+    curl_off_t blockStart;  // its offset in the compressed stream
+    bool lastBlock;
+    std::shared_ptr<AsyncUpload> waiting; // the upload itself, while waiting for the pipeline
+    std::chrono::steady_clock::time_point start;
+    std::promise<std::pair<std::string, int> > promise;
+    std::function<void(const std::pair<std::string, int>&)> done;
+    Cancellation cancel;
+};
+
+/* The total size announced for an upload: unknown while a compressed stream is
+    still being produced */
+static curl_off_t uploadTotal(const AsyncUpload& up)
+{
+    if (!up.pipeline)
+        return up.fileInfo.st_size;
+    return up.lastBlock ? up.blockStart + (curl_off_t) up.block.size() : -1;
+}
 
-    fd = fopen(filename, "rb"); /* open file to upload */
-    if(!fd)
+/* Asynchronous putFile, with the same choices as the blocking one: small files go
+    in a single multipart request, larger ones through a resumable session, and
+    compression applies to both. Every step (ID request, session start, chunks,
+    status queries after a failure) runs as a request on the I/O thread, and retry
+    delays do not hold up other transfers. Compressed streams are produced on the
+    pipeline's worker thread, which posts back to the I/O thread as blocks become ready.
+    A cancelled uncompressed upload keeps its session file so that it can be resumed later. */
+std::future<std::pair<std::string, int> > GDConnect::putFileAsync(const char * filename,
+        std::function<void(const std::pair<std::string, int>&)> done, Cancellation cancel)
+{
+    std::shared_ptr<AsyncUpload> up = std::make_shared<AsyncUpload>();
+    up->name = filename;
+    up->target.name = filename;
+    up->data = NULL;
+    up->committed = 0;
+    up->failures = 0;
+    up->conflicts = 0;
+    up->hashed = 0;
+    up->blockStart = 0;
+    up->lastBlock = false;
+    up->done = done;
+    up->cancel = cancel;
+    std::future<std::pair<std::string, int> > result = up->promise.get_future();
+
+    up->fd = open(filename, O_RDONLY);
+    if (up->fd < 0)
     {
-        return std::pair<std::string, int>("Unable to open file", -1); /* can't continue */
+        settle(up->promise, done, std::pair<std::string, int>("Unable to open file", -1));
+        return result;
     }
-
-    /* to get the file size */
-    if(fstat(fileno(fd), &fileInfo) != 0)
+    if (fstat(up->fd, &up->fileInfo) != 0)
     {
-        return std::pair<std::string, int>("Unable to get file stats", -1); /* can't continue */
+        close(up->fd);
+        settle(up->promise, done, std::pair<std::string, int>("Unable to get file stats", -1));
+        return result;
+    }
+    if (up->fileInfo.st_size > 0)
+    {
+        void * map = mmap(NULL, up->fileInfo.st_size, PROT_READ, MAP_PRIVATE, up->fd, 0);
+        if (map == MAP_FAILED)
+        {
+            close(up->fd);
+            settle(up->promise, done, std::pair<std::string, int>("Unable to map file", -1));
+            return result;
+        }
+        madvise(map, up->fileInfo.st_size, MADV_SEQUENTIAL);
+        up->data = static_cast<const char *>(map);
     }
 
-    std::cout << "Requesting Google Drive ID for new file." << std::endl;
-    std::pair<std::string, int> idRequest;
-    idRequest = get("https://www.googleapis.com/drive/v3/files/generateIds", "?count=1&space=drive", true);
-
-    Json::Value obj;
-    Json::Reader reader;
+    up->start = std::chrono::steady_clock::now();
+    if (up->fileInfo.st_size < multipartThreshold)
+    {
+        uploadMultipartAsync(up);
+        return result;
+    }
+    if (compressionLevel > 0)
+    {
+        tagCompressed(up->target, up->data, up->fileInfo.st_size);
+        std::weak_ptr<AsyncUpload> weak = up;
+        up->pipeline.reset(new CompressionPipeline(up->data, up->fileInfo.st_size, compressionLevel, uploadChunkSize, 2,
+                                                   [this, weak]()
+        {
+            asyncEngine()->post([this, weak]()
+            {
+                std::shared_ptr<AsyncUpload> up = weak.lock();
+                if (up && up->waiting)
+                {
+                    up->waiting.reset();
+                    nextBlockAsync(up);
+                }
+            });
+        }));
+        startUploadAsync(up); // the stream is only known in full at the end: no session to resume by
+        return result;
+    }
+    if (!loadUploadSession(filename, up->fileInfo, up->uri, up->id))
+        queryUploadAsync(up, true); // ask Google how much of the previous attempt it kept
+    else
+        startUploadAsync(up);
+    return result;
+}
 
-    if (reader.parse(idRequest.first, obj)) {
-        id = obj["ids"][0].asString();
+/* Sends a small file in one multipart request */
+void GDConnect::uploadMultipartAsync(std::shared_ptr<AsyncUpload> up)
+{
+    std::shared_ptr<Exchange> ex = std::make_shared<Exchange>();
+    std::string sent;
+    std::string error;
+    if (!prepareMultipart(*ex, up->target, up->data, up->fileInfo.st_size, sent, error))
+    {
+        closeExchange(*ex);
+        finishUploadAsync(up, error, -1);
+        return;
     }
+    performAsync(ex, up->cancel, [this, ex, up, sent](int code)
+    {
+        std::pair<std::string, int> result = multipartResult(up->name, *ex, code, sent, NULL);
+        if (up->data)
+            munmap(const_cast<char *>(up->data), up->fileInfo.st_size);
+        close(up->fd);
+        if (result.second == 0)
+            metrics->span("putFileAsync", up->name, up->start, std::chrono::steady_clock::now());
+        settle(up->promise, up->done, result);
+    });
+}
 
-    // std::cout << "File id will be " << id << std::endl;
-    std::cout << "Initiating upload" << std::endl;
+/* Takes an ID from the pool, or requests one, then opens a new resumable session for it */
+void GDConnect::startUploadAsync(std::shared_ptr<AsyncUpload> up)
+{
+    if (ids && ids->tryTake(up->id))
+    {
+        openSessionAsync(up);
+        return;
+    }
+    std::shared_ptr<Exchange> ex = openGet(apiURL + "/drive/v3/files/generateIds?count=1&space=drive", true);
+    if (!ex)
+    {
+        finishUploadAsync(up, "Unable to start curl", -1);
+        return;
+    }
+    performAsync(ex, up->cancel, [this, ex, up](int code)
+    {
+        Json::Value obj;
+        Json::Reader reader;
+        if (code != 200 || !reader.parse(ex->response, obj))
+        {
+            finishUploadAsync(up, ex->response, code);
+            return;
+        }
+        up->id = obj["ids"][0].asString();
+        openSessionAsync(up);
+    });
+}
 
-    std::pair<std::string, int> initResponse;
-    initResponse = initUpload(filename, id.c_str(), reinterpret_cast<long>(fileInfo.st_size));
+/* Opens a new resumable session for the ID the upload was given */
+void GDConnect::openSessionAsync(std::shared_ptr<AsyncUpload> up)
+{
+    std::shared_ptr<Exchange> init = std::make_shared<Exchange>();
+    if (!prepareInitUpload(*init, up->target, up->id, (long) uploadTotal(*up)))
+    {
+        finishUploadAsync(up, "Unable to start curl", -1);
+        return;
+    }
+    performAsync(init, up->cancel, [this, init, up](int code)
+    {
+        const int maxConflicts = 3;
+        if (code == 409 && up->target.fileId.empty() && ++up->conflicts <= maxConflicts)
+        {
+            // the ID was used already, by an earlier run that did not record it: drop it
+            std::cerr << "File ID " << up->id << " is already in use, trying another" << std::endl;
+            startUploadAsync(up);
+            return;
+        }
+        if (code != 200)
+        {
+            finishUploadAsync(up, init->response, code);
+            return;
+        }
+        up->uri = headerValue(init->header, "Location");
+        up->committed = 0;
+        if (up->pipeline)
+        {
+            nextBlockAsync(up);
+            return;
+        }
+        saveUploadSession(up->name.c_str(), up->fileInfo, up->uri, up->id);
+        sendChunkAsync(up);
+    });
+}
 
-    // std::cout << "Upload URI is " << std::endl << initResponse.first << std::endl;
+/* Moves a compressed upload on to the pipeline's next block, or waits for it
+    to be posted back if the worker is not done with it yet */
+void GDConnect::nextBlockAsync(std::shared_ptr<AsyncUpload> up)
+{
+    std::string block;
+    bool last = false;
+    int ready = up->pipeline->poll(block, last);
+    if (ready == 0)
+    {
+        up->waiting = up;
+        return;
+    }
+    if (ready < 0)
+    {
+        finishUploadAsync(up, "Compression failed", -1);
+        return;
+    }
+    up->blockStart += up->block.size();
+    up->block.swap(block);
+    up->lastBlock = last;
+    sendChunkAsync(up);
+}
 
-    if (initResponse.second != 200)
+/* Carries on from the offset Google reported: the rest of the current data,
+    or for a compressed upload whose block is all stored, the next block */
+void GDConnect::continueUploadAsync(std::shared_ptr<AsyncUpload> up)
+{
+    if (!up->pipeline)
     {
-        std::cerr << "Something went wrong!" << std::endl
-                  << "Request for upload URI should return 200 OK and location" << std::endl;
-        std::cerr << "Response code was: " << initResponse.second << std::endl
-                  << "and response was: " << initResponse.first << std::endl;
-        return std::pair<std::string, int>(initResponse.first, initResponse.second); /* can't continue */;
+        hashCommitted(up->digest, up->data, up->hashed, up->committed);
+        sendChunkAsync(up);
     }
+    else if (!up->lastBlock && up->committed >= up->blockStart + (curl_off_t) up->block.size())
+    {
+        up->digest.update(up->block.data(), up->block.size());
+        nextBlockAsync(up);
+    }
+    else
+        sendChunkAsync(up);
+}
 
-    CURL * curlHandle;
-    CURLcode res;
-    std::string url = initResponse.first;
-    std::string uploadResponse;
-    long uploadResponseCode;
-    curlHandle = curl_easy_init();
-    if(curlHandle)
+/* Sends the next chunk from the committed offset, out of the mapped file or
+    the current compressed block */
+void GDConnect::sendChunkAsync(std::shared_ptr<AsyncUpload> up)
+{
+    const char * window = up->pipeline ? up->block.data() : up->data;
+    curl_off_t windowStart = up->pipeline ? up->blockStart : 0;
+    curl_off_t windowEnd = up->pipeline ? up->blockStart + (curl_off_t) up->block.size() : up->fileInfo.st_size;
+    if (up->committed < windowStart)
     {
-        /* upload to this place */
-        curl_easy_setopt(curlHandle, CURLOPT_URL, url.c_str());
-        /* tell it to "upload" to the URL */
-        curl_easy_setopt(curlHandle, CURLOPT_UPLOAD, 1L);
-        /* set where to read from (on Windows you need to use READFUNCTION too) */
-        curl_easy_setopt(curlHandle, CURLOPT_READDATA, fd);
-        /* and give the size of the upload (optional) */
-        curl_easy_setopt(curlHandle, CURLOPT_INFILESIZE_LARGE, (curl_off_t)fileInfo.st_size);
-        curl_easy_setopt(curlHandle, CURLOPT_WRITEFUNCTION, callback);
-        curl_easy_setopt(curlHandle, CURLOPT_WRITEDATA, &uploadResponse);
-        /* enable verbose for easier tracing */
-        // curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
-        res = curl_easy_perform(curlHandle);
-        /* Check for errors */
-        if(res != CURLE_OK)
-        {
-            fprintf(stderr, "curl_easy_perform() failed: %s\n",
-                    curl_easy_strerror(res));
-            return std::pair<std::string, int>("curl_easy_perform() failed", -1); /* can't continue */;
+        finishUploadAsync(up, "Data from an earlier chunk was lost and is no longer available", -1);
+        return;
+    }
+    curl_off_t length = std::min(uploadChunkSize, windowEnd - up->committed);
+    std::shared_ptr<Exchange> ex = std::make_shared<Exchange>();
+    if (!prepareUploadChunk(*ex, up->uri, length > 0 ? window + (up->committed - windowStart) : NULL, up->committed,
+                            length, uploadTotal(*up)))
+    {
+        finishUploadAsync(up, "Unable to start curl", -1);
+        return;
+    }
+    performAsync(ex, up->cancel, [this, ex, up](int code)
+    {
+        if (code == 308 && committedBytes(*ex) > up->committed)
+        {
+            up->failures = 0;
+            up->committed = committedBytes(*ex);
+            continueUploadAsync(up);
         }
+        else if (code == 308)
+            retryUploadAsync(up, "Upload made no progress", -1); // Google kept none of the chunk
+        else if (code == 200 || code == 201)
+            finishUploadAsync(up, ex->response, code);
         else
+            retryUploadAsync(up, ex->response, code);
+    });
+}
+
+/* Asks how far the session got, then carries on from there.
+    When resuming a recorded session, an unknown session means starting over. */
+void GDConnect::queryUploadAsync(std::shared_ptr<AsyncUpload> up, bool resuming)
+{
+    std::shared_ptr<Exchange> ex = std::make_shared<Exchange>();
+    if (!prepareUploadChunk(*ex, up->uri, NULL, 0, 0, uploadTotal(*up)))
+    {
+        finishUploadAsync(up, "Unable to start curl", -1);
+        return;
+    }
+    performAsync(ex, up->cancel, [this, ex, up, resuming](int code)
+    {
+        if (code == 308)
+        {
+            up->committed = committedBytes(*ex);
+            if (resuming)
+                std::cout << "Resuming upload at byte " << up->committed << std::endl;
+            continueUploadAsync(up);
+        }
+        else if (code == 200 || code == 201)
+            finishUploadAsync(up, ex->response, code);
+        else if (resuming && code != -1)
         {
-            /* now extract transfer info */
-            curl_easy_getinfo(curlHandle, CURLINFO_SPEED_UPLOAD, &uploadSpeed);
-            curl_easy_getinfo(curlHandle, CURLINFO_SIZE_UPLOAD, &uploadSize);
-            curl_easy_getinfo(curlHandle, CURLINFO_TOTAL_TIME, &totalTime);
-            curl_easy_getinfo(curlHandle, CURLINFO_RESPONSE_CODE, &uploadResponseCode);
-            fprintf(stderr, "Size: %.3f Speed: %.3f bytes/sec during %.3f seconds\n",
-                    uploadSize, uploadSpeed, totalTime);
+            up->uri.clear(); // session expired or unknown: start over
+            startUploadAsync(up);
         }
-        /* always cleanup */
-        curl_easy_cleanup(curlHandle);
+        else
+            retryUploadAsync(up, ex->response, code);
+    });
+}
+
+/* Connection dropped, server error or a chunk Google kept none of: waits, without
+    blocking the I/O thread, then finds out what Google kept. Anything else is final. */
+void GDConnect::retryUploadAsync(std::shared_ptr<AsyncUpload> up, const std::string& response, int code)
+{
+    const int maxRetries = 5;
+    bool cancelled = (up->cancel && up->cancel->cancelled()) || asyncEngine()->stopping();
+    if (cancelled || (code != -1 && code < 500) || ++up->failures > maxRetries)
+    {
+        finishUploadAsync(up, response, code);
+        return;
+    }
+    asyncEngine()->after(std::chrono::milliseconds(scheduler->backoff(up->failures)),
+                         [this, up]() { queryUploadAsync(up, false); });
+}
+
+void GDConnect::finishUploadAsync(std::shared_ptr<AsyncUpload> up, const std::string& response, int code)
+{
+    curl_off_t total = up->fileInfo.st_size;
+    if (code == 200 || code == 201)
+    {
+        if (up->pipeline)
+            up->digest.update(up->block.data(), up->block.size());
+        else
+            hashCommitted(up->digest, up->data, up->hashed, total);
+        if (!uploadMatches(up->name.c_str(), response, up->digest.hexDigest()))
+            code = -1;
+    }
+    up->pipeline.reset(); // it reads the mapped file
+    if (up->data)
+        munmap(const_cast<char *>(up->data), total);
+    close(up->fd);
+    if (code != 200 && code != 201)
+    {
+        std::cerr << "Upload of " << up->name << " failed at byte " << up->committed << " of " << total << std::endl;
+        std::cerr << "Response code was: " << code << std::endl
+                  << "and response was: " << response << std::endl;
+        if (code == 404 || code == 410)
+            remove(sessionFilename(up->name.c_str()).c_str()); // session is gone for good
+        settle(up->promise, up->done, std::pair<std::string, int>(response, code));
+        return;
     }
-    return std::pair<std::string, int>(id, 0); /* can't continue */;
+    remove(sessionFilename(up->name.c_str()).c_str());
+    metrics->span("putFileAsync", up->name, up->start, std::chrono::steady_clock::now());
+    settle(up->promise, up->done, std::pair<std::string, int>(up->id, 0));
 }
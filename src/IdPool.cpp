@@ -0,0 +1,204 @@
+/*
+ * IdPool.cc
+ *
+ *  Prefetched Drive file IDs
+ *  IDs are requested a batch at a time and handed out from memory; the
+ *  stock is persisted through a temporary file like the metadata index.
+ *  The pool file is locked with flock() on a companion .lock file.
+ */
+
+#include "IdPool.h"
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <json/json.h>
+
+/* The pool starts from what poolFilename holds, if anything, unless another
+    process already uses that file. Below lowWater IDs, batchSize more (at most
+    maxBatch) are fetched in the background. */
+IdPool::IdPool(GDConnect * drive, const char * poolFilename, std::size_t lowWater, std::size_t batchSize)
+    : drive(drive), poolFilename(poolFilename), lowWater(lowWater),
+      batchSize(batchSize < 1 ? 1 : batchSize > maxBatch ? maxBatch : batchSize), reserved(0), refilling(false),
+      stop(false)
+{
+    std::string lockFilename = this->poolFilename + ".lock";
+    lockFd = open(lockFilename.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (lockFd >= 0 && flock(lockFd, LOCK_EX | LOCK_NB) != 0)
+    {
+        close(lockFd);
+        lockFd = -1;
+    }
+    if (lockFd < 0)
+        std::cerr << poolFilename << " is in use by another process, IDs are kept in memory only" << std::endl;
+    else
+        load();
+    worker = std::thread(&IdPool::run, this);
+}
+
+/* Unused IDs are written back for the next run */
+IdPool::~IdPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stop = true;
+    }
+    changed.notify_all();
+    worker.join();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        reserved = 0; // none of them will be handed out now
+    }
+    save();
+    if (lockFd >= 0)
+        close(lockFd);
+}
+
+/* Function for reading the stock of IDs from disk */
+int IdPool::load()
+{
+    Json::Value root;
+    Json::Reader reader;
+    std::ifstream poolFile(poolFilename.c_str());
+    if (!poolFile.is_open())
+        return -1;
+    if (!reader.parse(poolFile, root))
+    {
+        std::cerr << "Could not parse " << poolFilename << std::endl;
+        return -1;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    const Json::Value& entries = root["ids"];
+    for (unsigned int i = 0; i < entries.size(); i++)
+        ids.push_back(entries[i].asString());
+    return 0;
+}
+
+/* Function for writing the stock of IDs to disk, through a temporary file */
+int IdPool::save()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return store();
+}
+
+/* Writes the IDs not reserved for handing out to the pool file.
+    Must be called with the lock held, so that writes never overtake each other. */
+int IdPool::store()
+{
+    if (lockFd < 0)
+        return 0;
+    Json::Value root;
+    root["ids"] = Json::Value(Json::arrayValue);
+    for (std::size_t i = 0; i + reserved < ids.size(); i++)
+        root["ids"].append(ids[i]);
+    Json::FastWriter writer;
+    std::string tmpFilename = poolFilename + ".tmp";
+    std::ofstream poolFile(tmpFilename.c_str(), std::ofstream::trunc);
+    if (!poolFile.is_open())
+    {
+        std::cerr << "Error writing ID pool file!" << std::endl;
+        return -1;
+    }
+    poolFile << writer.write(root);
+    poolFile.close();
+    if (!poolFile || rename(tmpFilename.c_str(), poolFilename.c_str()) != 0)
+    {
+        std::cerr << "Error writing ID pool file!" << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+/* Fetches one batch of IDs with the lock released for the request.
+    Must be called with the lock held and refilling set by the caller. */
+bool IdPool::fetch(std::unique_lock<std::mutex>& guard)
+{
+    guard.unlock();
+    std::vector<std::string> fresh = drive->generateIds(batchSize);
+    guard.lock();
+    ids.insert(ids.begin(), fresh.begin(), fresh.end()); // hand out the oldest IDs first
+    refilling = false;
+    changed.notify_all();
+    return !fresh.empty();
+}
+
+/* Hands out an ID, fetching a batch on the spot only if the pool ran dry.
+    Returns an empty string if no ID could be obtained. */
+std::string IdPool::take()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while (ids.empty())
+    {
+        if (refilling)
+            changed.wait(guard);    // a fetch is already on its way
+        else
+        {
+            refilling = true;
+            if (!fetch(guard) && ids.empty())
+                return std::string();
+        }
+    }
+    std::string id = hand();
+    if (ids.size() < lowWater)
+        changed.notify_all();   // wake the worker
+    return id;
+}
+
+/* Removes the next ID from the pool. Before it goes, it leaves the pool file
+    together with the next few, so that a crash never leaves a used ID on disk.
+    Must be called with the lock held and the pool not empty. */
+std::string IdPool::hand()
+{
+    if (reserved == 0)
+    {
+        reserved = ids.size() < reserveBatch ? ids.size() : reserveBatch;
+        store();
+    }
+    std::string id = ids.back();
+    ids.pop_back();
+    reserved--;
+    return id;
+}
+
+/* Hands out an ID if one is in stock, without ever waiting for the network */
+bool IdPool::tryTake(std::string& id)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (ids.empty())
+    {
+        changed.notify_all();
+        return false;
+    }
+    id = hand();
+    if (ids.size() < lowWater)
+        changed.notify_all();
+    return true;
+}
+
+std::size_t IdPool::size()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return ids.size();
+}
+
+/* Worker: tops the pool up whenever it falls below the low-water mark.
+    After a failed fetch it waits for the next take rather than retrying at once. */
+void IdPool::run()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while (!stop)
+    {
+        if (ids.size() >= lowWater || refilling)
+        {
+            changed.wait(guard);
+            continue;
+        }
+        refilling = true;
+        if (fetch(guard) && !stop)
+            store();
+        else if (!stop)
+            changed.wait(guard);
+    }
+}
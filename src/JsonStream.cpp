@@ -0,0 +1,517 @@
+/*
+ * JsonStream.cc
+ *
+ *  Incremental JSON parser
+ *  A byte-at-a-time state machine, except that the plain runs of strings are
+ *  copied in one go. Numbers and literals end on the first byte that cannot
+ *  belong to them, which is then read again in the state that follows.
+ */
+
+#include "JsonStream.h"
+#include <cstdlib>
+
+static const std::size_t maxDepth = 1000;
+
+JsonStream::JsonStream()
+{
+    reset();
+}
+
+/* Forgets everything read so far, to parse a new document */
+void JsonStream::reset()
+{
+    state = ExpectValue;
+    stack.clear();
+    token.clear();
+    tokenIsKey = false;
+    escape = 0;
+    codePoint = 0;
+    highSurrogate = 0;
+    error = false;
+}
+
+/* Parses the next bytes of the document; false once it is known to be invalid */
+bool JsonStream::feed(const char * data, std::size_t length)
+{
+    const char * p = data;
+    const char * end = data + length;
+    while (p < end && !error)
+    {
+        if (state == InString && !escape)
+        {
+            const char * run = p;
+            while (p < end && *p != '"' && *p != '\\' && (unsigned char) *p >= 0x20)
+                p++;
+            if (p > run)
+            {
+                flushSurrogate();
+                token.append(run, p - run);
+            }
+            if (p == end)
+                break;
+        }
+        if (!step(*p++))
+            error = true;
+    }
+    return !error;
+}
+
+/* Ends the document; true if it held exactly one complete value */
+bool JsonStream::finish()
+{
+    if (!error && stack.empty() && state == InNumber)
+        error = !endNumber();
+    else if (!error && stack.empty() && state == InLiteral)
+        error = !endLiteral();
+    return !error && state == Complete;
+}
+
+bool JsonStream::step(char c)
+{
+    switch (state)
+    {
+    case InString:
+        if (escape == 1)
+        {
+            escape = 0;
+            if (c == 'u')
+            {
+                escape = 2;
+                codePoint = 0;
+                return true;
+            }
+            flushSurrogate();
+            switch (c)
+            {
+            case '"': case '\\': case '/': token += c; return true;
+            case 'b': token += '\b'; return true;
+            case 'f': token += '\f'; return true;
+            case 'n': token += '\n'; return true;
+            case 'r': token += '\r'; return true;
+            case 't': token += '\t'; return true;
+            default: return false;
+            }
+        }
+        if (escape >= 2)
+        {
+            int digit;
+            if (c >= '0' && c <= '9')
+                digit = c - '0';
+            else if (c >= 'a' && c <= 'f')
+                digit = c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F')
+                digit = c - 'A' + 10;
+            else
+                return false;
+            codePoint = codePoint * 16 + digit;
+            if (++escape < 6)
+                return true;
+            escape = 0;
+            if (codePoint >= 0xD800 && codePoint <= 0xDBFF)
+            {
+                flushSurrogate();
+                highSurrogate = codePoint;
+            }
+            else if (codePoint >= 0xDC00 && codePoint <= 0xDFFF)
+            {
+                appendUtf8(highSurrogate ? 0x10000 + ((highSurrogate - 0xD800) << 10) + (codePoint - 0xDC00) : 0xFFFD);
+                highSurrogate = 0;
+            }
+            else
+            {
+                flushSurrogate();
+                appendUtf8(codePoint);
+            }
+            return true;
+        }
+        if (c == '\\')
+        {
+            escape = 1;
+            return true;
+        }
+        if (c == '"')
+            return endString();
+        return false; // control characters must be escaped
+    case InNumber:
+        if ((c >= '0' && c <= '9') || c == '.' || c == 'e' || c == 'E' || c == '+' || c == '-')
+        {
+            token += c;
+            return true;
+        }
+        return endNumber() && step(c);
+    case InLiteral:
+        if (c >= 'a' && c <= 'z')
+        {
+            token += c;
+            return token.size() <= 5;
+        }
+        return endLiteral() && step(c);
+    default:
+        break;
+    }
+
+    if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+        return true;
+    switch (state)
+    {
+    case ExpectValueOrEnd:
+        if (c == ']')
+        {
+            endArray();
+            stack.pop_back();
+            valueDone();
+            return true;
+        }
+        return startValue(c);
+    case ExpectValue:
+        return startValue(c);
+    case ExpectKeyOrEnd:
+        if (c == '}')
+        {
+            endObject();
+            stack.pop_back();
+            valueDone();
+            return true;
+        }
+        // fall through
+    case ExpectKey:
+        if (c != '"')
+            return false;
+        state = InString;
+        tokenIsKey = true;
+        token.clear();
+        return true;
+    case ExpectColon:
+        if (c != ':')
+            return false;
+        state = ExpectValue;
+        return true;
+    case ExpectCommaOrEnd:
+        if (c == ',')
+        {
+            state = stack.back() == '{' ? ExpectKey : ExpectValue;
+            return true;
+        }
+        if (c == (stack.back() == '{' ? '}' : ']'))
+        {
+            if (stack.back() == '{')
+                endObject();
+            else
+                endArray();
+            stack.pop_back();
+            valueDone();
+            return true;
+        }
+        return false;
+    default:
+        return false; // anything but whitespace after the document
+    }
+}
+
+bool JsonStream::startValue(char c)
+{
+    if (c == '{' || c == '[')
+    {
+        if (stack.size() >= maxDepth)
+            return false;
+        stack.push_back(c);
+        if (c == '{')
+        {
+            startObject();
+            state = ExpectKeyOrEnd;
+        }
+        else
+        {
+            startArray();
+            state = ExpectValueOrEnd;
+        }
+        return true;
+    }
+    token.assign(1, c);
+    if (c == '"')
+    {
+        token.clear();
+        tokenIsKey = false;
+        state = InString;
+    }
+    else if (c == '-' || (c >= '0' && c <= '9'))
+        state = InNumber;
+    else if (c == 't' || c == 'f' || c == 'n')
+        state = InLiteral;
+    else
+        return false;
+    return true;
+}
+
+void JsonStream::valueDone()
+{
+    state = stack.empty() ? Complete : ExpectCommaOrEnd;
+}
+
+bool JsonStream::endString()
+{
+    flushSurrogate();
+    if (tokenIsKey)
+    {
+        key(token);
+        state = ExpectColon;
+    }
+    else
+    {
+        scalar(String, token);
+        valueDone();
+    }
+    return true;
+}
+
+bool JsonStream::endNumber()
+{
+    char * end;
+    const char * start = token.c_str();
+    strtod(start, &end);
+    if (end != start + token.size() || token == "-" || (token[0] == '-' ? token[1] : token[0]) == '.')
+        return false;
+    scalar(Number, token);
+    valueDone();
+    return true;
+}
+
+bool JsonStream::endLiteral()
+{
+    if (token == "true")
+        scalar(True, token);
+    else if (token == "false")
+        scalar(False, token);
+    else if (token == "null")
+        scalar(Null, token);
+    else
+        return false;
+    valueDone();
+    return true;
+}
+
+/* A high surrogate not followed by a low one stands for nothing valid */
+void JsonStream::flushSurrogate()
+{
+    if (highSurrogate)
+        appendUtf8(0xFFFD);
+    highSurrogate = 0;
+}
+
+void JsonStream::appendUtf8(unsigned int cp)
+{
+    if (cp < 0x80)
+        token += (char) cp;
+    else if (cp < 0x800)
+    {
+        token += (char) (0xC0 | (cp >> 6));
+        token += (char) (0x80 | (cp & 0x3F));
+    }
+    else if (cp < 0x10000)
+    {
+        token += (char) (0xE0 | (cp >> 12));
+        token += (char) (0x80 | ((cp >> 6) & 0x3F));
+        token += (char) (0x80 | (cp & 0x3F));
+    }
+    else
+    {
+        token += (char) (0xF0 | (cp >> 18));
+        token += (char) (0x80 | ((cp >> 12) & 0x3F));
+        token += (char) (0x80 | ((cp >> 6) & 0x3F));
+        token += (char) (0x80 | (cp & 0x3F));
+    }
+}
+
+/* Stores a scalar member of a Drive file resource in the FileInfo field of that name, if any */
+static void setFileField(FileInfo& file, const std::string& key, const std::string& text)
+{
+    if (key == "id")
+        file.id = text;
+    else if (key == "name")
+        file.name = text;
+    else if (key == "mimeType")
+        file.mimeType = text;
+    else if (key == "md5Checksum")
+        file.md5Checksum = text;
+    else if (key == "modifiedTime")
+        file.modifiedTime = text;
+    else if (key == "size")
+        file.size = strtoll(text.c_str(), NULL, 10); // sent as a string
+}
+
+ListingParser::ListingParser() : inFiles(false), inFile(false), inParents(false), inProperties(false)
+{
+}
+
+/* Empties the parser for the next page */
+void ListingParser::clear()
+{
+    reset();
+    files.clear();
+    nextPageToken.clear();
+    topKey.clear();
+    fileKey.clear();
+    propertyKey.clear();
+    inFiles = inFile = inParents = inProperties = false;
+}
+
+void ListingParser::startObject()
+{
+    if (depth() == 3 && inFiles)
+    {
+        inFile = true;
+        fileKey.clear();
+        files.push_back(FileInfo());
+        files.back().size = 0; // absent for folders and Google Docs
+    }
+    else if (depth() == 4 && inFile && fileKey == "appProperties")
+        inProperties = true;
+}
+
+void ListingParser::endObject()
+{
+    if (depth() == 3)
+        inFile = false;
+    else if (depth() == 4)
+        inProperties = false;
+}
+
+void ListingParser::startArray()
+{
+    if (depth() == 2 && topKey == "files")
+        inFiles = true;
+    else if (depth() == 4 && inFile && fileKey == "parents")
+        inParents = true;
+}
+
+void ListingParser::endArray()
+{
+    if (depth() == 2)
+        inFiles = false;
+    else if (depth() == 4)
+        inParents = false;
+}
+
+void ListingParser::key(const std::string& name)
+{
+    if (depth() == 1)
+        topKey = name;
+    else if (depth() == 3 && inFile)
+        fileKey = name;
+    else if (depth() == 4 && inProperties)
+        propertyKey = name;
+}
+
+void ListingParser::scalar(Scalar type, const std::string& text)
+{
+    if (depth() == 1 && topKey == "nextPageToken")
+        nextPageToken = text;
+    else if (depth() == 3 && inFile)
+        setFileField(files.back(), fileKey, text);
+    else if (depth() == 4 && inParents && type == String)
+        files.back().parents.push_back(text);
+    else if (depth() == 4 && inProperties && type == String)
+        files.back().appProperties[propertyKey] = text;
+}
+
+ChangesParser::ChangesParser()
+    : inChanges(false), inChange(false), inFile(false), inParents(false), inProperties(false)
+{
+}
+
+/* Empties the parser for the next page */
+void ChangesParser::clear()
+{
+    reset();
+    changes.clear();
+    nextPageToken.clear();
+    newStartPageToken.clear();
+    topKey.clear();
+    changeKey.clear();
+    fileKey.clear();
+    propertyKey.clear();
+    inChanges = inChange = inFile = inParents = inProperties = false;
+}
+
+void ChangesParser::startObject()
+{
+    if (depth() == 3 && inChanges)
+    {
+        inChange = true;
+        changeKey.clear();
+        changes.push_back(FileChange());
+        changes.back().removed = false;
+        changes.back().file.size = 0;
+    }
+    else if (depth() == 4 && inChange && changeKey == "file")
+    {
+        inFile = true;
+        fileKey.clear();
+    }
+    else if (depth() == 5 && inFile && fileKey == "appProperties")
+        inProperties = true;
+}
+
+void ChangesParser::endObject()
+{
+    if (depth() == 3)
+        inChange = false;
+    else if (depth() == 4)
+        inFile = false;
+    else if (depth() == 5)
+        inProperties = false;
+}
+
+void ChangesParser::startArray()
+{
+    if (depth() == 2 && topKey == "changes")
+        inChanges = true;
+    else if (depth() == 5 && inFile && fileKey == "parents")
+        inParents = true;
+}
+
+void ChangesParser::endArray()
+{
+    if (depth() == 2)
+        inChanges = false;
+    else if (depth() == 5)
+        inParents = false;
+}
+
+void ChangesParser::key(const std::string& name)
+{
+    if (depth() == 1)
+        topKey = name;
+    else if (depth() == 3 && inChange)
+        changeKey = name;
+    else if (depth() == 4 && inFile)
+        fileKey = name;
+    else if (depth() == 5 && inProperties)
+        propertyKey = name;
+}
+
+void ChangesParser::scalar(Scalar type, const std::string& text)
+{
+    if (depth() == 1 && topKey == "nextPageToken")
+        nextPageToken = text;
+    else if (depth() == 1 && topKey == "newStartPageToken")
+        newStartPageToken = text;
+    else if (depth() == 3 && inChange)
+    {
+        if (changeKey == "fileId")
+            changes.back().fileId = text;
+        else if (changeKey == "removed")
+            changes.back().removed = changes.back().removed || type == True;
+    }
+    else if (depth() == 4 && inFile)
+    {
+        if (fileKey == "trashed")
+            changes.back().removed = changes.back().removed || type == True;
+        else
+            setFileField(changes.back().file, fileKey, text);
+    }
+    else if (depth() == 5 && inParents && type == String)
+        changes.back().file.parents.push_back(text);
+    else if (depth() == 5 && inProperties && type == String)
+        changes.back().file.appProperties[propertyKey] = text;
+}
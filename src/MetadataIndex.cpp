@@ -0,0 +1,309 @@
+/*
+ * MetadataIndex.cc
+ *
+ *  Local metadata index for Google Drive
+ *  Keeps name -> ids, id -> metadata and the parent hierarchy in memory,
+ *  persisted to disk together with the changes feed position.
+ */
+
+#include "MetadataIndex.h"
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <json/json.h>
+
+static Json::Value toJson(const FileInfo& file)
+{
+    Json::Value obj;
+    obj["id"] = file.id;
+    obj["name"] = file.name;
+    obj["mimeType"] = file.mimeType;
+    obj["md5Checksum"] = file.md5Checksum;
+    obj["modifiedTime"] = file.modifiedTime;
+    obj["size"] = std::to_string(file.size);
+    obj["parents"] = Json::Value(Json::arrayValue);
+    for (std::size_t i = 0; i < file.parents.size(); i++)
+        obj["parents"].append(file.parents[i]);
+    for (std::map<std::string, std::string>::const_iterator it = file.appProperties.begin();
+            it != file.appProperties.end(); ++it)
+        obj["appProperties"][it->first] = it->second;
+    return obj;
+}
+
+static FileInfo fromJson(const Json::Value& obj)
+{
+    FileInfo file;
+    file.id = obj["id"].asString();
+    file.name = obj["name"].asString();
+    file.mimeType = obj["mimeType"].asString();
+    file.md5Checksum = obj["md5Checksum"].asString();
+    file.modifiedTime = obj["modifiedTime"].asString();
+    file.size = strtoll(obj["size"].asString().c_str(), NULL, 10);
+    const Json::Value& parents = obj["parents"];
+    for (unsigned int i = 0; i < parents.size(); i++)
+        file.parents.push_back(parents[i].asString());
+    const Json::Value& tags = obj["appProperties"];
+    std::vector<std::string> keys = tags.getMemberNames();
+    for (std::size_t i = 0; i < keys.size(); i++)
+        file.appProperties[keys[i]] = tags[keys[i]].asString();
+    return file;
+}
+
+/* Removes one value from a multimap bucket */
+static void eraseValue(std::unordered_multimap<std::string, std::string>& map, const std::string& key, const std::string& value)
+{
+    std::pair<std::unordered_multimap<std::string, std::string>::iterator,
+        std::unordered_multimap<std::string, std::string>::iterator> range = map.equal_range(key);
+    for (std::unordered_multimap<std::string, std::string>::iterator it = range.first; it != range.second; ++it)
+    {
+        if (it->second == value)
+        {
+            map.erase(it);
+            return;
+        }
+    }
+}
+
+/* The index is loaded from indexFilename if present.
+    maxStaleness is how many seconds may pass between syncs with the changes feed
+    before a lookup refreshes the index first. */
+MetadataIndex::MetadataIndex(GDConnect * drive, const char * indexFilename, int maxStaleness)
+    : drive(drive), indexFilename(indexFilename), lastSync(0), lastAttempt(0), maxStaleness(maxStaleness)
+{
+    load();
+}
+
+MetadataIndex::~MetadataIndex()
+{
+}
+
+/* Must be called with dataLock held */
+void MetadataIndex::insert(const FileInfo& file)
+{
+    erase(file.id);
+    files[file.id] = file;
+    names.insert(std::make_pair(file.name, file.id));
+    for (std::size_t i = 0; i < file.parents.size(); i++)
+        children.insert(std::make_pair(file.parents[i], file.id));
+}
+
+/* Must be called with dataLock held */
+void MetadataIndex::erase(const std::string& id)
+{
+    std::unordered_map<std::string, FileInfo>::iterator it = files.find(id);
+    if (it == files.end())
+        return;
+    eraseValue(names, it->second.name, id);
+    for (std::size_t i = 0; i < it->second.parents.size(); i++)
+        eraseValue(children, it->second.parents[i], id);
+    files.erase(it);
+}
+
+/* Must be called with dataLock held */
+void MetadataIndex::clear()
+{
+    files.clear();
+    names.clear();
+    children.clear();
+}
+
+/* Function for reading the index from disk */
+int MetadataIndex::load()
+{
+    Json::Value root;
+    Json::Reader reader;
+    std::ifstream indexFile(indexFilename.c_str());
+    if (!indexFile.is_open())
+        return -1;
+    if (!reader.parse(indexFile, root))
+    {
+        std::cerr << "Could not parse " << indexFilename << std::endl;
+        return -1;
+    }
+    std::lock_guard<std::mutex> guard(dataLock);
+    clear();
+    const Json::Value& entries = root["files"];
+    for (unsigned int i = 0; i < entries.size(); i++)
+        insert(fromJson(entries[i]));
+    pageToken = root["pageToken"].asString();
+    lastSync = (std::time_t) atol(root["lastSync"].asString().c_str());
+    return 0;
+}
+
+/* Function for writing the index to disk, through a temporary file so a crash
+    never leaves a truncated index behind */
+int MetadataIndex::save()
+{
+    Json::Value root;
+    {
+        std::lock_guard<std::mutex> guard(dataLock);
+        root["pageToken"] = pageToken;
+        root["lastSync"] = std::to_string((long long) lastSync);
+        root["files"] = Json::Value(Json::arrayValue);
+        for (std::unordered_map<std::string, FileInfo>::iterator it = files.begin(); it != files.end(); ++it)
+            root["files"].append(toJson(it->second));
+    }
+    Json::FastWriter writer;
+    std::string tmpFilename = indexFilename + ".tmp";
+    std::ofstream indexFile(tmpFilename.c_str(), std::ofstream::trunc);
+    if (!indexFile.is_open())
+    {
+        std::cerr << "Error writing index file!" << std::endl;
+        return -1;
+    }
+    indexFile << writer.write(root);
+    indexFile.close();
+    if (!indexFile || rename(tmpFilename.c_str(), indexFilename.c_str()) != 0)
+    {
+        std::cerr << "Error writing index file!" << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+/* Function for rebuilding the index from a full listing of the drive */
+int MetadataIndex::bootstrap()
+{
+    std::lock_guard<std::mutex> syncGuard(syncLock);
+    return bootstrapLocked();
+}
+
+/* Function for applying every change since the last sync.
+    Bootstraps instead if the index has never been built. */
+int MetadataIndex::sync()
+{
+    std::lock_guard<std::mutex> syncGuard(syncLock);
+    return syncLocked();
+}
+
+/* Syncs only if the index is older than the staleness bound.
+    Concurrent callers wait for a single sync rather than each running one, and
+    after a failed sync none is attempted for retryPause seconds.
+    Returns -1 if the index is still older than the bound. */
+int MetadataIndex::refresh()
+{
+    {
+        std::lock_guard<std::mutex> guard(dataLock);
+        if (std::time(NULL) - lastSync <= maxStaleness)
+            return 0;
+        if (std::time(NULL) - lastAttempt < retryPause)
+            return -1;
+    }
+    std::lock_guard<std::mutex> syncGuard(syncLock);
+    {
+        std::lock_guard<std::mutex> guard(dataLock);
+        if (std::time(NULL) - lastSync <= maxStaleness)
+            return 0; // someone else synced while we waited
+        if (std::time(NULL) - lastAttempt < retryPause)
+            return -1; // or failed to
+    }
+    syncLocked();
+    std::lock_guard<std::mutex> guard(dataLock);
+    lastAttempt = std::time(NULL); // a failed sync may have spent long in retries: pause from its end
+    return std::time(NULL) - lastSync <= maxStaleness ? 0 : -1; // a failed save does not make the index stale
+}
+
+/* Must be called with syncLock held.
+    The changes feed position is taken first so nothing changed during the
+    listing is missed by the next sync. */
+int MetadataIndex::bootstrapLocked()
+{
+    std::string token = drive->getStartPageToken();
+    if (token.empty())
+        return -1;
+    std::vector<FileInfo> listing;
+    if (drive->listFiles([&listing](const FileInfo& file)
+        {
+            listing.push_back(file);
+            return true;
+        }, "trashed = false"))
+        return -1;
+    {
+        std::lock_guard<std::mutex> guard(dataLock);
+        clear();
+        for (std::size_t i = 0; i < listing.size(); i++)
+            insert(listing[i]);
+        pageToken = token;
+        lastSync = std::time(NULL);
+    }
+    std::cout << "Indexed " << listing.size() << " files." << std::endl;
+    return save();
+}
+
+/* Must be called with syncLock held */
+int MetadataIndex::syncLocked()
+{
+    std::string token;
+    {
+        std::lock_guard<std::mutex> guard(dataLock);
+        token = pageToken;
+    }
+    if (token.empty())
+        return bootstrapLocked();
+    std::size_t changed = 0;
+    int err = drive->listChanges(token, [this, &changed](const FileChange& change)
+    {
+        std::lock_guard<std::mutex> guard(dataLock);
+        changed++;
+        if (change.removed)
+            erase(change.fileId);
+        else
+            insert(change.file);
+    });
+    {
+        std::lock_guard<std::mutex> guard(dataLock);
+        pageToken = token; // on error, the next sync retries from the first unread page
+        if (!err)
+            lastSync = std::time(NULL);
+    }
+    if (err)
+        return -1;
+    return changed ? save() : 0;
+}
+
+/* Looks up a file by id; returns false if the index does not know it or is too stale */
+bool MetadataIndex::lookup(const std::string& id, FileInfo& file)
+{
+    if (refresh())
+        return false;
+    std::lock_guard<std::mutex> guard(dataLock);
+    std::unordered_map<std::string, FileInfo>::iterator it = files.find(id);
+    if (it == files.end())
+        return false;
+    file = it->second;
+    return true;
+}
+
+/* Returns the ids of every file with exactly this name; none if the index is too stale */
+std::vector<std::string> MetadataIndex::idsByName(const std::string& name)
+{
+    std::vector<std::string> ids;
+    if (refresh())
+        return ids;
+    std::lock_guard<std::mutex> guard(dataLock);
+    std::pair<std::unordered_multimap<std::string, std::string>::iterator,
+        std::unordered_multimap<std::string, std::string>::iterator> range = names.equal_range(name);
+    for (std::unordered_multimap<std::string, std::string>::iterator it = range.first; it != range.second; ++it)
+        ids.push_back(it->second);
+    return ids;
+}
+
+/* Returns the ids of the files directly inside a folder; none if the index is too stale */
+std::vector<std::string> MetadataIndex::childrenOf(const std::string& parentId)
+{
+    std::vector<std::string> ids;
+    if (refresh())
+        return ids;
+    std::lock_guard<std::mutex> guard(dataLock);
+    std::pair<std::unordered_multimap<std::string, std::string>::iterator,
+        std::unordered_multimap<std::string, std::string>::iterator> range = children.equal_range(parentId);
+    for (std::unordered_multimap<std::string, std::string>::iterator it = range.first; it != range.second; ++it)
+        ids.push_back(it->second);
+    return ids;
+}
+
+std::size_t MetadataIndex::size()
+{
+    std::lock_guard<std::mutex> guard(dataLock);
+    return files.size();
+}
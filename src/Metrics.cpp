@@ -0,0 +1,291 @@
+/*
+ * Metrics.cc
+ *
+ *  Request metrics and tracing
+ *  Samples are folded into per-operation histograms under one lock; trace
+ *  events are only kept while tracing is on, up to a bounded count.
+ */
+
+#include "Metrics.h"
+#include <cstdio>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <json/json.h>
+
+const double Histogram::bounds[Histogram::bucketCount - 1] =
+    { 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30 };
+
+Histogram::Histogram() : count(0), sum(0)
+{
+    for (int i = 0; i < bucketCount; i++)
+        buckets[i] = 0;
+}
+
+void Histogram::add(double value)
+{
+    int i = 0;
+    while (i < bucketCount - 1 && value > bounds[i])
+        i++;
+    buckets[i]++;
+    count++;
+    sum += value;
+}
+
+/* Estimates the q-quantile (0 to 1), interpolating linearly inside its bucket */
+double Histogram::quantile(double q) const
+{
+    if (!count)
+        return 0;
+    double rank = q * count;
+    unsigned long long seen = 0;
+    for (int i = 0; i < bucketCount; i++)
+    {
+        if (seen + buckets[i] >= rank && buckets[i] > 0)
+        {
+            double lower = i ? bounds[i - 1] : 0;
+            if (i == bucketCount - 1)
+                return lower; // nothing is known above the last bound
+            return lower + (bounds[i] - lower) * (rank - seen) / buckets[i];
+        }
+        seen += buckets[i];
+    }
+    return bounds[bucketCount - 2];
+}
+
+Metrics::Span::Span(Metrics * metrics, const char * name, const std::string& detail)
+    : metrics(metrics), name(name), detail(detail), start(Clock::now())
+{
+}
+
+Metrics::Span::~Span()
+{
+    if (metrics)
+        metrics->span(name, detail, start, Clock::now());
+}
+
+Metrics::Metrics() : tracing(false), maxEvents(0), epoch(Clock::now())
+{
+}
+
+/* Folds a finished request into the statistics of its operation */
+void Metrics::record(const RequestSample& sample)
+{
+    Observer notify;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        OperationStats& stats = operations[sample.operation];
+        stats.requests++;
+        if (sample.code < 0 || sample.code >= 400)
+            stats.errors++;
+        stats.retries += sample.retries;
+        stats.bytesSent += sample.bytesSent;
+        stats.bytesReceived += sample.bytesReceived;
+        stats.codes[sample.code]++;
+        stats.phases[OperationStats::NameLookup].add(sample.nameLookup);
+        stats.phases[OperationStats::Connect].add(sample.connect);
+        stats.phases[OperationStats::Tls].add(sample.tls);
+        stats.phases[OperationStats::Ttfb].add(sample.ttfb);
+        stats.phases[OperationStats::Total].add(sample.total);
+        notify = observer;
+    }
+    if (notify)
+        notify(sample);
+}
+
+/* Records the request last performed on handle, reading its timings from cURL */
+void Metrics::record(CURL * handle, const char * operation, int code, int retries)
+{
+    curl_off_t lookup = 0, connect = 0, tls = 0, ttfb = 0, total = 0;
+    RequestSample sample;
+    sample.operation = operation;
+    sample.code = code;
+    sample.retries = retries;
+    sample.bytesSent = 0;
+    sample.bytesReceived = 0;
+    curl_easy_getinfo(handle, CURLINFO_NAMELOOKUP_TIME_T, &lookup);
+    curl_easy_getinfo(handle, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(handle, CURLINFO_APPCONNECT_TIME_T, &tls);
+    curl_easy_getinfo(handle, CURLINFO_STARTTRANSFER_TIME_T, &ttfb);
+    curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME_T, &total);
+    curl_easy_getinfo(handle, CURLINFO_SIZE_UPLOAD_T, &sample.bytesSent);
+    curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD_T, &sample.bytesReceived);
+    // cURL reports cumulative times since the start of the attempt, in microseconds
+    sample.nameLookup = lookup / 1e6;
+    sample.connect = connect > lookup ? (connect - lookup) / 1e6 : 0;
+    sample.tls = tls > connect ? (tls - connect) / 1e6 : 0;
+    sample.ttfb = ttfb / 1e6;
+    sample.total = total / 1e6;
+    record(sample);
+
+    std::lock_guard<std::mutex> guard(lock);
+    if (tracing)
+    {
+        Event event;
+        event.name = operation;
+        event.category = "request";
+        event.code = code;
+        event.bytes = sample.bytesSent + sample.bytesReceived;
+        Clock::time_point end = Clock::now();
+        trace(event, end - std::chrono::microseconds(total), end);
+    }
+}
+
+/* Records a flow spanning several requests, if tracing */
+void Metrics::span(const char * name, const std::string& detail, Clock::time_point start, Clock::time_point end)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (!tracing)
+        return;
+    Event event;
+    event.name = name;
+    event.category = "flow";
+    event.detail = detail;
+    event.code = 0;
+    event.bytes = 0;
+    trace(event, start, end);
+}
+
+/* Must be called with lock held */
+void Metrics::trace(Event& event, Clock::time_point start, Clock::time_point end)
+{
+    if (events.size() >= maxEvents)
+        return;
+    std::map<std::thread::id, int>::iterator it = threads.find(std::this_thread::get_id());
+    if (it == threads.end())
+        it = threads.insert(std::make_pair(std::this_thread::get_id(), (int) threads.size() + 1)).first;
+    event.thread = it->second;
+    event.start = std::chrono::duration_cast<std::chrono::microseconds>(start - epoch).count();
+    event.duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+    events.push_back(event);
+}
+
+/* Sets a function called with every request sample, on the thread that made the request */
+void Metrics::setObserver(Observer next)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    observer = next;
+}
+
+/* Starts or stops collecting trace spans; at most maxEvents are kept */
+void Metrics::setTracing(bool enable, std::size_t limit)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    tracing = enable;
+    maxEvents = limit;
+}
+
+std::map<std::string, OperationStats> Metrics::snapshot()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return operations;
+}
+
+/* Clears the statistics and the collected spans */
+void Metrics::reset()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    operations.clear();
+    events.clear();
+}
+
+/* The statistics in the Prometheus text exposition format */
+std::string Metrics::prometheus()
+{
+    static const char * phaseNames[OperationStats::PhaseCount] = { "namelookup", "connect", "tls", "ttfb", "total" };
+    std::map<std::string, OperationStats> current = snapshot();
+    std::map<std::string, OperationStats>::const_iterator it;
+    std::stringstream out;
+
+    out << "# HELP gdconnect_requests_total Requests completed, by operation and HTTP status.\n"
+        << "# TYPE gdconnect_requests_total counter\n";
+    for (it = current.begin(); it != current.end(); ++it)
+        for (std::map<int, unsigned long long>::const_iterator code = it->second.codes.begin();
+                code != it->second.codes.end(); ++code)
+            out << "gdconnect_requests_total{operation=\"" << it->first << "\",code=\"" << code->first << "\"} "
+                << code->second << "\n";
+
+    out << "# HELP gdconnect_retries_total Attempts beyond the first, after rate limits, server errors or expired tokens.\n"
+        << "# TYPE gdconnect_retries_total counter\n";
+    for (it = current.begin(); it != current.end(); ++it)
+        out << "gdconnect_retries_total{operation=\"" << it->first << "\"} " << it->second.retries << "\n";
+
+    out << "# HELP gdconnect_sent_bytes_total Request body bytes sent.\n"
+        << "# TYPE gdconnect_sent_bytes_total counter\n";
+    for (it = current.begin(); it != current.end(); ++it)
+        out << "gdconnect_sent_bytes_total{operation=\"" << it->first << "\"} " << it->second.bytesSent << "\n";
+
+    out << "# HELP gdconnect_received_bytes_total Response body bytes received.\n"
+        << "# TYPE gdconnect_received_bytes_total counter\n";
+    for (it = current.begin(); it != current.end(); ++it)
+        out << "gdconnect_received_bytes_total{operation=\"" << it->first << "\"} " << it->second.bytesReceived << "\n";
+
+    out << "# HELP gdconnect_request_duration_seconds Time spent in each phase of a request.\n"
+        << "# TYPE gdconnect_request_duration_seconds histogram\n";
+    for (it = current.begin(); it != current.end(); ++it)
+    {
+        for (int phase = 0; phase < OperationStats::PhaseCount; phase++)
+        {
+            const Histogram& h = it->second.phases[phase];
+            std::string labels = "operation=\"" + it->first + "\",phase=\"" + phaseNames[phase] + "\"";
+            unsigned long long cumulative = 0;
+            for (int i = 0; i < Histogram::bucketCount; i++)
+            {
+                cumulative += h.buckets[i];
+                out << "gdconnect_request_duration_seconds_bucket{" << labels << ",le=\"";
+                if (i < Histogram::bucketCount - 1)
+                    out << Histogram::bounds[i];
+                else
+                    out << "+Inf";
+                out << "\"} " << cumulative << "\n";
+            }
+            out << "gdconnect_request_duration_seconds_sum{" << labels << "} " << h.sum << "\n"
+                << "gdconnect_request_duration_seconds_count{" << labels << "} " << h.count << "\n";
+        }
+    }
+    return out.str();
+}
+
+/* The collected spans in the Chrome trace event format, for chrome://tracing or Perfetto */
+std::string Metrics::chromeTrace()
+{
+    Json::Value root;
+    root["traceEvents"] = Json::Value(Json::arrayValue);
+    root["displayTimeUnit"] = "ms";
+    std::lock_guard<std::mutex> guard(lock);
+    for (std::size_t i = 0; i < events.size(); i++)
+    {
+        const Event& e = events[i];
+        Json::Value event;
+        event["name"] = e.name;
+        event["cat"] = e.category;
+        event["ph"] = "X";
+        event["ts"] = (Json::Int64) e.start;
+        event["dur"] = (Json::Int64) e.duration;
+        event["pid"] = 1;
+        event["tid"] = e.thread;
+        if (!e.detail.empty())
+            event["args"]["detail"] = e.detail;
+        if (e.category[0] == 'r')
+        {
+            event["args"]["code"] = e.code;
+            event["args"]["bytes"] = (Json::Int64) e.bytes;
+        }
+        root["traceEvents"].append(event);
+    }
+    Json::FastWriter writer;
+    return writer.write(root);
+}
+
+/* Function for saving the collected spans to a file */
+int Metrics::writeChromeTrace(const char * path)
+{
+    std::ofstream traceFile(path, std::ofstream::trunc);
+    if (!traceFile.is_open())
+    {
+        std::cerr << "Error writing trace file " << path << std::endl;
+        return -1;
+    }
+    traceFile << chromeTrace();
+    return traceFile.good() ? 0 : -1;
+}
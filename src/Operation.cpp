@@ -0,0 +1,172 @@
+/*
+ * Operation.cc
+ *
+ *  Runs operations described in JSON against a GDConnect client
+ */
+
+#include "Operation.h"
+
+Json::Value describe(const FileInfo& file)
+{
+    Json::Value obj;
+    obj["id"] = file.id;
+    obj["name"] = file.name;
+    obj["mimeType"] = file.mimeType;
+    obj["size"] = (Json::Int64) file.size;
+    if (!file.md5Checksum.empty())
+        obj["md5Checksum"] = file.md5Checksum;
+    if (!file.modifiedTime.empty())
+        obj["modifiedTime"] = file.modifiedTime;
+    for (std::size_t i = 0; i < file.parents.size(); i++)
+        obj["parents"].append(file.parents[i]);
+    for (std::map<std::string, std::string>::const_iterator it = file.appProperties.begin();
+            it != file.appProperties.end(); ++it)
+        obj["appProperties"][it->first] = it->second;
+    return obj;
+}
+
+Json::Value describe(const SyncStats& stats)
+{
+    Json::Value obj;
+    obj["scanned"] = (Json::UInt64) stats.scanned;
+    obj["transferred"] = (Json::UInt64) stats.transferred;
+    obj["skipped"] = (Json::UInt64) stats.skipped;
+    obj["failed"] = (Json::UInt64) stats.failed;
+    obj["foldersCreated"] = (Json::UInt64) stats.foldersCreated;
+    obj["bytes"] = (Json::Int64) stats.bytes;
+    return obj;
+}
+
+/* The inverse of describe(const FileInfo&) */
+FileInfo fileFromJson(const Json::Value& obj)
+{
+    FileInfo file;
+    file.id = obj["id"].asString();
+    file.name = obj["name"].asString();
+    file.mimeType = obj["mimeType"].asString();
+    file.md5Checksum = obj["md5Checksum"].asString();
+    file.modifiedTime = obj["modifiedTime"].asString();
+    file.size = obj["size"].asInt64();
+    const Json::Value& parents = obj["parents"];
+    for (unsigned int i = 0; i < parents.size(); i++)
+        file.parents.push_back(parents[i].asString());
+    const Json::Value& tags = obj["appProperties"];
+    std::vector<std::string> keys = tags.getMemberNames();
+    for (std::size_t i = 0; i < keys.size(); i++)
+        file.appProperties[keys[i]] = tags[keys[i]].asString();
+    return file;
+}
+
+/* Runs one operation and fills its result, which always carries "ok" */
+void runOperation(GDConnect& connection, const Json::Value& op, Json::Value& result)
+{
+    std::string kind = op["op"].asString();
+    result["ok"] = false;
+    if (kind == "ls")
+    {
+        Json::Value files(Json::arrayValue);
+        std::string query = op["query"].asString();
+        int err = connection.listFiles([&files](const FileInfo& file)
+        {
+            files.append(describe(file));
+            return true;
+        }, query.empty() ? NULL : query.c_str());
+        result["ok"] = !err;
+        result["files"] = files;
+    }
+    else if (kind == "resolve")
+    {
+        std::string id = connection.getFileId(op["name"].asString().c_str());
+        result["ok"] = !id.empty();
+        result["fileId"] = id;
+    }
+    else if (kind == "get")
+    {
+        // never fall back to the working directory, which is the daemon's when it runs this
+        std::string path = op["path"].asString();
+        if (path.empty() || path[0] != '/')
+        {
+            result["error"] = "path must be an absolute path";
+            return;
+        }
+        std::string id = op["fileId"].asString();
+        if (id.empty() && op.isMember("name"))
+            id = connection.getFileId(op["name"].asString().c_str());
+        if (id.empty())
+        {
+            result["error"] = "no file to download";
+            return;
+        }
+        std::string md5;
+        int code = connection.getFileById(id.c_str(), path.c_str(), &md5);
+        result["ok"] = code >= 200 && code < 300;
+        result["code"] = code;
+        result["fileId"] = id;
+        if (!md5.empty())
+            result["md5"] = md5;
+    }
+    else if (kind == "put")
+    {
+        std::string path = op["path"].asString();
+        if (path.empty())
+        {
+            result["error"] = "no file to upload";
+            return;
+        }
+        UploadTarget target;
+        target.name = op.get("name", path.substr(path.find_last_of('/') + 1)).asString();
+        target.parentId = op["parent"].asString();
+        target.fileId = op["fileId"].asString();
+        const Json::Value& properties = op["appProperties"];
+        if (properties.isObject())
+        {
+            Json::Value::Members keys = properties.getMemberNames();
+            for (std::size_t i = 0; i < keys.size(); i++)
+                target.appProperties[keys[i]] = properties[keys[i]].asString();
+        }
+        std::string md5;
+        std::pair<std::string, int> response = connection.putFile(path.c_str(), target, &md5);
+        result["ok"] = response.second == 0;
+        if (response.second == 0)
+        {
+            result["fileId"] = response.first;
+            result["md5"] = md5;
+        }
+        else
+        {
+            result["code"] = response.second;
+            result["error"] = response.first;
+        }
+    }
+    else if (kind == "mkdir")
+    {
+        std::string name = op["name"].asString();
+        std::string parent = op["parent"].asString();
+        if (name.empty())
+        {
+            result["error"] = "no folder name";
+            return;
+        }
+        std::string id = connection.createFolder(name.c_str(), parent.empty() ? NULL : parent.c_str());
+        result["ok"] = !id.empty();
+        result["fileId"] = id;
+    }
+    else if (kind == "sync")
+    {
+        std::string direction = op["direction"].asString();
+        std::string local = op["local"].asString();
+        std::string remote = op["remote"].asString();
+        if ((direction != "up" && direction != "down") || local.empty() || remote.empty())
+        {
+            result["error"] = "sync needs a direction (up or down), local and remote";
+            return;
+        }
+        TreeSync sync(&connection);
+        SyncStats stats = direction == "up" ? sync.syncUp(local.c_str(), remote.c_str())
+                          : sync.syncDown(remote.c_str(), local.c_str());
+        result["ok"] = stats.failed == 0;
+        result["stats"] = describe(stats);
+    }
+    else
+        result["error"] = "unknown operation '" + kind + "'";
+}
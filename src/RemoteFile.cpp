@@ -0,0 +1,206 @@
+/*
+ * RemoteFile.cc
+ *
+ *  Block cache over HTTP Range reads of a Drive file
+ *  Blocks are claimed under the lock and requested outside it, as completion
+ *  callbacks take the lock on the I/O thread. A block that fails is dropped
+ *  from the cache, and a read waiting for it asks for it once more.
+ */
+
+#include "RemoteFile.h"
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+
+RemoteFile::RemoteFile(GDConnect * drive, std::size_t blockSize, std::size_t cacheBytes, std::size_t maxReadAhead)
+    : drive(drive), fileSize(0), blockSize(blockSize ? blockSize : 1 << 20), loading(0),
+      cancel(std::make_shared<CancelToken>()), nextOffset(0), window(0)
+{
+    capacity = std::max<std::size_t>(cacheBytes / this->blockSize, 2);
+    // read-ahead never takes more than half of the cache
+    this->maxReadAhead = std::min(maxReadAhead, capacity / 2);
+    memset(&counters, 0, sizeof(counters));
+}
+
+RemoteFile::~RemoteFile()
+{
+    close();
+}
+
+/* Function for opening a Google Drive file by ID; returns 0, or -1 if it could not be found.
+    The content is read as stored: files uploaded compressed are read compressed. */
+int RemoteFile::open(const char * id)
+{
+    close();
+    FileInfo file;
+    if (drive->getFileInfo(id, file))
+    {
+        std::cerr << "Error retrieving file id " << id << std::endl;
+        return -1;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    fileId = id;
+    fileSize = file.size;
+    nextOffset = 0;
+    window = 0;
+    memset(&counters, 0, sizeof(counters));
+    return 0;
+}
+
+/* Drops the cache, after cancelling the blocks in flight and waiting for them.
+    Must not be called while reads are in progress. */
+void RemoteFile::close()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    cancel->cancel();
+    changed.wait(guard, [this] { return loading == 0; });
+    cancel = std::make_shared<CancelToken>();
+    blocks.clear();
+    lru.clear();
+    fileId.clear();
+    fileSize = 0;
+}
+
+RemoteFileStats RemoteFile::stats()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return counters;
+}
+
+/* Reads up to length bytes at offset, like pread(2): returns the number of bytes
+    read, 0 at the end of the file, or -1 if a block could not be fetched.
+    Several threads may read at once. */
+ssize_t RemoteFile::pread(void * buffer, std::size_t length, curl_off_t offset)
+{
+    std::vector<std::size_t> requests;
+    std::size_t first, last;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (fileId.empty() || offset < 0)
+            return -1;
+        if (offset >= fileSize || length == 0)
+            return 0;
+        length = (std::size_t) std::min<curl_off_t>(length, fileSize - offset);
+        first = offset / blockSize;
+        last = (offset + length - 1) / blockSize;
+
+        // a read starting where the previous one ended widens the read-ahead, any other resets it
+        if (offset == nextOffset)
+            window = window ? std::min(window * 2, maxReadAhead) : std::min<std::size_t>(1, maxReadAhead);
+        else
+            window = 0;
+        nextOffset = offset + length;
+
+        for (std::size_t i = first; i <= last; i++)
+        {
+            if (blocks.count(i))
+            {
+                counters.hits++;
+                continue;
+            }
+            counters.misses++;
+            claim(i);
+            requests.push_back(i);
+        }
+        std::size_t lastBlock = (fileSize - 1) / blockSize;
+        for (std::size_t i = last + 1; i <= std::min(last + window, lastBlock) && loading < capacity / 2; i++)
+        {
+            if (blocks.count(i))
+                continue;
+            counters.prefetched++;
+            claim(i);
+            requests.push_back(i);
+        }
+    }
+    for (std::size_t i = 0; i < requests.size(); i++)
+        fetch(requests[i]);
+
+    std::unique_lock<std::mutex> guard(lock);
+    char * out = static_cast<char *>(buffer);
+    std::size_t copied = 0;
+    for (std::size_t i = first; i <= last; i++)
+    {
+        bool retried = false;
+        std::unordered_map<std::size_t, Block>::iterator it;
+        while (true)
+        {
+            it = blocks.find(i);
+            if (it == blocks.end())
+            {
+                // failed, or evicted by other readers before we got to it
+                if (retried)
+                    return -1;
+                retried = true;
+                counters.misses++;
+                claim(i);
+                guard.unlock();
+                fetch(i);
+                guard.lock();
+                continue;
+            }
+            if (it->second.state == Ready)
+                break;
+            changed.wait(guard);
+        }
+        Block& block = it->second;
+        curl_off_t blockStart = (curl_off_t) i * blockSize;
+        std::size_t from = (std::size_t) std::max<curl_off_t>(offset - blockStart, 0);
+        std::size_t count = std::min(block.data.size() - from, length - copied);
+        memcpy(out + copied, &block.data[from], count);
+        copied += count;
+        lru.splice(lru.begin(), lru, block.recent);
+    }
+    return copied;
+}
+
+/* Must be called with lock held: enters a block as Loading, evicting the least
+    recently read blocks if the cache is full */
+void RemoteFile::claim(std::size_t index)
+{
+    while (blocks.size() >= capacity && !lru.empty())
+    {
+        blocks.erase(lru.back());
+        lru.pop_back();
+        counters.evicted++;
+    }
+    blocks[index].state = Loading;
+    loading++;
+}
+
+/* Requests a claimed block; must be called without lock held */
+void RemoteFile::fetch(std::size_t index)
+{
+    curl_off_t begin = (curl_off_t) index * blockSize;
+    curl_off_t length = std::min<curl_off_t>(blockSize, fileSize - begin);
+    std::shared_ptr<std::vector<char> > data = std::make_shared<std::vector<char> >();
+    data->reserve(length);
+    drive->getFileRangeAsync(fileId.c_str(), begin, length, [data](const char * bytes, std::size_t size)
+    {
+        data->insert(data->end(), bytes, bytes + size);
+        return true;
+    }, [this, index, data](const int& code)
+    {
+        finished(index, data, code);
+    }, cancel);
+}
+
+/* Called on the I/O thread once a block has arrived or failed */
+void RemoteFile::finished(std::size_t index, std::shared_ptr<std::vector<char> > data, int code)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    loading--;
+    std::unordered_map<std::size_t, Block>::iterator it = blocks.find(index);
+    curl_off_t expected = std::min<curl_off_t>(blockSize, fileSize - (curl_off_t) index * blockSize);
+    if (code == 206 && (curl_off_t) data->size() == expected)
+    {
+        Block& block = it->second;
+        block.data.swap(*data);
+        block.state = Ready;
+        lru.push_front(index);
+        block.recent = lru.begin();
+        counters.bytesFetched += block.data.size();
+    }
+    else
+        blocks.erase(it);
+    changed.notify_all();
+}
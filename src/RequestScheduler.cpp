@@ -0,0 +1,173 @@
+/*
+ * RequestScheduler.cc
+ *
+ *  Token bucket rate limiting with priorities and adaptive backoff.
+ *  The request rate is cut in half when Drive reports a rate limit and
+ *  grows back linearly while requests succeed (AIMD), which settles close
+ *  to the sustainable rate instead of swinging between bursts and error storms.
+ */
+
+#include "RequestScheduler.h"
+#include <algorithm>
+
+/* Rates apply to the whole client. A rate of 0 means unlimited */
+RequestScheduler::RequestScheduler(double requestsPerSecond, double bytesPerSecond)
+    : maxRequestRate(requestsPerSecond), rng(std::random_device()())
+{
+    Clock::time_point now = Clock::now();
+    requests.rate = requestsPerSecond;
+    requests.tokens = requestsPerSecond;
+    requests.last = now;
+    bytes.rate = bytesPerSecond;
+    bytes.tokens = bytesPerSecond;
+    bytes.last = now;
+    for (int i = 0; i < PriorityCount; i++)
+        waiting[i] = 0;
+    pausedUntil = now;
+    lastThrottle = now - std::chrono::seconds(60);
+}
+
+void RequestScheduler::setRequestRate(double perSecond)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    maxRequestRate = perSecond;
+    requests.rate = perSecond;
+    requests.tokens = std::min(requests.tokens, perSecond);
+    wake.notify_all();
+}
+
+void RequestScheduler::setByteRate(double perSecond)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    bytes.rate = perSecond;
+    bytes.tokens = std::min(bytes.tokens, perSecond);
+    wake.notify_all();
+}
+
+/* The request rate currently allowed, below the configured one after rate limit errors */
+double RequestScheduler::currentRequestRate()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    refill(requests, Clock::now());
+    return requests.rate;
+}
+
+/* Must be called with lock held. A bucket holds at most one second worth of tokens.
+    The request rate also recovers here: a tenth of the configured rate per second
+    since the last rate limit error. */
+void RequestScheduler::refill(Bucket& bucket, Clock::time_point now)
+{
+    double elapsed = std::chrono::duration<double>(now - bucket.last).count();
+    bucket.last = now;
+    if (&bucket == &requests && maxRequestRate > 0 && requests.rate < maxRequestRate
+            && now - lastThrottle > std::chrono::seconds(1))
+        requests.rate = std::min(maxRequestRate, requests.rate + maxRequestRate / 10 * elapsed);
+    if (bucket.rate > 0)
+        bucket.tokens = std::min(bucket.rate, bucket.tokens + bucket.rate * elapsed);
+}
+
+/* Must be called with lock held. Returns 0 if a request of this priority may start now,
+    otherwise how many milliseconds to wait before asking again.
+    Bulk transfers leave a fifth of the request burst to metadata calls and give way
+    to any metadata call already waiting. */
+long RequestScheduler::delayLocked(Priority priority, Clock::time_point now)
+{
+    if (now < pausedUntil)
+        return std::max(1L, (long) std::chrono::duration_cast<std::chrono::milliseconds>(pausedUntil - now).count());
+    refill(requests, now);
+    refill(bytes, now);
+    if (priority == Bulk && waiting[Metadata] > 0)
+        return 10;
+    if (requests.rate > 0)
+    {
+        double needed = priority == Bulk ? 1 + requests.rate / 5 : 1;
+        needed = std::min(needed, std::max(1.0, requests.rate)); // always reachable, even at low rates
+        if (requests.tokens < needed)
+            return std::max(1L, (long) ((needed - requests.tokens) / requests.rate * 1000));
+    }
+    if (bytes.rate > 0 && bytes.tokens < 0)
+        return std::max(1L, (long) (-bytes.tokens / bytes.rate * 1000));
+    return 0;
+}
+
+/* Must be called with lock held */
+void RequestScheduler::takeLocked(curl_off_t length)
+{
+    if (requests.rate > 0)
+        requests.tokens -= 1;
+    if (bytes.rate > 0)
+        bytes.tokens -= length;
+}
+
+/* Blocks until a request of this priority sending length bytes may start */
+void RequestScheduler::acquire(Priority priority, curl_off_t length)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    waiting[priority]++;
+    long delay;
+    while ((delay = delayLocked(priority, Clock::now())) > 0)
+        wake.wait_for(guard, std::chrono::milliseconds(delay));
+    waiting[priority]--;
+    takeLocked(length);
+    wake.notify_all(); // bulk waiters may have been held back by this caller
+}
+
+/* Non-blocking acquire, for event loops: returns 0 if the request may start now
+    (its tokens are then taken), otherwise how many milliseconds to wait before trying again */
+long RequestScheduler::tryAcquire(Priority priority, curl_off_t length)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    long delay = delayLocked(priority, Clock::now());
+    if (delay == 0)
+        takeLocked(length);
+    return delay;
+}
+
+/* Accounts for bytes only known once a transfer is over, such as downloads */
+void RequestScheduler::charge(curl_off_t length)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (bytes.rate > 0)
+        bytes.tokens -= length;
+}
+
+/* Reports the outcome of a request. reason is the Drive error reason, if any, and
+    retryAfter the Retry-After header in seconds (0 if absent). attempt counts earlier
+    retries of the same request. Returns how many milliseconds to wait before retrying
+    it, or -1 if it should not be retried.
+    Rate limit errors also slow down every request, at most once per second so that a
+    burst of concurrent errors does not collapse the rate. */
+long RequestScheduler::complete(int code, const std::string& reason, long retryAfter, int attempt)
+{
+    const int maxAttempts = 5;
+    bool throttled = code == 429 || (code == 403 && (reason == "rateLimitExceeded" || reason == "userRateLimitExceeded"));
+    bool serverError = code == 500 || code == 502 || code == 503 || code == 504;
+    if (!throttled && !serverError)
+        return -1; // success, or an error retrying will not fix (e.g. dailyLimitExceeded)
+    long delay = retryAfter > 0 ? retryAfter * 1000 : backoff(attempt);
+    if (throttled)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        Clock::time_point now = Clock::now();
+        if (now - lastThrottle > std::chrono::seconds(1))
+        {
+            refill(requests, now);
+            if (requests.rate > 0)
+                requests.rate = std::max(1.0, requests.rate / 2);
+            lastThrottle = now;
+        }
+        // everyone holds off briefly, so the quota window can clear
+        pausedUntil = std::max(pausedUntil, now + std::chrono::milliseconds(delay / 2));
+    }
+    return attempt < maxAttempts ? delay : -1;
+}
+
+/* Exponential backoff with jitter: a random delay between half and all of
+    min(32 s, 2^attempt s), so that clients failing together do not retry together */
+long RequestScheduler::backoff(int attempt)
+{
+    long ceiling = 1000L << std::min(attempt, 5);
+    std::lock_guard<std::mutex> guard(lock);
+    std::uniform_int_distribution<long> jitter(ceiling / 2, ceiling);
+    return jitter(rng);
+}
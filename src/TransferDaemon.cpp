@@ -0,0 +1,282 @@
+/*
+ * TransferDaemon.cc
+ *
+ *  Unix socket server for GDConnect operations
+ *  Every connection gets a thread reading one request at a time. Requests are
+ *  keyed by their content without the client's "id", so a second identical
+ *  request arriving while the first is performed waits for the same result.
+ */
+
+#include "TransferDaemon.h"
+#include "Operation.h"
+#include <iostream>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <chrono>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+TransferDaemon::TransferDaemon(GDConnect * connection, std::size_t maxConcurrent)
+    : connection(connection), listener(-1), listening(false), active(0),
+      maxConcurrent(maxConcurrent ? maxConcurrent : 1), performing(0), waiting(0), served(0), shared(0)
+{
+}
+
+TransferDaemon::~TransferDaemon()
+{
+    stop();
+}
+
+/* Binds to socketPath, replacing a stale socket file, and starts accepting clients.
+    The socket is only accessible to the user running the daemon. */
+bool TransferDaemon::start(const char * socketPath)
+{
+    struct sockaddr_un addr;
+    if (strlen(socketPath) >= sizeof(addr.sun_path))
+    {
+        std::cerr << "Socket path too long: " << socketPath << std::endl;
+        return false;
+    }
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
+        return false;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socketPath);
+    unlink(socketPath);
+    mode_t previous = umask(0077);
+    int bound = bind(listener, (struct sockaddr *) &addr, sizeof(addr));
+    umask(previous);
+    if (bound != 0 || listen(listener, 128) != 0)
+    {
+        perror("TransferDaemon");
+        close(listener);
+        listener = -1;
+        return false;
+    }
+    path = socketPath;
+    listening = true;
+    acceptor = std::thread(&TransferDaemon::acceptLoop, this);
+    return true;
+}
+
+/* Stops accepting, closes every client connection and waits for the operations
+    in progress to finish */
+void TransferDaemon::stop()
+{
+    if (!listening.exchange(false))
+        return;
+    shutdown(listener, SHUT_RDWR);
+    close(listener);
+    acceptor.join();
+    unlink(path.c_str());
+    std::unique_lock<std::mutex> guard(connectionLock);
+    for (std::set<int>::iterator it = sockets.begin(); it != sockets.end(); ++it)
+        shutdown(*it, SHUT_RDWR);
+    idle.wait(guard, [this] { return active == 0; });
+}
+
+/* Counters of the daemon, also answered to a "status" request */
+Json::Value TransferDaemon::status()
+{
+    Json::Value obj;
+    {
+        std::lock_guard<std::mutex> guard(connectionLock);
+        obj["clients"] = (Json::UInt64) sockets.size();
+    }
+    std::lock_guard<std::mutex> guard(flightLock);
+    obj["performing"] = (Json::UInt64) performing;
+    obj["waiting"] = (Json::UInt64) waiting;
+    obj["maxConcurrent"] = (Json::UInt64) maxConcurrent;
+    obj["served"] = (Json::UInt64) served;
+    obj["shared"] = (Json::UInt64) shared;
+    return obj;
+}
+
+/* Accepts clients until stopped. Running out of descriptors or memory leaves the
+    pending connection queued: accepting again only after a pause gives the
+    clients served meanwhile a chance to close theirs. */
+void TransferDaemon::acceptLoop()
+{
+    while (listening)
+    {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                continue;
+            }
+            if (listening)
+                perror("TransferDaemon");
+            break;
+        }
+        std::lock_guard<std::mutex> guard(connectionLock);
+        if (!listening)
+        {
+            close(fd);
+            break;
+        }
+        sockets.insert(fd);
+        active++;
+        std::thread(&TransferDaemon::serve, this, fd).detach();
+    }
+}
+
+/* Answers the requests of one client until it disconnects */
+void TransferDaemon::serve(int fd)
+{
+    std::string buffer;
+    char chunk[16384];
+    Json::Reader reader;
+    Json::FastWriter writer;
+    bool open = true;
+    while (open)
+    {
+        std::size_t newline;
+        while ((newline = buffer.find('\n')) == std::string::npos)
+        {
+            ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+            if (n <= 0)
+                break;
+            buffer.append(chunk, n);
+        }
+        if (newline == std::string::npos)
+            break;
+        std::string line = buffer.substr(0, newline);
+        buffer.erase(0, newline + 1);
+        if (line.find_first_not_of(" \t\r") == std::string::npos)
+            continue;
+        Json::Value request;
+        Json::Value response;
+        if (!reader.parse(line, request) || !request.isObject())
+        {
+            response["ok"] = false;
+            response["error"] = "invalid request: " + reader.getFormattedErrorMessages();
+        }
+        else
+            response = handle(request);
+        open = sendAll(fd, writer.write(response));
+    }
+    close(fd);
+    std::lock_guard<std::mutex> guard(connectionLock);
+    sockets.erase(fd);
+    if (--active == 0)
+        idle.notify_all();
+}
+
+/* Performs a request, or joins an identical one already in flight */
+Json::Value TransferDaemon::handle(const Json::Value& request)
+{
+    Json::Value op = request;
+    op.removeMember("id");
+    Json::Value response;
+    std::string kind = op["op"].asString();
+    if (kind == "status")
+    {
+        response = status();
+        response["ok"] = true;
+    }
+    else if (kind == "metrics")
+    {
+        response["ok"] = true;
+        response["prometheus"] = connection->getMetrics().prometheus();
+    }
+    else
+    {
+        // paths are the client's: the daemon runs in another working directory
+        const char * pathFields[] = { "path", "local" };
+        for (int i = 0; i < 2; i++)
+        {
+            if (op.isMember(pathFields[i]) && op[pathFields[i]].asString().compare(0, 1, "/") != 0)
+            {
+                response["ok"] = false;
+                response["error"] = std::string(pathFields[i]) + " must be an absolute path";
+            }
+        }
+        if (response.isNull())
+        {
+            Json::FastWriter writer;
+            std::string key = writer.write(op);   // members are ordered, so equal operations give equal keys
+            std::shared_future<Json::Value> result;
+            bool owner = false;
+            std::promise<Json::Value> promise;
+            {
+                std::lock_guard<std::mutex> guard(flightLock);
+                std::map<std::string, std::shared_future<Json::Value> >::iterator it = inFlight.find(key);
+                if (it != inFlight.end())
+                {
+                    result = it->second;
+                    shared++;
+                }
+                else
+                {
+                    result = promise.get_future().share();
+                    inFlight[key] = result;
+                    owner = true;
+                }
+            }
+            if (owner)
+            {
+                Json::Value outcome = perform(op);
+                {
+                    std::lock_guard<std::mutex> guard(flightLock);
+                    inFlight.erase(key);
+                }
+                promise.set_value(outcome);
+                response = outcome;
+            }
+            else
+            {
+                response = result.get();
+                response["shared"] = true;
+            }
+        }
+    }
+    {
+        std::lock_guard<std::mutex> guard(flightLock);
+        served++;
+    }
+    if (request.isMember("id"))
+        response["id"] = request["id"];
+    return response;
+}
+
+/* Runs an operation once one of the maxConcurrent slots is free */
+Json::Value TransferDaemon::perform(const Json::Value& op)
+{
+    {
+        std::unique_lock<std::mutex> guard(flightLock);
+        waiting++;
+        slotFree.wait(guard, [this] { return performing < maxConcurrent; });
+        waiting--;
+        performing++;
+    }
+    Json::Value result;
+    runOperation(*connection, op, result);
+    {
+        std::lock_guard<std::mutex> guard(flightLock);
+        performing--;
+    }
+    slotFree.notify_one();
+    return result;
+}
+
+bool TransferDaemon::sendAll(int fd, const std::string& data)
+{
+    std::size_t sent = 0;
+    while (sent < data.size())
+    {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        sent += n;
+    }
+    return true;
+}
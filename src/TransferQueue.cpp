@@ -0,0 +1,152 @@
+/*
+ * TransferQueue.cc
+ *
+ *  Single-threaded curl_multi event loop shared by the bulk download paths.
+ */
+
+#include "TransferQueue.h"
+
+TransferQueue::TransferQueue(std::size_t maxInFlight) : maxInFlight(maxInFlight ? maxInFlight : 1), gateDelay(0)
+{
+    multi = curl_multi_init();
+}
+
+TransferQueue::~TransferQueue()
+{
+    abort();
+    curl_multi_cleanup(multi);
+}
+
+/* Abandons every transfer, started or not: each is detached and reported as aborted.
+   Completions may queue follow-ups; those are aborted too. */
+void TransferQueue::abort()
+{
+    while (!active.empty() || !pending.empty() || !delayed.empty())
+    {
+        std::map<CURL *, Completion> started;
+        started.swap(active);
+        std::deque<Transfer> waiting;
+        waiting.swap(pending);
+        for (std::multimap<Clock::time_point, Transfer>::iterator it = delayed.begin(); it != delayed.end(); ++it)
+            waiting.push_back(it->second);
+        delayed.clear();
+        for (std::map<CURL *, Completion>::iterator it = started.begin(); it != started.end(); ++it)
+        {
+            curl_multi_remove_handle(multi, it->first);
+            it->second(it->first, CURLE_ABORTED_BY_CALLBACK);
+        }
+        for (std::size_t i = 0; i < waiting.size(); i++)
+            waiting[i].done(waiting[i].handle, CURLE_ABORTED_BY_CALLBACK);
+    }
+}
+
+/* Queues a prepared easy handle; it starts as soon as a slot is free, and
+   no sooner than delayMs from now. A delayed transfer holds up no other. */
+void TransferQueue::add(CURL * handle, Completion done, long delayMs)
+{
+    Transfer transfer;
+    transfer.handle = handle;
+    transfer.done = done;
+    if (delayMs > 0)
+        delayed.insert(std::make_pair(Clock::now() + std::chrono::milliseconds(delayMs), transfer));
+    else
+        pending.push_back(transfer);
+}
+
+/* Milliseconds until the next delayed transfer is due, or -1 if there is none */
+long TransferQueue::untilDue()
+{
+    if (delayed.empty())
+        return -1;
+    long ms = (long) std::chrono::duration_cast<std::chrono::milliseconds>(delayed.begin()->first - Clock::now()).count();
+    return ms > 0 ? ms : 0;
+}
+
+/* Moves queued transfers onto the multi stack up to the in-flight limit,
+   as long as the gate lets them through */
+void TransferQueue::fill()
+{
+    gateDelay = 0;
+    while (!delayed.empty() && delayed.begin()->first <= Clock::now())
+    {
+        pending.push_back(delayed.begin()->second);
+        delayed.erase(delayed.begin());
+    }
+    while (!pending.empty() && active.size() < maxInFlight)
+    {
+        if (gate && (gateDelay = gate(pending.front().handle)) > 0)
+            return;
+        Transfer transfer = pending.front();
+        pending.pop_front();
+        if (curl_multi_add_handle(multi, transfer.handle) != CURLM_OK)
+        {
+            transfer.done(transfer.handle, CURLE_FAILED_INIT);
+            continue;
+        }
+        active[transfer.handle] = transfer.done;
+    }
+}
+
+/* Hands finished transfers to their completions */
+void TransferQueue::reap()
+{
+    CURLMsg * msg;
+    int remaining;
+    while ((msg = curl_multi_info_read(multi, &remaining)))
+    {
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+        CURL * handle = msg->easy_handle;
+        CURLcode res = msg->data.result;
+        curl_multi_remove_handle(multi, handle);
+        std::map<CURL *, Completion>::iterator it = active.find(handle);
+        if (it == active.end())
+            continue;
+        Completion done = it->second;
+        active.erase(it);
+        done(handle, res); // may queue follow-up transfers
+    }
+}
+
+/* Runs the event loop until every queued transfer, including follow-ups
+   added by completions, has finished. Returns 0, or -1 on a multi error. */
+int TransferQueue::run()
+{
+    while (!active.empty() || !pending.empty() || !delayed.empty())
+    {
+        if (step(1000))
+            return -1;
+    }
+    return 0;
+}
+
+/* One turn of the event loop: waits up to timeoutMs for socket activity
+   (or a wakeup), then advances transfers and hands finished ones to their
+   completions. Returns 0, or -1 on a multi error. */
+int TransferQueue::step(int timeoutMs)
+{
+    if (!multi)
+        return -1;
+    int running = 0;
+    fill();
+    if (gateDelay > 0 && gateDelay < timeoutMs)
+        timeoutMs = (int) gateDelay; // come back when the gate may open
+    long due = untilDue();
+    if (due >= 0 && due < timeoutMs)
+        timeoutMs = (int) due;
+    // freshly added handles are due at once, so this only blocks while transfers wait on the network
+    if (curl_multi_poll(multi, NULL, 0, timeoutMs, NULL) != CURLM_OK)
+        return -1;
+    if (curl_multi_perform(multi, &running) != CURLM_OK)
+        return -1;
+    reap();
+    fill();
+    return 0;
+}
+
+/* Interrupts a step blocked in poll; safe to call from any thread */
+void TransferQueue::wakeup()
+{
+    if (multi)
+        curl_multi_wakeup(multi);
+}
@@ -0,0 +1,508 @@
+/*
+ * TreeSync.cc
+ *
+ *  Directory tree upload and download for Google Drive.
+ *  The remote tree is listed one level at a time, with every folder of a
+ *  level listed concurrently; missing remote folders are created one level
+ *  at a time through batch requests; files are hashed and transferred on
+ *  bounded pools of threads sharing one client.
+ */
+
+#include "TreeSync.h"
+#include "Md5.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <atomic>
+#include <thread>
+#include <future>
+#include <chrono>
+#include <algorithm>
+#include <iostream>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <json/json.h>
+
+static const char * folderType = "application/vnd.google-apps.folder";
+
+/* Google Docs, Sheets... have no binary content to compare or download */
+static bool isGoogleType(const std::string& mimeType)
+{
+    return mimeType.compare(0, 28, "application/vnd.google-apps.") == 0;
+}
+
+/* Parses an RFC 3339 time as used by Drive, e.g. 2016-06-01T12:00:00.000Z */
+static time_t parseTime(const std::string& str)
+{
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(str.c_str(), "%d-%d-%dT%d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+        return 0;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    return timegm(&tm);
+}
+
+static std::string parentOf(const std::string& path)
+{
+    std::size_t slash = path.rfind('/');
+    return slash == std::string::npos ? std::string() : path.substr(0, slash);
+}
+
+static std::string baseName(const std::string& path)
+{
+    std::size_t slash = path.rfind('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+static std::string join(const std::string& dir, const std::string& name)
+{
+    return dir.empty() ? name : dir + "/" + name;
+}
+
+/* Tells whether the existing directory dir resolves to root (itself resolved)
+    or below it, so that symbolic links cannot lead a download out of the tree */
+static bool inside(const std::string& root, const std::string& dir)
+{
+    char * resolved = realpath(dir.c_str(), NULL);
+    if (!resolved)
+        return false;
+    std::string path = resolved;
+    free(resolved);
+    return path == root || (path.compare(0, root.size(), root) == 0 && (root == "/" || path[root.size()] == '/'));
+}
+
+/* hashThreads of 0 uses one thread per core. maxTransfers bounds concurrent uploads or downloads */
+TreeSync::TreeSync(GDConnect * drive, std::size_t hashThreads, std::size_t maxTransfers)
+    : drive(drive), hashThreads(hashThreads), maxTransfers(maxTransfers ? maxTransfers : 1)
+{
+    if (this->hashThreads == 0)
+        this->hashThreads = std::max(1u, std::thread::hardware_concurrency());
+}
+
+TreeSync::~TreeSync()
+{
+}
+
+/* Runs work(0) ... work(count - 1) on up to threads threads */
+void TreeSync::parallel(std::size_t count, std::size_t threads, const std::function<void(std::size_t)>& work)
+{
+    std::atomic<std::size_t> next(0);
+    std::vector<std::thread> workers;
+    threads = std::min(threads, count);
+    for (std::size_t t = 0; t < threads; t++)
+    {
+        workers.push_back(std::thread([&next, count, &work]()
+        {
+            std::size_t i;
+            while ((i = next++) < count)
+                work(i);
+        }));
+    }
+    for (std::size_t t = 0; t < workers.size(); t++)
+        workers[t].join();
+}
+
+/* Lists every file below folderId into entries, and every folder into folders
+    (relative path -> id, with "" for folderId itself). Returns 0, or -1 if any
+    folder could not be listed. */
+int TreeSync::listRemote(const std::string& folderId, std::map<std::string, Entry>& entries,
+                         std::map<std::string, std::string>& folders)
+{
+    int err = 0;
+    folders[""] = folderId;
+    std::vector<std::pair<std::string, std::string> > level(1, std::make_pair(std::string(), folderId));
+    while (!level.empty())
+    {
+        std::vector<std::vector<FileInfo> > children(level.size());
+        std::vector<std::future<int> > listings;
+        for (std::size_t i = 0; i < level.size(); i++)
+        {
+            std::string query = "'" + level[i].second + "' in parents and trashed = false";
+            std::vector<FileInfo> * found = &children[i];
+            listings.push_back(drive->listFilesAsync([found](const FileInfo& file)
+            {
+                found->push_back(file);
+                return true;
+            }, query.c_str()));
+        }
+        std::vector<std::pair<std::string, std::string> > next;
+        for (std::size_t i = 0; i < level.size(); i++)
+        {
+            if (listings[i].get())
+            {
+                std::cerr << "Unable to list remote folder " << level[i].first << std::endl;
+                err = -1;
+                continue;
+            }
+            for (std::size_t j = 0; j < children[i].size(); j++)
+            {
+                const FileInfo& file = children[i][j];
+                if (!GDConnect::usableName(file.name))
+                {
+                    std::cerr << "Skipping remote file " << file.id << ": its name cannot be used locally" << std::endl;
+                    continue;
+                }
+                std::string path = join(level[i].first, file.name);
+                if (file.mimeType == folderType)
+                {
+                    if (folders.insert(std::make_pair(path, file.id)).second)
+                        next.push_back(std::make_pair(path, file.id));
+                    continue;
+                }
+                Entry& entry = entries[path];
+                if (entry.remote)
+                {
+                    std::cerr << "Several remote files are named " << path << ", using the first one" << std::endl;
+                    continue;
+                }
+                entry.path = path;
+                entry.remote = true;
+                entry.remoteFile = file;
+            }
+        }
+        level.swap(next);
+    }
+    return err;
+}
+
+/* Lists every regular file below root/relative into entries, and every directory into dirs.
+    Upload session files and partial downloads are left out. Symbolic links are followed;
+    visited holds the directories listed so far, so that none is listed twice. */
+int TreeSync::listLocal(const std::string& root, const std::string& relative, std::map<std::string, Entry>& entries,
+                        std::vector<std::string>& dirs, std::set<std::pair<dev_t, ino_t> >& visited)
+{
+    std::string dirPath = relative.empty() ? root : root + "/" + relative;
+    DIR * dir = opendir(dirPath.c_str());
+    if (!dir)
+    {
+        std::cerr << "Unable to read directory " << dirPath << std::endl;
+        return -1;
+    }
+    int err = 0;
+    struct dirent * item;
+    while ((item = readdir(dir)))
+    {
+        std::string name = item->d_name;
+        if (name == "." || name == "..")
+            continue;
+        if (name.size() > 12 && name.compare(name.size() - 12, 12, ".upload.json") == 0)
+            continue;
+        if ((name.size() > 5 && name.compare(name.size() - 5, 5, ".part") == 0)
+                || (name.size() > 10 && name.compare(name.size() - 10, 10, ".part.json") == 0))
+            continue;
+        std::string path = join(relative, name);
+        std::string localPath = root + "/" + path;
+        struct stat info;
+        if (stat(localPath.c_str(), &info) != 0)
+            continue;
+        if (S_ISDIR(info.st_mode))
+        {
+            // links are followed, but a directory reached twice (e.g. through a link cycle) is walked once
+            if (!visited.insert(std::make_pair(info.st_dev, info.st_ino)).second)
+            {
+                std::cerr << "Skipping " << localPath << ": directory already listed through another path" << std::endl;
+                continue;
+            }
+            dirs.push_back(path);
+            if (listLocal(root, path, entries, dirs, visited))
+                err = -1;
+        }
+        else if (S_ISREG(info.st_mode))
+        {
+            Entry& entry = entries[path];
+            entry.path = path;
+            entry.localPath = localPath;
+            entry.local = true;
+            entry.localSize = info.st_size;
+            entry.localMtime = info.st_mtime;
+        }
+    }
+    closedir(dir);
+    return err;
+}
+
+/* Creates the remote folders missing for dirs, shallowest first so that every
+    parent exists before its children; the folders of one level go out together
+    in batch requests. Returns how many folders were created. */
+std::size_t TreeSync::createFolders(const std::vector<std::string>& dirs, std::map<std::string, std::string>& folders)
+{
+    std::map<std::size_t, std::vector<std::string> > levels;
+    for (std::size_t i = 0; i < dirs.size(); i++)
+    {
+        if (!folders.count(dirs[i]))
+            levels[std::count(dirs[i].begin(), dirs[i].end(), '/')].push_back(dirs[i]);
+    }
+    std::size_t created = 0;
+    Json::FastWriter writer;
+    for (std::map<std::size_t, std::vector<std::string> >::iterator level = levels.begin(); level != levels.end(); ++level)
+    {
+        std::vector<std::string> paths;
+        std::vector<BatchRequest> requests;
+        for (std::size_t i = 0; i < level->second.size(); i++)
+        {
+            const std::string& path = level->second[i];
+            std::map<std::string, std::string>::iterator parent = folders.find(parentOf(path));
+            if (parent == folders.end())
+                continue; // its parent could not be created
+            Json::Value body;
+            body["name"] = baseName(path);
+            body["mimeType"] = folderType;
+            body["parents"].append(parent->second);
+            BatchRequest request;
+            request.method = "POST";
+            request.path = "/drive/v3/files?fields=id";
+            request.body = writer.write(body);
+            requests.push_back(request);
+            paths.push_back(path);
+        }
+        std::vector<BatchResult> results = drive->batch(requests);
+        for (std::size_t i = 0; i < results.size(); i++)
+        {
+            if (results[i].code == 200 && !results[i].body["id"].asString().empty())
+            {
+                folders[paths[i]] = results[i].body["id"].asString();
+                created++;
+            }
+            else
+                std::cerr << "Unable to create remote folder " << paths[i] << " (code " << results[i].code << ")" << std::endl;
+        }
+    }
+    return created;
+}
+
+/* Decides which files present on both sides need a transfer. Sizes are compared
+    first; only files of equal size are hashed, on the hashing threads. Files Drive
+    keeps no checksum for are compared by modification time instead.
+    Files stored compressed are compared through the size and MD5 of their original
+    content, which is what uploads read and downloads write, unless downloads are
+    left compressed. */
+void TreeSync::compare(std::vector<Entry *>& entries, bool upward)
+{
+    std::vector<Entry *> toHash;
+    for (std::size_t i = 0; i < entries.size(); i++)
+    {
+        Entry * entry = entries[i];
+        entry->expectedSize = entry->remoteFile.size;
+        entry->expectedMd5 = entry->remoteFile.md5Checksum;
+        long long originalSize;
+        std::string originalMd5;
+        if ((upward || drive->decompressing())
+                && GDConnect::compressedOriginal(entry->remoteFile, originalSize, originalMd5))
+        {
+            entry->expectedSize = originalSize;
+            entry->expectedMd5 = originalMd5;
+        }
+        if (entry->localSize != entry->expectedSize)
+            entry->transfer = true;
+        else if (!entry->expectedMd5.empty())
+            toHash.push_back(entry);
+        else
+        {
+            time_t remoteTime = parseTime(entry->remoteFile.modifiedTime);
+            entry->transfer = upward ? entry->localMtime > remoteTime : remoteTime > entry->localMtime;
+        }
+    }
+    parallel(toHash.size(), hashThreads, [&toHash](std::size_t i)
+    {
+        toHash[i]->transfer = Md5::ofFile(toHash[i]->localPath.c_str()) != toHash[i]->expectedMd5;
+    });
+}
+
+/* Function for mirroring localDir into the Drive folder remoteFolderId.
+    New files are created and changed files get new content, in place; remote
+    files with no local counterpart are left alone. */
+SyncStats TreeSync::syncUp(const char * localDir, const char * remoteFolderId)
+{
+    SyncStats stats = SyncStats();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::map<std::string, Entry> entries;
+    std::map<std::string, std::string> folders;
+    std::vector<std::string> dirs;
+    std::string root = localDir;
+    while (root.size() > 1 && root[root.size() - 1] == '/')
+        root.erase(root.size() - 1);
+
+    // the local walk runs while the remote tree is being listed
+    std::map<std::string, Entry> localEntries;
+    std::future<int> walk = std::async(std::launch::async, [this, &root, &localEntries, &dirs]()
+    {
+        std::set<std::pair<dev_t, ino_t> > visited;
+        struct stat info;
+        if (stat(root.c_str(), &info) == 0)
+            visited.insert(std::make_pair(info.st_dev, info.st_ino));
+        return listLocal(root, "", localEntries, dirs, visited);
+    });
+    int remoteErr = listRemote(remoteFolderId, entries, folders);
+    walk.get();
+    for (std::map<std::string, Entry>::iterator it = localEntries.begin(); it != localEntries.end(); ++it)
+    {
+        Entry& entry = entries[it->first];
+        entry.path = it->first;
+        entry.localPath = it->second.localPath;
+        entry.local = true;
+        entry.localSize = it->second.localSize;
+        entry.localMtime = it->second.localMtime;
+    }
+    if (remoteErr)
+        std::cerr << "Remote listing incomplete: files may be uploaded twice" << std::endl;
+
+    stats.foldersCreated = createFolders(dirs, folders);
+
+    std::vector<Entry *> both;
+    std::vector<Entry *> transfers;
+    for (std::map<std::string, Entry>::iterator it = entries.begin(); it != entries.end(); ++it)
+    {
+        Entry& entry = it->second;
+        if (!entry.local)
+            continue;
+        stats.scanned++;
+        if (!entry.remote)
+            entry.transfer = true;
+        else if (isGoogleType(entry.remoteFile.mimeType))
+            std::cerr << "Not overwriting Google document " << entry.path << std::endl;
+        else
+            both.push_back(&entry);
+    }
+    compare(both, true);
+    for (std::map<std::string, Entry>::iterator it = entries.begin(); it != entries.end(); ++it)
+    {
+        if (it->second.local && it->second.transfer)
+            transfers.push_back(&it->second);
+    }
+    stats.skipped = stats.scanned - transfers.size();
+
+    parallel(transfers.size(), maxTransfers, [this, &transfers, &folders](std::size_t i)
+    {
+        Entry * entry = transfers[i];
+        std::map<std::string, std::string>::const_iterator parent = folders.find(parentOf(entry->path));
+        if (parent == folders.end())
+            return;
+        UploadTarget target;
+        target.name = baseName(entry->path);
+        if (entry->remote)
+            target.fileId = entry->remoteFile.id;
+        else
+            target.parentId = parent->second;
+        entry->ok = drive->putFile(entry->localPath.c_str(), target).second == 0;
+    });
+    for (std::size_t i = 0; i < transfers.size(); i++)
+    {
+        if (transfers[i]->ok)
+        {
+            stats.transferred++;
+            stats.bytes += transfers[i]->localSize;
+        }
+        else
+            stats.failed++;
+    }
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    fprintf(stderr, "Uploaded %lu, skipped %lu, failed %lu of %lu files (%lu folders created): %"
+            CURL_FORMAT_CURL_OFF_T " bytes in %.3f seconds\n", (unsigned long) stats.transferred,
+            (unsigned long) stats.skipped, (unsigned long) stats.failed, (unsigned long) stats.scanned,
+            (unsigned long) stats.foldersCreated, stats.bytes, stats.seconds);
+    drive->getMetrics().span("syncUp", localDir, start, std::chrono::steady_clock::now());
+    return stats;
+}
+
+/* Function for mirroring the Drive folder remoteFolderId into localDir.
+    Missing directories are created; local files with no remote counterpart
+    are left alone. Google documents are skipped, having no binary content. */
+SyncStats TreeSync::syncDown(const char * remoteFolderId, const char * localDir)
+{
+    SyncStats stats = SyncStats();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::map<std::string, Entry> entries;
+    std::map<std::string, std::string> folders;
+    std::string root = localDir;
+    while (root.size() > 1 && root[root.size() - 1] == '/')
+        root.erase(root.size() - 1);
+
+    if (listRemote(remoteFolderId, entries, folders))
+        std::cerr << "Remote listing incomplete: some files will not be downloaded" << std::endl;
+
+    // folders come out of the map sorted, so parents are created before their children
+    mkdir(root.c_str(), 0755);
+    char * resolved = realpath(root.c_str(), NULL);
+    if (!resolved)
+    {
+        std::cerr << "Unable to use directory " << root << std::endl;
+        stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return stats;
+    }
+    std::string realRoot = resolved;
+    free(resolved);
+    for (std::map<std::string, std::string>::iterator it = folders.begin(); it != folders.end(); ++it)
+    {
+        if (it->first.empty())
+            continue;
+        std::string path = root + "/" + it->first;
+        if (!inside(realRoot, parentOf(path)))
+            std::cerr << "Not creating " << path << ": it would be outside " << root << std::endl;
+        else if (mkdir(path.c_str(), 0755) == 0)
+            stats.foldersCreated++;
+        else if (errno != EEXIST)
+            std::cerr << "Unable to create directory " << path << std::endl;
+    }
+
+    std::vector<Entry *> both;
+    std::vector<Entry *> transfers;
+    for (std::map<std::string, Entry>::iterator it = entries.begin(); it != entries.end(); ++it)
+    {
+        Entry& entry = it->second;
+        if (isGoogleType(entry.remoteFile.mimeType))
+            continue;
+        stats.scanned++;
+        entry.localPath = root + "/" + entry.path;
+        if (!inside(realRoot, parentOf(entry.localPath)))
+        {
+            std::cerr << "Not downloading " << entry.localPath << ": it would be outside " << root << std::endl;
+            stats.failed++;
+            continue;
+        }
+        struct stat info;
+        if (stat(entry.localPath.c_str(), &info) != 0)
+        {
+            entry.transfer = true;
+            continue;
+        }
+        entry.local = true;
+        entry.localSize = info.st_size;
+        entry.localMtime = info.st_mtime;
+        both.push_back(&entry);
+    }
+    compare(both, false);
+    for (std::map<std::string, Entry>::iterator it = entries.begin(); it != entries.end(); ++it)
+    {
+        if (it->second.transfer)
+            transfers.push_back(&it->second);
+    }
+    stats.skipped = stats.scanned - stats.failed - transfers.size(); // failed so far: outside the tree
+
+    parallel(transfers.size(), maxTransfers, [this, &transfers](std::size_t i)
+    {
+        Entry * entry = transfers[i];
+        int code = drive->getFileById(entry->remoteFile.id.c_str(), entry->localPath.c_str());
+        entry->ok = code >= 200 && code < 300;
+    });
+    for (std::size_t i = 0; i < transfers.size(); i++)
+    {
+        if (transfers[i]->ok)
+        {
+            stats.transferred++;
+            stats.bytes += transfers[i]->remoteFile.size;
+        }
+        else
+            stats.failed++;
+    }
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    fprintf(stderr, "Downloaded %lu, skipped %lu, failed %lu of %lu files (%lu directories created): %"
+            CURL_FORMAT_CURL_OFF_T " bytes in %.3f seconds\n", (unsigned long) stats.transferred,
+            (unsigned long) stats.skipped, (unsigned long) stats.failed, (unsigned long) stats.scanned,
+            (unsigned long) stats.foldersCreated, stats.bytes, stats.seconds);
+    drive->getMetrics().span("syncDown", localDir, start, std::chrono::steady_clock::now());
+    return stats;
+}